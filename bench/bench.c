@@ -0,0 +1,651 @@
+/*
+ * bench.c
+ * End to end throughput and latency suite for ssi.
+ *
+ * Generates workloads into a temporary directory, runs ssi on each
+ * of them and prints one "name value unit" line per metric, in a
+ * fixed order, so runs on different releases can be diffed.
+ *
+ * usage: ssibench [-r runs] [ssi]
+ */
+
+#define _GNU_SOURCE		/* mkdtemp(3) */
+
+#include <sys/resource.h>	/* struct rusage */
+#include <sys/wait.h>		/* waitpid(2), wait4(2) */
+
+#include <dirent.h>		/* opendir(3), readdir(3) */
+#include <err.h>		/* err(3), errx(3) */
+#include <errno.h>		/* errno */
+#include <fcntl.h>		/* open(2) */
+#include <limits.h>		/* PATH_MAX */
+#include <spawn.h>		/* posix_spawn(3) */
+#include <stdint.h>		/* uintptr_t */
+#include <stdio.h>		/* fopen(3), fprintf(3), printf(3) */
+#include <stdlib.h>		/* getenv(3), setenv(3), strtol(3) */
+#include <string.h>		/* strcmp(3), strcspn(3) */
+#include <time.h>		/* clock_gettime(2) */
+#include <unistd.h>		/* getopt(3), unlink(2), unlinkat(2) */
+				/* rmdir(2) */
+
+#define TRUE_CMDS	5000		/* Lines of "true" per run. */
+#define PARSE_ARGS	2000000		/* Arguments parsed per size. */
+#define LOOP_ITERS	2000		/* Iterations of the loop body. */
+#define CACHE_LINES	100000		/* Lines of the compiled script. */
+#define ZYGOTES		4		/* Zygote pool for bench_zygote(). */
+#define STARTS		200		/* Shells started per startup run. */
+
+/*
+ * Latency percentiles of one phase from ssistat -o, in nanoseconds.
+ */
+struct lat {
+	unsigned long long	 p50;
+	unsigned long long	 p90;
+	unsigned long long	 p99;
+	unsigned long long	 max;
+};
+
+static double		 now(void);
+static FILE		*gen_open(const char *);
+static void		 gen_close(FILE *, const char *);
+static double		 run(const char *, const char *, const char *);
+static double		 best(const char *, const char *, const char *);
+static int		 lat_read(const char *, const char *, struct lat *);
+static void		 lat_print(const char *, const struct lat *);
+static void		 bench_startup(void);
+static void		 start(const char *, long *);
+static void		 bench_true(const char *, const char *);
+static void		 bench_zygote(const char *, const char *);
+static void		 bench_parse(const char *);
+static void		 bench_bg(const char *);
+static void		 bench_loop(const char *);
+static void		 bench_cache(const char *);
+static void		 cache_clear(void);
+static const char	*bin_path(const char *);
+static void		 usage(void);
+
+extern char		**environ;
+
+static const char	*ssi = "./ssi";	/* Shell under test. */
+static int		 runs = 3;	/* Runs per workload; best kept. */
+static char		 dir[PATH_MAX - 16];	/* Workload directory. */
+
+int
+main(int argc, char *argv[])
+{
+	const char	*tmp;			/* $TMPDIR. */
+	char		 stat[PATH_MAX];	/* ssistat -o output. */
+	char		 script[PATH_MAX];	/* Generated script. */
+	char		*end;
+	int		 ch;
+
+	while ((ch = getopt(argc, argv, "r:")) != -1) {
+		switch (ch) {
+		case 'r':
+			runs = (int)strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || runs < 1) {
+				errx(1, "invalid runs: %s", optarg);
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1) {
+		usage();
+	}
+	if (argc == 1) {
+		ssi = argv[0];
+	}
+	if (access(ssi, X_OK) == -1) {
+		err(1, "%s", ssi);
+	}
+
+	if ((tmp = getenv("TMPDIR")) == NULL || *tmp == '\0') {
+		tmp = "/tmp";
+	}
+	snprintf(dir, sizeof(dir), "%s/ssibench.XXXXXX", tmp);
+	if (mkdtemp(dir) == NULL) {
+		err(1, "mkdtemp");
+	}
+	snprintf(stat, sizeof(stat), "%s/stat", dir);
+	snprintf(script, sizeof(script), "%s/script", dir);
+
+	/* Compiled scripts go in the workload directory too. */
+	if (setenv("XDG_CACHE_HOME", dir, 1) == -1) {
+		err(1, "setenv");
+	}
+
+	printf("# ssibench 1\n");
+	printf("# ssi %s\n", ssi);
+	printf("# runs %d\n", runs);
+
+	bench_startup();
+	bench_true(script, stat);
+	bench_zygote(script, stat);
+	bench_parse(script);
+	bench_bg(script);
+	bench_loop(script);
+	bench_cache(script);
+
+	cache_clear();
+	unlink(stat);
+	unlink(script);
+	if (rmdir(dir) == -1) {
+		warn("rmdir %s", dir);
+	}
+
+	return 0;
+}
+
+static double
+now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * Create the script file path for writing.
+ */
+static FILE *
+gen_open(const char *path)
+{
+	FILE	*fp;
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		err(1, "%s", path);
+	}
+
+	return fp;
+}
+
+static void
+gen_close(FILE *fp, const char *path)
+{
+	if (fclose(fp) == EOF) {
+		err(1, "%s", path);
+	}
+}
+
+/*
+ * Run ssi [flag] script with output discarded.
+ * Returns the wall clock time it took, in seconds.
+ */
+static double
+run(const char *flag, const char *script, const char *name)
+{
+	posix_spawn_file_actions_t	 fa;
+	char				*argv[4];
+	double				 t;
+	pid_t				 pid;
+	int				 i = 0;
+	int				 status;
+	int				 e;
+
+	argv[i++] = (char *)(uintptr_t)ssi;
+	if (flag != NULL) {
+		argv[i++] = (char *)(uintptr_t)flag;
+	}
+	argv[i++] = (char *)(uintptr_t)script;
+	argv[i] = NULL;
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+	    O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null",
+	    O_WRONLY, 0);
+
+	t = now();
+	if ((e = posix_spawn(&pid, ssi, &fa, NULL, argv, environ)) != 0) {
+		errno = e;
+		err(1, "%s", ssi);
+	}
+	if (waitpid(pid, &status, 0) == -1) {
+		err(1, "waitpid");
+	}
+	t = now() - t;
+
+	posix_spawn_file_actions_destroy(&fa);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "%s: ssi failed with status %#x", name, status);
+	}
+
+	return t;
+}
+
+/*
+ * Best (shortest) time of runs runs of ssi [flag] script.
+ */
+static double
+best(const char *flag, const char *script, const char *name)
+{
+	double	 min = 0;
+	double	 t;
+	int	 i;
+
+	for (i = 0; i < runs; i++) {
+		t = run(flag, script, name);
+		if (i == 0 || t < min) {
+			min = t;
+		}
+	}
+
+	return min;
+}
+
+/*
+ * Read the percentiles of phase from the ssistat -o file path.
+ */
+static int
+lat_read(const char *path, const char *phase, struct lat *l)
+{
+	FILE	*fp;
+	char	 line[512];
+	char	 name[32];
+	int	 found = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		err(1, "%s", path);
+	}
+	while (!found && fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "phase %31s count %*u sum %*u min %*u "
+		    "p50 %llu p90 %llu p99 %llu p999 %*u max %llu", name,
+		    &l->p50, &l->p90, &l->p99, &l->max) == 5 &&
+		    !strcmp(name, phase)) {
+			found = 1;
+		}
+	}
+	fclose(fp);
+
+	return found ? 0 : -1;
+}
+
+static void
+lat_print(const char *name, const struct lat *l)
+{
+	printf("%s.p50 %.1f us\n", name, (double)l->p50 / 1e3);
+	printf("%s.p90 %.1f us\n", name, (double)l->p90 / 1e3);
+	printf("%s.p99 %.1f us\n", name, (double)l->p99 / 1e3);
+	printf("%s.max %.1f us\n", name, (double)l->max / 1e3);
+}
+
+/*
+ * Time to start and exit ssi -c :, as every script does, and ssi
+ * reading commands from an empty standard input, which sets up the
+ * line editor; and the peak resident memory of each.
+ */
+static void
+bench_startup(void)
+{
+	static const char	*modes[][2] = {
+		{ "c", "-c" },
+		{ "stdin", NULL },
+	};
+	double			 min;
+	double			 t;
+	long			 rss;
+	size_t			 k;
+	int			 i;
+	int			 j;
+
+	for (k = 0; k < sizeof(modes) / sizeof(modes[0]); k++) {
+		min = 0;
+		rss = 0;
+		for (i = 0; i < runs; i++) {
+			t = now();
+			for (j = 0; j < STARTS; j++) {
+				start(modes[k][1], &rss);
+			}
+			t = now() - t;
+			if (i == 0 || t < min) {
+				min = t;
+			}
+		}
+		printf("startup.%s.time %.1f us\n", modes[k][0],
+		    min / STARTS * 1e6);
+		printf("startup.%s.rss %ld kB\n", modes[k][0], rss);
+	}
+}
+
+/*
+ * Run ssi -c : if flag is set, otherwise plain ssi, with standard
+ * input from /dev/null and output discarded. Raises *rss to its peak
+ * resident size in kB, if higher.
+ */
+static void
+start(const char *flag, long *rss)
+{
+	posix_spawn_file_actions_t	 fa;
+	struct rusage			 ru;
+	char				*argv[4];
+	pid_t				 pid;
+	int				 i = 0;
+	int				 status;
+	int				 e;
+
+	argv[i++] = (char *)(uintptr_t)ssi;
+	if (flag != NULL) {
+		argv[i++] = (char *)(uintptr_t)flag;
+		argv[i++] = (char *)(uintptr_t)":";
+	}
+	argv[i] = NULL;
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null",
+	    O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+	    O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null",
+	    O_WRONLY, 0);
+
+	if ((e = posix_spawn(&pid, ssi, &fa, NULL, argv, environ)) != 0) {
+		errno = e;
+		err(1, "%s", ssi);
+	}
+	if (wait4(pid, &status, 0, &ru) == -1) {
+		err(1, "wait4");
+	}
+
+	posix_spawn_file_actions_destroy(&fa);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "startup: ssi failed with status %#x", status);
+	}
+	if (ru.ru_maxrss > *rss) {
+		*rss = ru.ru_maxrss;
+	}
+}
+
+/*
+ * Commands per second running the external true(1), with
+ * posix_spawn(3) and with fork(2), and launch latency percentiles
+ * from ssistat.
+ */
+static void
+bench_true(const char *script, const char *stat)
+{
+	struct lat	 l;
+	const char	*path;
+	FILE		*fp;
+	double		 t;
+	int		 i;
+
+	path = bin_path("true");
+	fp = gen_open(script);
+	for (i = 0; i < TRUE_CMDS; i++) {
+		fprintf(fp, "%s\n", path);
+	}
+	fprintf(fp, "ssistat -o %s\n", stat);
+	gen_close(fp, script);
+
+	t = best(NULL, script, "true.spawn");
+	printf("true.spawn.rate %.1f cmds/s\n", TRUE_CMDS / t);
+	if (lat_read(stat, "spawn", &l) == 0) {
+		lat_print("launch.spawn", &l);
+	}
+	if (lat_read(stat, "wait", &l) == 0) {
+		lat_print("launch.exit", &l);
+	}
+
+	t = best("-f", script, "true.fork");
+	printf("true.fork.rate %.1f cmds/s\n", TRUE_CMDS / t);
+	if (lat_read(stat, "spawn", &l) == 0) {
+		lat_print("launch.fork", &l);
+	}
+}
+
+/*
+ * The same run of true(1) with a pool of zygotes, for the launch
+ * latency of sending a command to a process that already exists.
+ */
+static void
+bench_zygote(const char *script, const char *stat)
+{
+	struct lat	 l;
+	const char	*path;
+	FILE		*fp;
+	double		 t;
+	int		 i;
+
+	path = bin_path("true");
+	fp = gen_open(script);
+	fprintf(fp, "zygote %d\n", ZYGOTES);
+	for (i = 0; i < TRUE_CMDS; i++) {
+		fprintf(fp, "%s\n", path);
+	}
+	fprintf(fp, "ssistat -o %s\n", stat);
+	gen_close(fp, script);
+
+	t = best(NULL, script, "true.zygote");
+	printf("true.zygote.rate %.1f cmds/s\n", TRUE_CMDS / t);
+	if (lat_read(stat, "spawn", &l) == 0) {
+		lat_print("launch.zygote", &l);
+	}
+	if (lat_read(stat, "wait", &l) == 0) {
+		lat_print("launch.zygote.exit", &l);
+	}
+}
+
+/*
+ * Parse throughput of lines of 10 to 10k arguments, with ssi -n so
+ * nothing is run.
+ */
+static void
+bench_parse(const char *script)
+{
+	static const int	 sizes[] = { 10, 100, 1000, 10000 };
+	FILE			*fp;
+	double			 t;
+	size_t			 k;
+	long			 bytes;
+	int			 lines;
+	int			 i;
+	int			 j;
+
+	for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+		lines = PARSE_ARGS / sizes[k];
+
+		fp = gen_open(script);
+		for (i = 0; i < lines; i++) {
+			fputs("echo", fp);
+			for (j = 1; j < sizes[k]; j++) {
+				fprintf(fp, " arg%d", j);
+			}
+			fputc('\n', fp);
+		}
+		bytes = ftell(fp);
+		gen_close(fp, script);
+
+		t = best("-n", script, "parse");
+		printf("parse.%d.rate %.0f args/s\n", sizes[k],
+		    (double)lines * sizes[k] / t);
+		printf("parse.%d.bytes %.1f MB/s\n", sizes[k],
+		    (double)bytes / t / 1e6);
+	}
+}
+
+/*
+ * Cost of launching and reaping 1k and 10k background jobs.
+ */
+static void
+bench_bg(const char *script)
+{
+	static const int	 jobs[] = { 1000, 10000 };
+	const char		*path;
+	FILE			*fp;
+	double			 t;
+	size_t			 k;
+	int			 i;
+
+	path = bin_path("true");
+	for (k = 0; k < sizeof(jobs) / sizeof(jobs[0]); k++) {
+		fp = gen_open(script);
+		for (i = 0; i < jobs[k]; i++) {
+			fprintf(fp, "%s &\n", path);
+		}
+		fputs("wait\n", fp);
+		gen_close(fp, script);
+
+		t = best(NULL, script, "bg");
+		printf("bg.%d.total %.3f s\n", jobs[k], t);
+		printf("bg.%d.job %.1f us\n", jobs[k], t / jobs[k] * 1e6);
+	}
+}
+
+/*
+ * Commands per second of a loop body of true, echo, test and [, run
+ * as builtins and as the external commands of the same names, written
+ * out line after line, and of the builtins in a for loop, whose body
+ * is parsed once.
+ */
+static void
+bench_loop(const char *script)
+{
+	static const char	*body[][2] = {
+		{ "true", "" },
+		{ "echo", " loop body" },
+		{ "test", " 1 -lt 2" },
+		{ "[", " a = a ]" },
+	};
+	const size_t		 n = sizeof(body) / sizeof(body[0]);
+	FILE			*fp;
+	double			 t[2];
+	double			 tfor;
+	size_t			 k;
+	int			 ext;
+	int			 i;
+
+	for (ext = 0; ext < 2; ext++) {
+		fp = gen_open(script);
+		for (i = 0; i < LOOP_ITERS; i++) {
+			for (k = 0; k < n; k++) {
+				fprintf(fp, "%s%s\n", ext ?
+				    bin_path(body[k][0]) : body[k][0],
+				    body[k][1]);
+			}
+		}
+		gen_close(fp, script);
+
+		t[ext] = best(NULL, script, "loop");
+	}
+
+	fp = gen_open(script);
+	fputs("for i in", fp);
+	for (i = 0; i < LOOP_ITERS; i++) {
+		fprintf(fp, " %d", i);
+	}
+	fputs("; do\n", fp);
+	for (k = 0; k < n; k++) {
+		fprintf(fp, "\t%s%s\n", body[k][0], body[k][1]);
+	}
+	fputs("done\n", fp);
+	gen_close(fp, script);
+	tfor = best(NULL, script, "loop.for");
+
+	printf("loop.builtin.rate %.1f cmds/s\n", LOOP_ITERS * n / t[0]);
+	printf("loop.for.rate %.1f cmds/s\n", LOOP_ITERS * n / tfor);
+	printf("loop.external.rate %.1f cmds/s\n", LOOP_ITERS * n / t[1]);
+	printf("loop.speedup %.1f x\n", t[1] / t[0]);
+}
+
+/*
+ * Time to run a long script of builtins the first time, when it is
+ * parsed and compiled, and later, from its compiled form.
+ */
+static void
+bench_cache(const char *script)
+{
+	FILE	*fp;
+	double	 cold = 0;
+	double	 t;
+	int	 i;
+
+	fp = gen_open(script);
+	for (i = 0; i < CACHE_LINES; i++) {
+		fprintf(fp, ": arg1 \"arg 2\" arg3 'arg 4' arg5 arg6 arg7\n");
+	}
+	gen_close(fp, script);
+
+	for (i = 0; i < runs; i++) {
+		cache_clear();
+		t = run(NULL, script, "script.cold");
+		if (i == 0 || t < cold) {
+			cold = t;
+		}
+	}
+	t = best(NULL, script, "script.cached");
+
+	printf("script.cold %.1f ms\n", cold * 1e3);
+	printf("script.cached %.1f ms\n", t * 1e3);
+	printf("script.speedup %.1f x\n", cold / t);
+}
+
+/*
+ * Remove the compiled scripts that ssi left in the workload directory.
+ */
+static void
+cache_clear(void)
+{
+	char		 path[PATH_MAX];
+	DIR		*d;
+	struct dirent	*de;
+
+	snprintf(path, sizeof(path), "%s/ssi", dir);
+	if ((d = opendir(path)) == NULL) {
+		return;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] != '.') {
+			unlinkat(dirfd(d), de->d_name, 0);
+		}
+	}
+	closedir(d);
+	rmdir(path);
+}
+
+/*
+ * Full path of the external command name, from PATH, so that ssi
+ * runs it rather than its builtin of the same name.
+ */
+static const char *
+bin_path(const char *name)
+{
+	static char	 buf[PATH_MAX];
+	const char	*path;
+	const char	*p;
+	size_t		 len;
+
+	if ((path = getenv("PATH")) == NULL) {
+		path = "/usr/bin:/bin";
+	}
+	for (p = path; ; p += len + 1) {
+		len = strcspn(p, ":");
+		if (len > 0 && (size_t)snprintf(buf, sizeof(buf), "%.*s/%s",
+		    (int)len, p, name) < sizeof(buf) &&
+		    access(buf, X_OK) == 0) {
+			return buf;
+		}
+		if (p[len] == '\0') {
+			break;
+		}
+	}
+	errx(1, "%s: not found in PATH", name);
+}
+
+static void
+usage(void)
+{
+	extern char	*__progname;
+
+	(void)fprintf(stderr, "usage: %s [-r runs] [ssi]\n", __progname);
+
+	exit(1);
+}
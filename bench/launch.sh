@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# launch.sh
+# Compare external command launch throughput of ssi's posix_spawn(3)
+# path against the fork(2) + execvp(3) path (ssi -f).
+#
+# usage: launch.sh [ssi] [count]
+
+SSI=${1:-./ssi}
+N=${2:-2000}
+TRUE=${TRUE:-/bin/true}		# Full path, or ssi runs its builtin.
+
+now() {
+	date +%s.%N
+}
+
+run() {
+	awk -v n="$N" -v t="$TRUE" 'BEGIN { for (i = 0; i < n; i++) print t }' |
+	    "$SSI" "$@" >/dev/null 2>&1
+}
+
+bench() {
+	t0=$(now)
+	run "$@"
+	t1=$(now)
+	awk -v n="$N" -v t0="$t0" -v t1="$t1" -v m="$MODE" \
+	    'BEGIN { printf "%-6s %8d cmds %8.3f s %10.1f cmds/s\n",
+	    m, n, t1 - t0, n / (t1 - t0) }'
+}
+
+MODE=spawn bench
+MODE=fork bench -f
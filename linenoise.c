@@ -111,14 +111,30 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "linenoise.h"
 
 #define LINENOISE_DEFAULT_HISTORY_MAX_LEN 100
 #define LINENOISE_MAX_LINE 4096
+#define LINENOISE_HISTORY_SYNC_LINES 32 /* fdatasync() after this many, */
+#define LINENOISE_HISTORY_SYNC_SECS 5   /* or this long since the last. */
+#define LINENOISE_HISTORY_INDEX_STEP 256 /* Loaded entries hashed per add. */
+#define LINENOISE_SEARCH_BUCKETS (1<<16) /* Trigram posting lists. */
+#define LINENOISE_SEARCH_TRIGRAMS 8 /* Of the query, looked up at most. */
+#define LINENOISE_SEARCH_SKIP 64    /* Ids between skips. */
+#define LINENOISE_SEARCH_CHUNK 65536 /* Bytes of loaded lines searched
+                                        at a time. */
 static char *unsupported_term[] = {"dumb","cons25","emacs",NULL};
 static linenoiseCompletionCallback *completionCallback = NULL;
 static linenoiseHintsCallback *hintsCallback = NULL;
@@ -129,8 +145,90 @@ static int rawmode = 0; /* For atexit() function to check if restore is needed*/
 static int mlmode = 0;  /* Multi line mode. Default is single line. */
 static int atexit_registered = 0; /* Register atexit just 1 time. */
 static int history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
-static int history_len = 0;
-static char **history = NULL;
+
+/* The history is a ring of entries over an append-only arena of lines.
+ * Lines that fall off the ring, or that are added again and so move to
+ * the end, leave garbage in the arena that is compacted away once it
+ * outgrows the live lines. A hash set of the live lines finds the
+ * duplicates. The arena starts with the lines of the history file as
+ * loaded, in history_map, and goes on in history_buf. */
+struct historyEntry {
+    size_t off;         /* Offset of the line, see historyLine(). */
+    unsigned len:31;    /* Line length, without the newline. */
+    unsigned dead:1;    /* Added again later: skipped and not saved. */
+    unsigned hash;      /* historyHash() of the line. */
+    unsigned id;        /* Increasing with every entry, see historyPost(). */
+};
+
+/* The ids of the entries that have a trigram, for Ctrl-R to find lines
+ * by a substring without reading every line. Each trigram has two lists:
+ * ids added later, increasing, and loaded ones as historyIndex() gets to
+ * them, decreasing, older than all of the first. The lists keep the
+ * first and last id and in between the differences, in bytes of seven
+ * bits each, the high bit marking the last byte of a difference, so
+ * that they can be read both ways. Every LINENOISE_SEARCH_SKIP-th id is
+ * also kept with where it is in buf, to start reading the lists in the
+ * middle. */
+struct historySkip {
+    unsigned id;
+    unsigned pos;       /* Bytes of buf up to it. */
+};
+
+struct historyPostings {
+    unsigned char *buf; /* The differences. */
+    unsigned len;       /* Bytes used in buf. */
+    unsigned cap;       /* Bytes allocated. */
+    unsigned count;     /* Ids in the list. */
+    unsigned first;     /* The first id put. */
+    unsigned last;      /* The last id put. */
+    struct historySkip *skip;
+    unsigned nskip;     /* One per LINENOISE_SEARCH_SKIP ids, rounded up. */
+};
+
+/* Reads the ids of a trigram from the newest. */
+struct historyCursor {
+    struct historyPostings *p;  /* Its lists, added and loaded. */
+    int seg;            /* Which of them we are reading. */
+    unsigned n;         /* Ids of it read so far. */
+    unsigned pos;       /* Where we are in its buf. */
+    unsigned id;        /* The id read last, */
+    int valid;          /* if any. */
+};
+
+static struct historyEntry *history = NULL; /* Ring of history_cap. */
+static int history_cap = 0;     /* Entries allocated, up to max_len. */
+static int history_head = 0;    /* Ring slot of the oldest entry. */
+static int history_len = 0;     /* Entries in the ring, dead or not. */
+static int history_dead = 0;    /* Dead entries in the ring. */
+static char *history_map = NULL;    /* Lines of the file, from load. */
+static size_t history_map_size = 0;
+static char *history_buf = NULL;    /* Lines added since, each with a
+                                       newline like in the file. */
+static size_t history_buf_len = 0;  /* Bytes used in history_buf. */
+static size_t history_buf_size = 0; /* Bytes allocated. */
+static size_t history_bytes = 0;    /* Bytes of lines in the arena. */
+static size_t history_garbage = 0;  /* Bytes of lines no longer used. */
+static int *history_set = NULL; /* Ring slot + 1 of each live line. */
+static unsigned history_set_mask = 0;
+static int history_unindexed = 0;   /* Oldest entries not hashed and
+                                       indexed for search yet, */
+static int history_unsplit = 0;     /* of which not even split from the
+                                       map, */
+static size_t history_pending = 0;  /* whose lines are here in it. */
+static size_t history_pending_end = 0;
+static unsigned history_pending_id = 0; /* Id of the newest of them. */
+static unsigned history_next_id = 0;    /* Id of the next entry added. */
+static struct historyPostings *history_postings = NULL; /* Two a bucket. */
+static int history_postings_failed = 0; /* Out of memory: not indexed. */
+static size_t history_posts = 0;        /* Ids in the lists, */
+static size_t history_posts_live = 0;   /* of which for live entries. */
+static int history_new = 0;     /* Newest entries not in the file yet. */
+static int history_unsynced = 0;    /* Lines appended since fdatasync(). */
+static time_t history_synced_at = 0;
+static off_t history_file_off = 0;  /* File size after our last write. */
+static dev_t history_file_dev = 0;  /* And which file that was. */
+static ino_t history_file_ino = 0;
+static char history_saved[LINENOISE_MAX_LINE]; /* Line being typed. */
 
 /* The linenoiseState structure represents the state during line editing.
  * We pass this state to functions implementing specific editing
@@ -147,7 +245,8 @@ struct linenoiseState {
     size_t len;         /* Current edited line length. */
     size_t cols;        /* Number of columns in terminal. */
     size_t maxrows;     /* Maximum num of rows used so far (multiline mode) */
-    int history_index;  /* The history index we are currently editing. */
+    int history_index;  /* Entries back from the newest; 0 is the line
+                           being typed, kept in history_saved. */
 };
 
 enum KEY_ACTION{
@@ -158,6 +257,7 @@ enum KEY_ACTION{
 	CTRL_D = 4,         /* Ctrl-d */
 	CTRL_E = 5,         /* Ctrl-e */
 	CTRL_F = 6,         /* Ctrl-f */
+	CTRL_G = 7,         /* Ctrl-g */
 	CTRL_H = 8,         /* Ctrl-h */
 	TAB = 9,            /* Tab */
 	CTRL_K = 11,        /* Ctrl+k */
@@ -165,6 +265,7 @@ enum KEY_ACTION{
 	ENTER = 13,         /* Enter */
 	CTRL_N = 14,        /* Ctrl-n */
 	CTRL_P = 16,        /* Ctrl-p */
+	CTRL_R = 18,        /* Ctrl-r */
 	CTRL_T = 20,        /* Ctrl-t */
 	CTRL_U = 21,        /* Ctrl+u */
 	CTRL_W = 23,        /* Ctrl+w */
@@ -174,6 +275,20 @@ enum KEY_ACTION{
 
 static void linenoiseAtExit(void);
 int linenoiseHistoryAdd(const char *line);
+static struct historyEntry *historyAt(int back);
+static const char *historyLine(const struct historyEntry *e);
+static int historyScanBack(const char *map, const char *end, int max,
+    const char **startp);
+static void historyEntrySet(struct historyEntry *e, const char *base,
+    const char *line, const char *end);
+static void historySplit(int back);
+static void historyIndex(int back);
+static int historyLive(int back);
+static int historyAdd(const char *line, size_t len);
+static int historySearch(const char *q, size_t qlen, int from);
+static void historyUnpost(void);
+static const char *historyMatch(const char *line, size_t len,
+    const char *q, size_t qlen);
 static void refreshLine(struct linenoiseState *l);
 
 static void linenoiseEditMoveLeft(struct linenoiseState *l);
@@ -181,6 +296,7 @@ static void linenoiseEditMoveRight(struct linenoiseState *l);
 static void linenoiseEditMoveHome(struct linenoiseState *l);
 static void linenoiseEditMoveEnd(struct linenoiseState *l);
 static void linenoiseEditHistoryNext(struct linenoiseState *l, int dir);
+static int linenoiseEditSearch(struct linenoiseState *l);
 static void linenoiseEditDelete(struct linenoiseState *l);
 static void linenoiseEditBackspace(struct linenoiseState *l);
 static void linenoiseEditDeletePrevWord(struct linenoiseState *l);
@@ -684,25 +800,115 @@ void linenoiseEditMoveEnd(struct linenoiseState *l) {
 #define LINENOISE_HISTORY_NEXT 0
 #define LINENOISE_HISTORY_PREV 1
 void linenoiseEditHistoryNext(struct linenoiseState *l, int dir) {
-    if (history_len > 1) {
-        /* Update the current history entry before to
-         * overwrite it with the next one. */
-        free(history[history_len - 1 - l->history_index]);
-        history[history_len - 1 - l->history_index] = strdup(l->buf);
-        /* Show the new entry */
-        l->history_index += (dir == LINENOISE_HISTORY_PREV) ? 1 : -1;
-        if (l->history_index < 0) {
-            l->history_index = 0;
-            return;
-        } else if (l->history_index >= history_len) {
-            l->history_index = history_len-1;
-            return;
-        }
-        strncpy(l->buf,history[history_len - 1 - l->history_index],l->buflen);
-        l->buf[l->buflen-1] = '\0';
-        l->len = l->pos = strlen(l->buf);
+    struct historyEntry *e = NULL;
+    int i = l->history_index;
+    size_t len;
+
+    /* Step over the dead entries, which were added again later. */
+    do {
+        i += (dir == LINENOISE_HISTORY_PREV) ? 1 : -1;
+        if (i < 0 || i > history_len) return;
+        historySplit(i);
+    } while (i > 0 && !historyLive(i));
+    if (i > 0) e = historyAt(i);
+
+    /* Keep the line being typed, to come back to it. */
+    if (l->history_index == 0) {
+        memcpy(history_saved,l->buf,l->len+1);
+    }
+    l->history_index = i;
+    if (i == 0) {
+        len = strlen(history_saved);
+        memcpy(l->buf,history_saved,len+1);
+    } else {
+        len = e->len < l->buflen ? e->len : l->buflen;
+        memcpy(l->buf,historyLine(e),len);
+        l->buf[len] = '\0';
+    }
+    l->len = l->pos = len;
+    refreshLine(l);
+}
+
+/* Search the history back for what the user types, showing the newest
+ * line that has it, as the user types it. Ctrl-R goes on to older lines,
+ * Ctrl-G puts back the line as it was. Like completeLine(), returns the
+ * key that ended the search, which is then handled as usual, 0 if
+ * there is none, or -1 on read errors. */
+static int linenoiseEditSearch(struct linenoiseState *l) {
+    static char last[LINENOISE_MAX_LINE]; /* Query of the last search. */
+    char query[LINENOISE_MAX_LINE], prompt[LINENOISE_MAX_LINE+32];
+    char orig[LINENOISE_MAX_LINE];
+    const char *oldprompt = l->prompt, *m;
+    struct historyEntry *e;
+    size_t oldplen = l->plen, qlen = 0, len;
+    int back = 0, found = 0, failed = 0, index = l->history_index;
+    char c;
+
+    /* Keep the line being typed, to come back to it. */
+    len = l->len < sizeof(orig)-1 ? l->len : sizeof(orig)-1;
+    memcpy(orig,l->buf,len);
+    orig[len] = '\0';
+    if (l->history_index == 0) memcpy(history_saved,orig,len+1);
+    query[0] = '\0';
+
+    while(1) {
+        snprintf(prompt,sizeof(prompt),"(%sreverse-i-search)`%s': ",
+            failed ? "failed " : "",query);
+        l->prompt = prompt;
+        l->plen = strlen(prompt);
         refreshLine(l);
+
+        if (read(l->ifd,&c,1) <= 0) {
+            c = -1;
+            break;
+        }
+        if (c == CTRL_R) {
+            /* Older, or the last search again. */
+            if (qlen == 0) {
+                qlen = strlen(last);
+                memcpy(query,last,qlen+1);
+            }
+            found = historySearch(query,qlen,back);
+        } else if (c == BACKSPACE || c == CTRL_H) {
+            if (qlen > 0) query[--qlen] = '\0';
+            found = historySearch(query,qlen,back > 0 ? back-1 : 0);
+        } else if (c == CTRL_G) {
+            len = strlen(orig);
+            memcpy(l->buf,orig,len+1);
+            l->len = l->pos = len;
+            back = 0;
+            l->history_index = index;
+            c = 0;
+            break;
+        } else if ((unsigned char)c >= ' ' && c != BACKSPACE) {
+            if (qlen+1 < sizeof(query)) {
+                query[qlen++] = c;
+                query[qlen] = '\0';
+            }
+            found = historySearch(query,qlen,back > 0 ? back-1 : 0);
+        } else {
+            break;
+        }
+
+        /* On a miss, keep showing the last match. */
+        failed = found == 0;
+        if (found == 0) continue;
+        back = found;
+        e = historyAt(back);
+        len = e->len < l->buflen ? e->len : l->buflen;
+        memcpy(l->buf,historyLine(e),len);
+        l->buf[len] = '\0';
+        l->len = len;
+        m = historyMatch(l->buf,len,query,qlen);
+        l->pos = m ? (size_t)(m-l->buf) : len;
     }
+
+    if (qlen > 0) memcpy(last,query,qlen+1);
+    if (back > 0) l->history_index = back;
+    l->prompt = oldprompt;
+    l->plen = oldplen;
+    refreshLine(l);
+    return c;
 }
 
 /* Delete the character at the right of the cursor without altering the cursor
@@ -773,10 +979,6 @@ static int linenoiseEdit(int stdin_fd, int stdout_fd, char *buf, size_t buflen,
     l.buf[0] = '\0';
     l.buflen--; /* Make sure there is always space for the nulterm */
 
-    /* The latest history entry is always our current buffer, that
-     * initially is just an empty string. */
-    linenoiseHistoryAdd("");
-
     if (write(l.ofd,prompt,l.plen) == -1) return -1;
     while(1) {
         char c;
@@ -786,6 +988,14 @@ static int linenoiseEdit(int stdin_fd, int stdout_fd, char *buf, size_t buflen,
         nread = read(l.ifd,&c,1);
         if (nread <= 0) return l.len;
 
+        /* Ctrl-R searches the history until another key, which is then
+         * handled as usual, also by completion. */
+        if (c == CTRL_R) {
+            c = linenoiseEditSearch(&l);
+            if (c < 0) return l.len;
+            if (c == 0) continue;
+        }
+
         /* Only autocomplete when the callback is set. It returns < 0 when
          * there was an error reading from fd. Otherwise it will return the
          * character that should be handled next. */
@@ -799,8 +1009,6 @@ static int linenoiseEdit(int stdin_fd, int stdout_fd, char *buf, size_t buflen,
 
         switch(c) {
         case ENTER:    /* enter */
-            history_len--;
-            free(history[history_len]);
             if (mlmode) linenoiseEditMoveEnd(&l);
             if (hintsCallback) {
                 /* Force a refresh without hints to leave the previous
@@ -823,8 +1031,6 @@ static int linenoiseEdit(int stdin_fd, int stdout_fd, char *buf, size_t buflen,
             if (l.len > 0) {
                 linenoiseEditDelete(&l);
             } else {
-                history_len--;
-                free(history[history_len]);
                 return -1;
             }
             break;
@@ -1063,54 +1269,635 @@ void linenoiseFree(void *ptr) {
 /* Free the history, but does not reset it. Only used when we have to
  * exit() to avoid memory leaks are reported by valgrind & co. */
 static void freeHistory(void) {
-    if (history) {
-        int j;
-
-        for (j = 0; j < history_len; j++)
-            free(history[j]);
-        free(history);
-    }
+    free(history);
+    free(history_buf);
+    free(history_set);
+    free(history_map);
 }
 
 /* At exit we'll try to fix the terminal to the initial conditions. */
 static void linenoiseAtExit(void) {
     disableRawMode(STDIN_FILENO);
     freeHistory();
+    historyUnpost();
 }
 
-/* This is the API call to add a new entry in the linenoise history.
- * It uses a fixed array of char pointers that are shifted (memmoved)
- * when the history max length is reached in order to remove the older
- * entry and make room for the new one, so it is not exactly suitable for huge
- * histories, but will work well for a few hundred of entries.
+/* FNV-1a hash of the len bytes of line. */
+static unsigned historyHash(const char *line, size_t len) {
+    unsigned h = 2166136261u;
+    size_t j;
+
+    for (j = 0; j < len; j++)
+        h = (h ^ (unsigned char)line[j]) * 16777619u;
+    return h;
+}
+
+/* The entry 'back' entries back from the newest, which is 1. */
+static struct historyEntry *historyAt(int back) {
+    return &history[(history_head+history_len-back) % history_cap];
+}
+
+/* The text of entry e. The first history_map_size offsets are in the
+ * lines loaded from the history file, the rest in history_buf. */
+static const char *historyLine(const struct historyEntry *e) {
+    if (e->off < history_map_size) return history_map+e->off;
+    return history_buf+(e->off-history_map_size);
+}
+
+/* Return the ring slot of the live entry equal to line, or -1. */
+static int historyFind(const char *line, size_t len, unsigned h) {
+    unsigned j = h & history_set_mask;
+    struct historyEntry *e;
+
+    while (history_set[j]) {
+        e = &history[history_set[j]-1];
+        if (e->hash == h && e->len == len &&
+            !memcmp(historyLine(e),line,len)) return history_set[j]-1;
+        j = (j+1) & history_set_mask;
+    }
+    return -1;
+}
+
+static void historySetInsert(int slot) {
+    unsigned j = history[slot].hash & history_set_mask;
+
+    while (history_set[j]) j = (j+1) & history_set_mask;
+    history_set[j] = slot+1;
+}
+
+/* Entries a line is in the search index for, counting as if all its
+ * trigrams were different. */
+static size_t historyTrigrams(const struct historyEntry *e) {
+    return e->len > 2 ? e->len-2 : 0;
+}
+
+/* The bucket of the trigram at s. */
+static unsigned historyTrigram(const char *s) {
+    const unsigned char *u = (const unsigned char *)s;
+
+    return ((u[0] | u[1] << 8 | (unsigned)u[2] << 16) * 2654435761u) >> 16;
+}
+
+/* Append id to the list p. Returns -1 out of memory. */
+static int historyPostingsPut(struct historyPostings *p, unsigned id) {
+    unsigned char tmp[5];
+    unsigned delta;
+    int n = 1;
+
+    if (p->count > 0 && p->last == id) return 0; /* Twice in a line. */
+    if (p->count % LINENOISE_SEARCH_SKIP == 0 &&
+        (p->nskip & (p->nskip-1)) == 0) {
+        /* Grow the skips at powers of two. */
+        struct historySkip *skip = realloc(p->skip,
+            sizeof(*skip)*(p->nskip ? p->nskip*2 : 1));
+
+        if (skip == NULL) return -1;
+        p->skip = skip;
+    }
+    if (p->count == 0) {
+        p->first = id;
+    } else {
+        delta = p->last > id ? p->last-id : id-p->last;
+        tmp[4] = 0x80 | (delta & 0x7f);
+        while ((delta >>= 7) != 0) tmp[4-n++] = delta & 0x7f;
+        if (p->len+n > p->cap) {
+            unsigned cap = p->cap ? p->cap*2 : 16;
+            unsigned char *buf = realloc(p->buf,cap);
+
+            if (buf == NULL) return -1;
+            p->buf = buf;
+            p->cap = cap;
+        }
+        memcpy(p->buf+p->len,tmp+5-n,n);
+        p->len += n;
+    }
+    if (p->count++ % LINENOISE_SEARCH_SKIP == 0) {
+        p->skip[p->nskip].id = id;
+        p->skip[p->nskip++].pos = p->len;
+    }
+    p->last = id;
+    return 0;
+}
+
+/* Drop the search index. */
+static void historyUnpost(void) {
+    int j;
+
+    if (history_postings != NULL) {
+        for (j = 0; j < LINENOISE_SEARCH_BUCKETS*2; j++) {
+            free(history_postings[j].buf);
+            free(history_postings[j].skip);
+        }
+        free(history_postings);
+        history_postings = NULL;
+    }
+    history_postings_failed = 0;
+    history_posts = history_posts_live = 0;
+}
+
+/* Add entry e to the search index, to the lists of loaded entries if
+ * 'loaded' is set. Out of memory, the index is dropped and Ctrl-R
+ * reads every line instead, until historyRepost(). */
+static void historyPost(const struct historyEntry *e, int loaded) {
+    const char *line = historyLine(e);
+    unsigned j;
+
+    if (e->len < 3 || history_postings_failed) return;
+    if (history_postings == NULL && (history_postings = calloc(
+        LINENOISE_SEARCH_BUCKETS*2,sizeof(*history_postings))) == NULL) {
+        history_postings_failed = 1;
+        return;
+    }
+    for (j = 0; j+2 < e->len; j++) {
+        if (historyPostingsPut(&history_postings[historyTrigram(line+j)*2+
+            loaded],e->id) == -1) {
+            historyUnpost();
+            history_postings_failed = 1;
+            return;
+        }
+    }
+    history_posts += historyTrigrams(e);
+    history_posts_live += historyTrigrams(e);
+}
+
+/* Build the search index again from the live entries, oldest first. */
+static void historyRepost(void) {
+    struct historyEntry *e;
+    int i;
+
+    historyUnpost();
+    for (i = history_len-history_unindexed; i > 0; i--) {
+        e = historyAt(i);
+        if (!e->dead) historyPost(e,0);
+    }
+}
+
+/* Move c to the next id of its trigram, from the newest. Returns 0 if
+ * there is none, for now: historyIndex() may put more. */
+static int historyCursorNext(struct historyCursor *c) {
+    const struct historyPostings *p = &c->p[c->seg];
+    unsigned delta = 0, shift = 0;
+    unsigned char b;
+
+    if (c->seg == 0) {
+        /* Added entries: from the last id, reading the buffer back. */
+        if (c->n == p->count) {
+            c->seg = 1;
+            c->n = 0;
+            c->pos = 0;
+            return historyCursorNext(c);
+        }
+        if (c->n++ == 0) {
+            c->id = p->last;
+            c->pos = p->len;
+        } else {
+            do {
+                b = p->buf[--c->pos];
+                delta |= (unsigned)(b & 0x7f) << shift;
+                shift += 7;
+            } while (c->pos > 0 && !(p->buf[c->pos-1] & 0x80));
+            c->id -= delta;
+        }
+    } else {
+        /* Loaded entries: from the first id, reading it forward. */
+        if (c->n == p->count) return 0;
+        if (c->n++ == 0) {
+            c->id = p->first;
+        } else {
+            do {
+                b = p->buf[c->pos++];
+                delta = delta << 7 | (b & 0x7f);
+            } while (!(b & 0x80));
+            c->id -= delta;
+        }
+    }
+    c->valid = 1;
+    return 1;
+}
+
+/* Move c on to about where the ids below 'below' start, using the
+ * skips, so that historyCursorNext() gets to them in a few steps. */
+static void historyCursorSeek(struct historyCursor *c, unsigned below) {
+    struct historyPostings *p = &c->p[0];
+    int lo = 0, hi = p->nskip-1, mid, k = -1;
+
+    if (p->count > 0 && p->first < below) {
+        /* In the added ids, increasing: the first skip not below. */
+        while (lo <= hi) {
+            mid = lo+(hi-lo)/2;
+            if (p->skip[mid].id >= below) {
+                k = mid;
+                hi = mid-1;
+            } else {
+                lo = mid+1;
+            }
+        }
+        if (k == -1) return; /* Near the end anyway. */
+        c->n = p->count-k*LINENOISE_SEARCH_SKIP;
+    } else {
+        /* In the loaded ids, decreasing: the last skip not below. */
+        p = &c->p[1];
+        c->seg = 1;
+        c->n = 0;
+        c->pos = 0;
+        if (p->count == 0 || p->first < below) return;
+        hi = p->nskip-1;
+        while (lo <= hi) {
+            mid = lo+(hi-lo)/2;
+            if (p->skip[mid].id >= below) {
+                k = mid;
+                lo = mid+1;
+            } else {
+                hi = mid-1;
+            }
+        }
+        c->n = k*LINENOISE_SEARCH_SKIP+1;
+    }
+    c->pos = p->skip[k].pos;
+    c->id = p->skip[k].id;
+    c->valid = 1;
+}
+
+/* Return how far back from the newest the indexed entry with the given
+ * id is, or 0 if it is gone. */
+static int historyBack(unsigned id) {
+    int lo = 1, hi = history_len-history_unindexed, mid;
+    unsigned cur;
+
+    while (lo <= hi) {
+        mid = lo+(hi-lo)/2;
+        cur = historyAt(mid)->id;
+        if (cur == id) return mid;
+        if (cur > id) lo = mid+1;
+        else hi = mid-1;
+    }
+    return 0;
+}
+
+/* Find q in the len bytes of line. */
+static const char *historyMatch(const char *line, size_t len,
+    const char *q, size_t qlen)
+{
+    const char *p;
+
+    if (qlen == 0) return line;
+    while (len >= qlen && (p = memchr(line,q[0],len-qlen+1)) != NULL) {
+        if (!memcmp(p,q,qlen)) return p;
+        len -= p+1-line;
+        line = p+1;
+    }
+    return NULL;
+}
+
+/* Like historySearch(), in the loaded entries that are not indexed yet,
+ * all older than the indexed ones. Those already split are read one by
+ * one. The text of the others is searched as it was loaded, from the
+ * end, and only the entries down to a match are then split. */
+static int historySearchLoaded(const char *q, size_t qlen, int from) {
+    const char *lo, *hi, *start, *end, *m, *last, *p;
+    struct historyEntry *e;
+    int back;
+
+    back = history_len-history_unindexed;
+    for (back = from > back ? from+1 : back+1;
+         back <= history_len-history_unsplit; back++) {
+        e = historyAt(back);
+        if (historyMatch(historyLine(e),e->len,q,qlen) && historyLive(back))
+            return back;
+    }
+
+    while (history_unsplit > 0) {
+        lo = history_map+history_pending;
+        hi = history_map+history_pending_end;
+        last = qlen == 0 ? hi : NULL;
+        for (start = hi; last == NULL && start > lo;) {
+            /* Overlap the chunk after by a query, less a byte. */
+            end = (size_t)(hi-start) > qlen-1 ? start+qlen-1 : hi;
+            start = start-lo > LINENOISE_SEARCH_CHUNK ?
+                start-LINENOISE_SEARCH_CHUNK : lo;
+            for (m = start; (m = historyMatch(m,end-m,q,qlen)) != NULL; m++)
+                last = m;
+        }
+        if (last == NULL) return 0;
+
+        back = history_len-history_unsplit+1;
+        for (p = last; (p = memchr(p,'\n',hi-p)) != NULL; p++) back++;
+        historySplit(back);
+        if (historyLive(back)) return back;
+    }
+    return 0;
+}
+
+/* Return how far back from the newest the newest entry further back
+ * than 'from' with q in it is, or 0 if there is none.
  *
- * Using a circular buffer is smarter, but a bit more complex to handle. */
+ * The ids of the trigram of q that is in the fewest entries are read
+ * from the newest, each checked against the ids of the other trigrams,
+ * which only ever move on to older ones, and then against the line
+ * itself: so a search costs about as much as the rarest trigram of q
+ * is common. Queries of less than three bytes read every line. */
+static int historySearch(const char *q, size_t qlen, int from) {
+    struct historyCursor cur[LINENOISE_SEARCH_TRIGRAMS], *c, *d;
+    struct historyPostings *p;
+    struct historyEntry *e;
+    unsigned below, id;
+    int n = 0, i, back;
+    size_t j;
+
+    /* As on every add, index some more of the loaded entries. */
+    historyIndex(history_len-history_unindexed+LINENOISE_HISTORY_INDEX_STEP);
+    if (qlen < 3 || history_postings_failed || history_postings == NULL) {
+        for (back = from+1; back <= history_len-history_unindexed; back++) {
+            e = historyAt(back);
+            if (!e->dead && historyMatch(historyLine(e),e->len,q,qlen))
+                return back;
+        }
+        return historySearchLoaded(q,qlen,from);
+    }
+
+    for (j = 0; j+2 < qlen && n < LINENOISE_SEARCH_TRIGRAMS; j++) {
+        p = &history_postings[historyTrigram(q+j)*2];
+        for (i = 0; i < n && cur[i].p != p; i++);
+        if (i < n) continue;
+        memset(&cur[n],0,sizeof(cur[n]));
+        cur[n++].p = p;
+    }
+    d = &cur[0];
+    for (i = 1; i < n; i++) {
+        if (cur[i].p[0].count+cur[i].p[1].count <
+            d->p[0].count+d->p[1].count) d = &cur[i];
+    }
+
+    below = from > 0 ? historyAt(from)->id : UINT_MAX;
+    for (i = 0; i < n; i++) historyCursorSeek(&cur[i],below);
+    while (1) {
+        if (!historyCursorNext(d)) return historySearchLoaded(q,qlen,from);
+        if ((id = d->id) >= below) continue;
+
+        for (i = 0; i < n; i++) {
+            c = &cur[i];
+            while (!(c->valid && c->id <= id) && historyCursorNext(c));
+            if (!c->valid || c->id != id) break;
+        }
+        if (i < n || (back = historyBack(id)) == 0) continue;
+        e = historyAt(back);
+        if (!e->dead && historyMatch(historyLine(e),e->len,q,qlen))
+            return back;
+    }
+}
+
+/* Split the lines loaded by linenoiseHistoryLoad() into entries, up to
+ * 'back' entries back from the newest. */
+static void historySplit(int back) {
+    struct historyEntry *e;
+    const char *start, *end;
+    int i;
+
+    for (i = history_len-history_unsplit+1;
+         i <= back && history_unsplit > 0; i++) {
+        end = history_map+history_pending_end;
+        historyScanBack(history_map+history_pending,end,1,&start);
+        e = historyAt(i);
+        historyEntrySet(e,history_map,start,end);
+        e->id = history_pending_id--;
+        history_pending_end = start > history_map+history_pending ?
+            (size_t)(start-history_map-1) : history_pending;
+        history_unsplit--;
+    }
+}
+
+/* Hash the entries loaded by linenoiseHistoryLoad(), up to 'back'
+ * entries back from the newest, and add them to the set and the search
+ * index. It is put off so as not to delay startup, and done newest
+ * first, so that of lines loaded more than once only the newest is kept
+ * alive. */
+static void historyIndex(int back) {
+    struct historyEntry *e;
+    int i;
+
+    historySplit(back);
+    for (i = history_len-history_unindexed+1;
+         i <= back && history_unindexed > 0; i++) {
+        e = historyAt(i);
+        history_unindexed--;
+        e->hash = historyHash(historyLine(e),e->len);
+        if (historyFind(historyLine(e),e->len,e->hash) != -1) {
+            e->dead = 1;
+            history_dead++;
+            history_garbage += e->len+1;
+        } else {
+            historySetInsert(e-history);
+            historyPost(e,1);
+        }
+    }
+}
+
+/* Whether the entry 'back' entries back, which must be split, is not
+ * dead. For one not hashed yet, it is dead if a newer one that is has
+ * the same line: one only the same as other entries not hashed yet is
+ * taken as live until then. */
+static int historyLive(int back) {
+    struct historyEntry *e = historyAt(back);
+
+    if (back <= history_len-history_unindexed) return !e->dead;
+    return historyFind(historyLine(e),e->len,
+        historyHash(historyLine(e),e->len)) == -1;
+}
+
+/* Remove ring slot 'slot' from the set, shifting back the entries
+ * after it that would no longer be found past the hole. */
+static void historySetDelete(int slot) {
+    unsigned j = history[slot].hash & history_set_mask;
+    unsigned k, home;
+
+    while (history_set[j] != slot+1) j = (j+1) & history_set_mask;
+    for (k = (j+1) & history_set_mask; history_set[k];
+         k = (k+1) & history_set_mask) {
+        home = history[history_set[k]-1].hash & history_set_mask;
+        /* Can the entry at k move back to the hole at j? */
+        if (((k-home) & history_set_mask) >= ((k-j) & history_set_mask)) {
+            history_set[j] = history_set[k];
+            j = k;
+        }
+    }
+    history_set[j] = 0;
+}
+
+/* Rebuild the history with room for cap entries, keeping the newest
+ * cap live ones and dropping the dead entries and the garbage of the
+ * arena, and so the loaded lines too. Returns -1 out of memory, leaving
+ * the history as it was. */
+static int historyRebuild(int cap) {
+    struct historyEntry *ring, *e;
+    char *buf;
+    int *set;
+    size_t size = 0, off = 0;
+    unsigned mask;
+    int keep = 0, i, j;
+
+    historyIndex(history_len);
+    for (i = 1; i <= history_len && keep < cap; i++) {
+        e = historyAt(i);
+        if (e->dead) {
+            if (i <= history_new) history_new--;
+            continue;
+        }
+        size += e->len+1;
+        keep++;
+    }
+    if (history_new > keep) history_new = keep;
+    for (mask = 1; mask < (unsigned)cap*2; mask <<= 1);
+    size = size*2 > 4096 ? size*2 : 4096; /* Room to grow. */
+    ring = malloc(sizeof(*ring)*cap);
+    buf = malloc(size);
+    set = calloc(mask,sizeof(*set));
+    if (ring == NULL || buf == NULL || set == NULL) {
+        free(ring);
+        free(buf);
+        free(set);
+        return -1;
+    }
+
+    /* Copy oldest first, so that the arena stays in order. */
+    for (j = 0; i > 1; i--) {
+        e = historyAt(i-1);
+        if (e->dead) continue;
+        ring[j] = *e;
+        ring[j].off = off;
+        memcpy(buf+off,historyLine(e),e->len);
+        buf[off+e->len] = '\n';
+        off += e->len+1;
+        j++;
+    }
+
+    freeHistory();
+    history = ring;
+    history_cap = cap;
+    history_head = 0;
+    history_len = keep;
+    history_dead = 0;
+    history_map = NULL;
+    history_map_size = 0;
+    history_buf = buf;
+    history_buf_len = off;
+    history_buf_size = size;
+    history_bytes = off;
+    history_garbage = 0;
+    history_set = set;
+    history_set_mask = mask-1;
+    history_posts_live = 0;
+    for (i = 0; i < keep; i++) {
+        historySetInsert(i);
+        history_posts_live += historyTrigrams(&ring[i]);
+    }
+    return 0;
+}
+
+/* This is the API call to add a new entry in the linenoise history.
+ * The line is appended to the arena and takes the next slot of the
+ * ring, dropping the oldest entry if the history is full, so adding
+ * takes constant time however long the history is. A line already in
+ * the history moves to the end instead of being added twice.
+ * Lines added here are the ones linenoiseHistoryAppend() writes. */
 int linenoiseHistoryAdd(const char *line) {
-    char *linecopy;
+    if (!historyAdd(line,strlen(line))) return 0;
+    history_new++;
+    return 1;
+}
+
+/* Add the len bytes at line to the history. Returns 1 if it was added. */
+static int historyAdd(const char *line, size_t len) {
+    struct historyEntry *e;
+    unsigned h = historyHash(line,len);
+    int slot;
 
     if (history_max_len == 0) return 0;
 
     /* Initialization on first call. */
-    if (history == NULL) {
-        history = malloc(sizeof(char*)*history_max_len);
-        if (history == NULL) return 0;
-        memset(history,0,(sizeof(char*)*history_max_len));
-    }
-
-    /* Don't add duplicated lines. */
-    if (history_len && !strcmp(history[history_len-1], line)) return 0;
-
-    /* Add an heap allocated copy of the line in the history.
-     * If we reached the max length, remove the older line. */
-    linecopy = strdup(line);
-    if (!linecopy) return 0;
-    if (history_len == history_max_len) {
-        free(history[0]);
-        memmove(history,history+1,sizeof(char*)*(history_max_len-1));
+    if (history == NULL && historyRebuild(16 < history_max_len ?
+        16 : history_max_len) == -1) return 0;
+    historyIndex(history_len-history_unindexed+LINENOISE_HISTORY_INDEX_STEP);
+
+    /* Don't add duplicated lines: the old copy is left dead instead. */
+    if ((slot = historyFind(line,len,h)) != -1) {
+        if (historyAt(1) == &history[slot]) return 0;
+        historySetDelete(slot);
+        history[slot].dead = 1;
+        history_dead++;
+        history_garbage += len+1;
+        history_posts_live -= historyTrigrams(&history[slot]);
+    }
+
+    /* Make room: grow the ring up to the max length, then drop dead
+     * entries once they are many, then the oldest entry. */
+    if (history_len == history_cap) {
+        if (history_cap < history_max_len) {
+            historyRebuild(history_cap*2 < history_max_len ?
+                history_cap*2 : history_max_len);
+        } else if (history_dead > history_cap/4) {
+            historyRebuild(history_cap);
+        }
+    }
+    if (history_len == history_cap) {
+        e = &history[history_head];
+        if (history_unsplit > 0) {
+            /* Not split yet: just step over its loaded line. */
+            const char *p = history_map+history_pending;
+            const char *nl = memchr(p,'\n',history_pending_end-
+                history_pending);
+
+            p = nl ? nl+1 : history_map+history_pending_end;
+            history_garbage += p-(history_map+history_pending);
+            history_pending = p-history_map;
+            history_unsplit--;
+            history_unindexed--;
+        } else if (history_unindexed > 0) {
+            history_garbage += e->len+1;
+            history_unindexed--;
+        } else if (e->dead) {
+            history_dead--;
+        } else {
+            historySetDelete(history_head);
+            history_garbage += e->len+1;
+            history_posts_live -= historyTrigrams(e);
+        }
+        history_head = (history_head+1) % history_cap;
         history_len--;
+        if (history_new > history_len) history_new = history_len;
+    }
+
+    /* Append to the arena, compacting it first if it is mostly garbage
+     * and growing it if that is not enough. */
+    if (history_buf_len+len+1 > history_buf_size &&
+        history_garbage > history_bytes/2) historyRebuild(history_cap);
+    if (history_buf_len+len+1 > history_buf_size) {
+        size_t size = history_buf_size ? history_buf_size*2 : 4096;
+        char *buf;
+
+        while (size < history_buf_len+len+1) size *= 2;
+        if ((buf = realloc(history_buf,size)) == NULL) return 0;
+        history_buf = buf;
+        history_buf_size = size;
     }
-    history[history_len] = linecopy;
+    memcpy(history_buf+history_buf_len,line,len);
+    history_buf[history_buf_len+len] = '\n';
+
+    slot = (history_head+history_len) % history_cap;
+    e = &history[slot];
+    e->off = history_map_size+history_buf_len;
+    e->len = len;
+    e->hash = h;
+    e->dead = 0;
+    e->id = history_next_id++;
+    history_buf_len += len+1;
+    history_bytes += len+1;
     history_len++;
+    historySetInsert(slot);
+
+    /* Index it, and index again from scratch once most of the index is
+     * for entries that are gone. */
+    historyPost(e,0);
+    if (history_posts > 2*history_posts_live+65536) historyRepost();
     return 1;
 }
 
@@ -1119,69 +1906,370 @@ int linenoiseHistoryAdd(const char *line) {
  * just the latest 'len' elements if the new history length value is smaller
  * than the amount of items already inside the history. */
 int linenoiseHistorySetMaxLen(int len) {
-    char **new;
-
     if (len < 1) return 0;
-    if (history) {
-        int tocopy = history_len;
+    if (history && history_cap > len && historyRebuild(len) == -1) return 0;
+    history_max_len = len;
+    return 1;
+}
 
-        new = malloc(sizeof(char*)*len);
-        if (new == NULL) return 0;
+/* Write len bytes at buf to fd. Returns -1 on error. */
+static int historyWrite(int fd, const char *buf, size_t len) {
+    ssize_t n;
 
-        /* If we can't copy everything, free the elements we'll not use. */
-        if (len < tocopy) {
-            int j;
+    while (len > 0) {
+        if ((n = write(fd,buf,len)) == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
 
-            for (j = 0; j < tocopy-len; j++) free(history[j]);
-            tocopy = len;
+/* Return the newest 'count' live entries, oldest first, as lines in a
+ * malloc()ed buffer, setting *lenp to its length. */
+static char *historyLines(int count, size_t *lenp) {
+    struct historyEntry *e;
+    size_t len = 0;
+    char *buf;
+    int i;
+
+    historyIndex(count);
+    for (i = count; i > 0; i--)
+        if (!historyAt(i)->dead) len += historyAt(i)->len+1;
+    if ((buf = malloc(len+1)) == NULL) return NULL;
+    *lenp = len;
+    len = 0;
+    for (i = count; i > 0; i--) {
+        e = historyAt(i);
+        if (e->dead) continue;
+        memcpy(buf+len,historyLine(e),e->len);
+        len += e->len;
+        buf[len++] = '\n';
+    }
+    return buf;
+}
+
+/* Add the lines of the len bytes at buf, which may lack the last
+ * newline, to the history. */
+static void historyAddLines(const char *buf, size_t len) {
+    const char *end = buf+len, *nl;
+    size_t n;
+
+    while (buf < end) {
+        nl = memchr(buf,'\n',end-buf);
+        n = (nl ? nl : end)-buf;
+        if (n > 0 && buf[n-1] == '\r') n--;
+        historyAdd(buf,n);
+        buf = nl ? nl+1 : end;
+    }
+}
+
+/* Remember fd, of size 'size', as the history file we are in step
+ * with. */
+static void historyFileSeen(int fd, off_t size) {
+    struct stat st;
+
+    if (fstat(fd,&st) == -1) return;
+    history_file_dev = st.st_dev;
+    history_file_ino = st.st_ino;
+    history_file_off = size;
+}
+
+/* Open the history file for appending with an exclusive flock() on it.
+ * Once we have the lock, make sure it is still the file of that name:
+ * historyRewrite() may have replaced it while we waited. On success
+ * the file descriptor is returned and *st filled in, otherwise -1. */
+static int historyOpenLocked(const char *filename, struct stat *st) {
+    struct stat cur;
+    mode_t old_umask;
+    int fd;
+
+    while (1) {
+        old_umask = umask(S_IXUSR|S_IRWXG|S_IRWXO);
+        fd = open(filename,O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC,
+            S_IRUSR|S_IWUSR);
+        umask(old_umask);
+        if (fd == -1) return -1;
+        if (flock(fd,LOCK_EX) == -1 || fstat(fd,st) == -1) {
+            close(fd);
+            return -1;
         }
-        memset(new,0,sizeof(char*)*len);
-        memcpy(new,history+(history_len-tocopy), sizeof(char*)*tocopy);
-        free(history);
-        history = new;
+        if (stat(filename,&cur) == 0 && cur.st_dev == st->st_dev &&
+            cur.st_ino == st->st_ino) return fd;
+        close(fd);
     }
-    history_max_len = len;
-    if (history_len > history_max_len)
-        history_len = history_max_len;
-    return 1;
+}
+
+/* Replace the history file, which the caller has locked, with the
+ * whole history. It is written to a new file that is renamed over the
+ * old one rather than rewritten in place, so that a session loading
+ * the old one meanwhile still reads it whole.
+ * On success 0 is returned otherwise -1 is returned. */
+static int historyRewrite(const char *filename) {
+    size_t len;
+    char *buf = NULL, *tmp;
+    int fd, ret = -1;
+
+    if ((tmp = malloc(strlen(filename)+8)) == NULL) return -1;
+    snprintf(tmp,strlen(filename)+8,"%s.XXXXXX",filename);
+    if ((fd = mkstemp(tmp)) == -1) {
+        free(tmp);
+        return -1;
+    }
+    if ((buf = historyLines(history_len,&len)) != NULL &&
+        historyWrite(fd,buf,len) == 0 && fdatasync(fd) == 0 &&
+        rename(tmp,filename) == 0) {
+        historyFileSeen(fd,len);
+        history_new = 0;
+        history_unsynced = 0;
+        history_synced_at = time(NULL);
+        ret = 0;
+    } else {
+        unlink(tmp);
+    }
+    free(buf);
+    close(fd);
+    free(tmp);
+    return ret;
 }
 
 /* Save the history in the specified file. On success 0 is returned
  * otherwise -1 is returned. */
 int linenoiseHistorySave(const char *filename) {
-    mode_t old_umask = umask(S_IXUSR|S_IRWXG|S_IRWXO);
-    FILE *fp;
-    int j;
+    struct stat st;
+    int fd, ret;
 
-    fp = fopen(filename,"w");
-    umask(old_umask);
-    if (fp == NULL) return -1;
-    chmod(filename,S_IRUSR|S_IWUSR);
-    for (j = 0; j < history_len; j++)
-        fprintf(fp,"%s\n",history[j]);
-    fclose(fp);
-    return 0;
+    if ((fd = historyOpenLocked(filename,&st)) == -1) return -1;
+    ret = historyRewrite(filename);
+    close(fd);
+    return ret;
+}
+
+/* Append the lines added with linenoiseHistoryAdd() since the last
+ * load, save or append to the specified file, under an exclusive
+ * flock(). Lines that other sessions appended in the meantime are
+ * merged into our history first, ahead of ours, so every session ends
+ * up with the lines of all of them in the order they were written.
+ *
+ * Appends are only fdatasync()ed every LINENOISE_HISTORY_SYNC_LINES
+ * lines or LINENOISE_HISTORY_SYNC_SECS seconds, or when 'sync' is
+ * set, as at exit. Once the file is mostly lines that are no longer
+ * in the history, it is rewritten as linenoiseHistorySave() would.
+ *
+ * On success 0 is returned otherwise -1 is returned. */
+int linenoiseHistoryAppend(const char *filename, int sync) {
+    struct stat st;
+    size_t len = 0, olen;
+    char *buf = NULL, *obuf, *p;
+    time_t now = time(NULL);
+    int fd, ret = -1;
+
+    if (history_new == 0 && (!sync || history_unsynced == 0)) return 0;
+    if (history_new > 0 &&
+        (buf = historyLines(history_new,&len)) == NULL) return -1;
+    if ((fd = historyOpenLocked(filename,&st)) == -1) goto done;
+
+    /* Merge what others appended since our last write, then add ours
+     * again to move them after it. */
+    if (st.st_dev == history_file_dev && st.st_ino == history_file_ino &&
+        st.st_size > history_file_off) {
+        olen = st.st_size-history_file_off;
+        if ((obuf = malloc(olen)) != NULL) {
+            if (pread(fd,obuf,olen,history_file_off) == (ssize_t)olen) {
+                historyAddLines(obuf,olen);
+                historyAddLines(buf,len);
+            }
+            free(obuf);
+        }
+    }
+    history_new = 0;
+
+    /* Mostly lines no longer in the history: rewrite it instead. */
+    if ((size_t)st.st_size > 2*(history_bytes-history_garbage)+65536) {
+        ret = historyRewrite(filename);
+        goto done;
+    }
+
+    if (historyWrite(fd,buf,len) == -1) goto done;
+    historyFileSeen(fd,st.st_size+len);
+    for (p = buf; p && (p = memchr(p,'\n',buf+len-p)) != NULL; p++)
+        history_unsynced++;
+    if (sync || history_unsynced >= LINENOISE_HISTORY_SYNC_LINES ||
+        now-history_synced_at >= LINENOISE_HISTORY_SYNC_SECS) {
+        if (fdatasync(fd) == -1) goto done;
+        history_unsynced = 0;
+        history_synced_at = now;
+    }
+    ret = 0;
+
+done:
+    free(buf);
+    if (fd != -1) close(fd);
+    return ret;
+}
+
+/* Find where the newest 'max' lines of the text from map to end start,
+ * setting *startp, and return how many lines that is. */
+static int historyScanBack(const char *map, const char *end, int max,
+    const char **startp)
+{
+    const char *p = end;
+    int n = 1; /* The line that ends at end. */
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    const char *block, *q;
+    __m128i count;
+    unsigned mask;
+    int bit;
+
+    /* While there are more lines to go than a block can have, count the
+     * newlines of 255 vectors at a time, each byte of count counting
+     * its column; then look for them a vector at a time. */
+    while (p-map >= 16*255 && max-n >= 16*255) {
+        block = p-16*255;
+        count = zero;
+        for (q = block; q < p; q += 16)
+            count = _mm_sub_epi8(count,_mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *)q),nl));
+        count = _mm_sad_epu8(count,zero);
+        n += _mm_cvtsi128_si32(count)+
+            _mm_cvtsi128_si32(_mm_srli_si128(count,8));
+        p = block;
+    }
+    while (p-map >= 16) {
+        p -= 16;
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)p),nl));
+        for (; mask; mask &= ~(1u << bit)) {
+            bit = 31-__builtin_clz(mask);
+            if (n == max) {
+                *startp = p+bit+1;
+                return n;
+            }
+            n++;
+        }
+    }
+#endif
+    while (p > map) {
+        if (*--p == '\n') {
+            if (n == max) {
+                *startp = p+1;
+                return n;
+            }
+            n++;
+        }
+    }
+    *startp = map;
+    return n;
+}
+
+/* Make e the line from line to end, at offset line-base. */
+static void historyEntrySet(struct historyEntry *e, const char *base,
+    const char *line, const char *end)
+{
+    if (end > line && end[-1] == '\r') end--;
+    e->off = line-base;
+    e->len = end-line;
+    e->hash = 0;
+    e->dead = 0;
 }
 
 /* Load the history from the specified file. If the file does not exist
- * zero is returned and no operation is performed.
+ * -1 is returned and no operation is performed.
+ *
+ * The file is mapped, and its newest lines, as many as the history
+ * holds, are copied out in one piece to become the first part of the
+ * arena: loading only counts them. Splitting and hashing them is put
+ * off to historyIndex(), a little on every add and as far as the user
+ * goes back in history. If the history is not empty, the lines are
+ * added one by one instead.
+ *
+ * Nothing is kept mapped: if the file were truncated under a map,
+ * touching the lost pages would raise SIGBUS. The shared lock keeps
+ * our own writers out while the map is read.
  *
  * If the file exists and the operation succeeded 0 is returned, otherwise
  * on error -1 is returned. */
 int linenoiseHistoryLoad(const char *filename) {
-    FILE *fp = fopen(filename,"r");
-    char buf[LINENOISE_MAX_LINE];
-
-    if (fp == NULL) return -1;
-
-    while (fgets(buf,LINENOISE_MAX_LINE,fp) != NULL) {
-        char *p;
-
-        p = strchr(buf,'\r');
-        if (!p) p = strchr(buf,'\n');
-        if (p) *p = '\0';
-        linenoiseHistoryAdd(buf);
+    struct stat st;
+    struct historyEntry *ring;
+    const char *start, *end;
+    char *map, *lines;
+    int *set;
+    unsigned mask;
+    int fd, n, cap;
+
+    if ((fd = open(filename,O_RDONLY|O_CLOEXEC)) == -1) return -1;
+    if (flock(fd,LOCK_SH) == -1 || fstat(fd,&st) == -1) {
+        close(fd);
+        return -1;
+    }
+    historyFileSeen(fd,st.st_size);
+    history_new = 0;
+    if (st.st_size == 0 || history_max_len == 0) {
+        close(fd);
+        return 0;
     }
-    fclose(fp);
+    /* Closing fd releases the lock once the map is gone. */
+    map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    end = map+st.st_size;
+    if (end[-1] == '\n') end--;
+    n = historyScanBack(map,end,history_max_len,&start);
+
+    if (history_len > 0) {
+        historyAddLines(start,end-start);
+        munmap(map,st.st_size);
+        close(fd);
+        return 0;
+    }
+    historyUnpost();
+
+    /* Room to grow, which costs nothing until it is used. */
+    cap = n < 8 ? 16 : n*2;
+    if (cap > history_max_len) cap = history_max_len;
+    for (mask = 1; mask < (unsigned)cap*2; mask <<= 1);
+    ring = malloc(sizeof(*ring)*cap);
+    set = calloc(mask,sizeof(*set));
+    lines = malloc(end-start+1);
+    if (ring == NULL || set == NULL || lines == NULL) {
+        free(ring);
+        free(set);
+        free(lines);
+        munmap(map,st.st_size);
+        close(fd);
+        return -1;
+    }
+    memcpy(lines,start,end-start);
+    lines[end-start] = '\n';
+    munmap(map,st.st_size);
+    close(fd);
+
+    freeHistory();
+    history = ring;
+    history_cap = cap;
+    history_head = 0;
+    history_len = n;
+    history_dead = 0;
+    history_map = lines;
+    history_map_size = end-start+1;
+    history_buf = NULL;
+    history_buf_len = 0;
+    history_buf_size = 0;
+    history_bytes = end-start+1;
+    history_garbage = 0;
+    history_set = set;
+    history_set_mask = mask-1;
+    history_unindexed = history_unsplit = n;
+    history_pending = 0;
+    history_pending_end = end-start;
+    history_pending_id = n-1;
+    history_next_id = n;
     return 0;
 }
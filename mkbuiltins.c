@@ -0,0 +1,146 @@
+/*
+ * mkbuiltins.c
+ * Generate the builtin dispatch table of ssi.
+ *
+ * Reads "name handler [pure] [spawns]" lines from stdin (see
+ * builtins.def) and writes a header with a perfect hash table of them:
+ * a seed for which builtin_hash() in sh.c sends every name to its own
+ * slot, so looking up any word costs one hash and at most one string
+ * compare.
+ *
+ * usage: mkbuiltins < builtins.def > builtins.h
+ */
+
+#include <err.h>		/* err(3), errx(3) */
+#include <stdio.h>		/* fgets(3), printf(3), sscanf(3) */
+#include <stdlib.h>		/* calloc(3) */
+#include <string.h>		/* strcmp(3), strdup(3) */
+
+#define MAX_BUILTINS	256		/* Names in builtins.def. */
+#define MAX_SEED	(1u << 24)	/* Seeds tried per table size. */
+
+struct entry {
+	char	*name;			/* Command name. */
+	char	*fn;			/* Handler function. */
+	int	 pure;			/* Safe to run for $(...) in-process. */
+	int	 spawns;		/* Starts children that use fd 1. */
+};
+
+static unsigned		 hash(const char *, unsigned);
+
+int
+main(void)
+{
+	static struct entry	 ents[MAX_BUILTINS];
+	char			 line[256];
+	char			 name[128];
+	char			 fn[128];
+	char			 flag[2][128];
+	unsigned char		*used;
+	unsigned		 size;
+	unsigned		 seed;
+	unsigned		 h;
+	int			 n = 0;
+	int			 i;
+	int			 j;
+	int			 k;
+	int			 f;
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		if (line[0] == '#' || (k = sscanf(line,
+		    "%127s %127s %127s %127s", name, fn, flag[0],
+		    flag[1])) < 2) {
+			continue;		/* Comment or blank line. */
+		}
+		if (n == MAX_BUILTINS) {
+			errx(1, "too many builtins");
+		}
+		ents[n].pure = ents[n].spawns = 0;
+		for (f = 0; f < k - 2; f++) {
+			if (!strcmp(flag[f], "pure")) {
+				ents[n].pure = 1;
+			} else if (!strcmp(flag[f], "spawns")) {
+				ents[n].spawns = 1;
+			} else {
+				errx(1, "%s: unknown flag %s", name, flag[f]);
+			}
+		}
+		for (i = 0; i < n; i++) {
+			if (!strcmp(ents[i].name, name)) {
+				errx(1, "%s: listed twice", name);
+			}
+		}
+		if ((ents[n].name = strdup(name)) == NULL ||
+		    (ents[n].fn = strdup(fn)) == NULL) {
+			err(1, "strdup");
+		}
+		n++;
+	}
+	if (n == 0) {
+		errx(1, "no builtins");
+	}
+
+	/* Smallest power of two table, at least twice n, that has a seed. */
+	for (size = 2; size < 2 * (unsigned)n; size <<= 1)
+		;
+	for (;; size <<= 1) {
+		if ((used = calloc(size, 1)) == NULL) {
+			err(1, "calloc");
+		}
+		for (seed = 0; seed < MAX_SEED; seed++) {
+			memset(used, 0, size);
+			for (i = 0; i < n; i++) {
+				h = hash(ents[i].name, seed) & (size - 1);
+				if (used[h]) {
+					break;
+				}
+				used[h] = 1;
+			}
+			if (i == n) {
+				break;
+			}
+		}
+		free(used);
+		if (seed < MAX_SEED) {
+			break;
+		}
+	}
+
+	printf("/* Generated by mkbuiltins from builtins.def; do not edit. */\n");
+	printf("\n");
+	printf("#define BUILTIN_SEED\t%#xu\n", seed);
+	printf("#define BUILTIN_MASK\t%#x\n", size - 1);
+	printf("\n");
+	printf("static const struct builtin\t builtins[BUILTIN_MASK + 1] = {\n");
+	for (h = 0; h < size; h++) {
+		for (j = 0; j < n; j++) {
+			if ((hash(ents[j].name, seed) & (size - 1)) == h) {
+				printf("\t[%u] = { \"%s\", %s, %d, %d },\n",
+				    h, ents[j].name, ents[j].fn, ents[j].pure,
+				    ents[j].spawns);
+			}
+		}
+	}
+	printf("};\n");
+
+	if (fflush(stdout) == EOF) {
+		err(1, "stdout");
+	}
+
+	return 0;
+}
+
+/*
+ * Must match builtin_hash() in sh.c.
+ */
+static unsigned
+hash(const char *s, unsigned seed)
+{
+	unsigned	 h = 2166136261u ^ seed;
+
+	while (*s != '\0') {
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	}
+
+	return h ^ (h >> 15);
+}
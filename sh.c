@@ -7,433 +7,7518 @@
  * Christopher Hettrick
  */
 
-#include <sys/wait.h>		/* wait(2) */
+#define _GNU_SOURCE		/* strchrnul(3), pipe2(2), F_SETPIPE_SZ */
 
-#include <err.h>		/* err(3), warn(3), warnx(3) */
-#include <libgen.h>		/* basename(3) */
+#include <sys/epoll.h>		/* epoll_create1(2), epoll_wait(2) */
+#include <sys/mman.h>		/* mmap(2), madvise(2), memfd_create(2) */
+#include <sys/pidfd.h>		/* pidfd_open(2) */
+#include <sys/resource.h>	/* getrusage(2) */
+#include <sys/socket.h>		/* socketpair(2), sendmsg(2), recvmsg(2) */
+#include <sys/stat.h>		/* stat(2), lstat(2), mkdir(2) */
+#include <sys/syscall.h>	/* SYS_clone */
+#include <sys/time.h>		/* timeradd(3) */
+#include <sys/wait.h>		/* wait4(2) */
+
+#include <dirent.h>		/* opendir(3), readdir(3) */
+#include <err.h>		/* err(3), warn(3), warnx(3), vwarnx(3) */
+#include <errno.h>		/* errno, ENOENT */
+#include <fcntl.h>		/* open(2), fcntl(2), O_CLOEXEC, F_SETPIPE_SZ */
+#include <fnmatch.h>		/* fnmatch(3) */
+#include <inttypes.h>		/* strtoimax(3), intmax_t */
 #include <limits.h>		/* PATH_MAX */
+#include <stdarg.h>		/* va_start(3) */
 #include <stdio.h>		/* printf(3), fprintf(3), snprintf(3) */
-				/* readline(3) */
+				/* fopen(3), rename(2), setvbuf(3) */
 #include <stddef.h>		/* size_t */
-#include <stdlib.h>		/* exit(3), free(3), getenv(3), calloc(3) */
+#include <stdint.h>		/* uintptr_t, uint64_t */
+#include <stdlib.h>		/* exit(3), free(3), calloc(3), qsort(3) */
+				/* realpath(3), mkstemp(3) */
+				/* malloc(3), realloc(3) */
 #include <string.h>		/* strdup(3), strcmp(3), strlen(3) */
+				/* memchr(3), memset(3) */
 				/* strspn(3), strcspn(3), strsep(3) */
-#include <unistd.h>		/* getcwd(3), fork(2), execvp(3) */
+				/* strchrnul(3), stpcpy(3) */
+#include <sched.h>		/* CLONE_PARENT */
+#include <signal.h>		/* SIGCHLD */
+#include <spawn.h>		/* posix_spawn(3) */
+#include <time.h>		/* clock_gettime(2) */
+#include <unistd.h>		/* getcwd(3), fork(2), execvp(3), getopt(3) */
+				/* chdir(2), isatty(3), access(2) */
+				/* pipe2(2), dup2(2), close_range(2) */
+				/* syscall(2), geteuid(2) */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>		/* SSE2 and AVX2 intrinsics */
+#endif
 
+#ifdef USE_READLINE
 #include <readline/readline.h>	/* readline(3) */
 #include <readline/history.h>	/* add_history(3) */
+#else
+#include "linenoise.h"		/* linenoise(), history, completion */
+#endif
 
 #define PROMPT_SIZE	(5 + PATH_MAX + 3 + 1)	/* "SSI: " + cwd + " > " + \0 */
+#define PATHTAB_SIZE	256		/* Command hash buckets, power of 2. */
+#define BGTAB_SIZE	64		/* Initial job pid hash, power of 2. */
+#define BG_EVENTS	64		/* Reaped per epoll_wait(2) call. */
+#define ARENA_SIZE	65536		/* Initial command arena chunk. */
+#define ARENA_ALIGN	16		/* Alignment of arena allocations. */
+#define POOL_SLAB	64		/* Objects per pool slab. */
+#define HIST_SUB_BITS	4		/* log2 of buckets per power of 2. */
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+#define OBUF_SIZE	65536		/* Builtin output buffer. */
+#define REDIR_FDS	10		/* Descriptors 0-9 can be redirected. */
+#define ZYGOTE_MAX	64		/* Largest zygote pool. */
+#define PARALLEL_MAX	4096		/* Most parallel -j children. */
+#define ZYGOTE_MSG	65536		/* Largest request to a zygote. */
+#define ZYGOTE_FDS	(4 + REDIR_FDS)	/* cwd, 0-2, here-documents. */
+#define EXP_MARK	'\001'		/* Starts a word to expand when run. */
+#define SUBST_READ	65536		/* Smallest read(2) of $(...) output. */
+#define VARTAB_SIZE	64		/* Initial variable slots, power of 2. */
+#define HISTORY_FILE	".ssi_history"	/* In $HOME, unless $HISTFILE. */
+#define HISTORY_SIZE	1000		/* Lines of history kept. */
+#define CACHE_MAGIC	"ssicache"	/* First bytes of a script cache. */
+#define CACHE_FORMAT	3		/* Bump when records change. */
+#define CACHE_RECORDS(n)	/* Offset of records, after n byte path. */ \
+	((sizeof(struct cache_hdr) + (n) + 8) & ~(size_t)7)
 
 enum proc_state {
 	STATE_FG,
 	STATE_BG
 };
 
+enum token {
+	T_EOF,				/* End of line. */
+	T_ERROR,			/* Syntax error, already reported. */
+	T_WORD,				/* Word, quotes removed. */
+	T_PIPE,				/* | */
+	T_AMP,				/* & */
+	T_SEMI,				/* ; */
+	T_DSEMI,			/* ;; */
+	T_ANDIF,			/* && */
+	T_ORIF,				/* || */
+	T_LPAREN,			/* ( */
+	T_RPAREN,			/* ) */
+	T_NL,				/* End of a line, to the parser. */
+	/* Redirection operators, from T_IONUM on, must come last. */
+	T_IONUM,			/* Digits right before < or >. */
+	T_LT,				/* < */
+	T_GT,				/* > */
+	T_DGT,				/* >> */
+	T_LTAND,			/* <& */
+	T_GTAND,			/* >& */
+	T_DLT,				/* << */
+	T_DLTDASH,			/* <<- */
+	T_TLT				/* <<< */
+};
+
+enum redir_type {
+	R_IN,				/* [n]<file */
+	R_OUT,				/* [n]>file */
+	R_APPEND,			/* [n]>>file */
+	R_DUP,				/* [n]>&m, [n]<&m */
+	R_CLOSE,			/* [n]>&-, [n]<&- */
+	R_DOC				/* [n]<<word, [n]<<<word */
+};
+
+/*
+ * One redirection of a command, applied in order.
+ */
+struct redir {
+	struct redir	*next;		/* Next redirection of command. */
+	struct redir	*dnext;		/* Next here-document to read. */
+	const char	*file;		/* File to open, or R_DOC text. */
+	const char	*delim;		/* R_DOC: here-document delimiter. */
+	size_t		 len;		/* R_DOC: length of text. */
+	int		 strip;		/* R_DOC: <<-, strip leading tabs. */
+	int		 fd;		/* Descriptor redirected. */
+	int		 src;		/* R_DUP: descriptor copied. */
+				/* R_DOC: memfd holding text. */
+	int		 cmd;		/* Index of command in pipeline. */
+	enum redir_type	 type;
+};
+
+/*
+ * Where lines come from: a script buffer, split in place, or the
+ * terminal through tty_read().
+ */
+struct input {
+	char	*p;			/* Rest of script buffer. */
+	char	*end;			/* End of script buffer. */
+	int	 tty;			/* Read with tty_read() instead. */
+};
+
+/*
+ * Buffered output to a file descriptor. Builtins write through one,
+ * rather than stdio, so their output can be pointed at any fd.
+ */
+struct obuf {
+	struct	 capture *cap;		/* Collect here instead of fd. */
+	int	 fd;			/* Descriptor written to. */
+	int	 lbf;			/* Flush at each newline (a tty). */
+	int	 err;			/* A write failed. */
+	size_t	 len;			/* Bytes buffered. */
+	char	 buf[OBUF_SIZE];
+};
+
+/*
+ * Header of a compiled script cache file, followed by the script's
+ * real path and then its records. It is only used if every field
+ * matches the script and ssi as they are now.
+ */
+struct cache_hdr {
+	char		 magic[8];	/* CACHE_MAGIC, no NUL. */
+	uint32_t	 format;	/* CACHE_FORMAT. */
+	uint32_t	 pathlen;	/* Length of the script's path. */
+	uint64_t	 len;		/* Bytes in the whole file. */
+	uint64_t	 exe_size;	/* Size of the ssi that wrote it. */
+	int64_t		 exe_mtime;	/* Its mtime, in nanoseconds. */
+	uint64_t	 size;		/* Size of the script. */
+	int64_t		 mtime;		/* Its mtime, in nanoseconds. */
+	uint64_t	 dev;		/* Device of the script. */
+	uint64_t	 ino;		/* Inode of the script. */
+};
+
+/*
+ * Kinds of record in a script cache. Records are made of numbers,
+ * seven bits to a byte with the top bit set on all but the last,
+ * and strings: one more than their length, then their bytes and a
+ * NUL, so they can be used where they lie. A NULL string is just 0.
+ */
+enum cache_rec {
+	CR_PIPE = 1,			/* A pipeline. */
+	CR_AND,				/* &&: two nodes. */
+	CR_OR,				/* ||: two nodes. */
+	CR_NOT,				/* !: one node. */
+	CR_IF,				/* Condition, then and else lists. */
+	CR_WHILE,			/* Condition and body lists. */
+	CR_UNTIL,			/* Condition and body lists. */
+	CR_FOR,				/* Name, words, body list. */
+	CR_CASE,			/* Word, then patterns and list of */
+					/* each item. */
+	CR_BG,				/* &: one node, run in a subshell. */
+	CR_END				/* End of a list. */
+};
+
+/*
+ * A cache file being built.
+ */
+struct cbuf {
+	char	*buf;
+	size_t	 len;			/* Bytes used. */
+	size_t	 cap;			/* Bytes allocated. */
+};
+
+/*
+ * Reads the records of a cache file.
+ */
+struct creader {
+	const unsigned char *p;		/* Next byte. */
+	const unsigned char *end;	/* End of the records. */
+	int		 bad;		/* Cut short: file is corrupt. */
+};
+
+/*
+ * Phases of reading and running a command, timed by the main loop.
+ */
+enum phase {
+	PH_READ,			/* Reading the line. */
+	PH_PARSE,			/* parse_line(). */
+	PH_BUILTIN,			/* Running a builtin. */
+	PH_SPAWN,			/* Launching the pipeline. */
+	PH_WAIT,			/* Launch to exit of foreground. */
+	PH_PROMPT,			/* cwd_prompt(). */
+	PH_MAX
+};
+
+/*
+ * Log-linear latency histogram, in nanoseconds. Fixed size, so
+ * recording a value never allocates.
+ */
+struct hist {
+	uint64_t  count;		/* Values recorded. */
+	uint64_t  sum;			/* Sum of values. */
+	uint64_t  min;			/* Smallest value. */
+	uint64_t  max;			/* Largest value. */
+	uint64_t  b[HIST_BUCKETS];	/* Counts per bucket. */
+};
+
+struct lexer {
+	char	 *p;			/* Next character to read. */
+	char	  pend;			/* Operator hidden under a NUL. */
+};
+
+/*
+ * State of the parser: the current token, and the here-documents
+ * whose bodies follow the current line.
+ */
+struct parser {
+	struct	  lexer lx;		/* Lexer over the current line. */
+	enum	  token t;		/* Current token. */
+	char	 *word;			/* Its word, for T_WORD. */
+	struct	  redir *docs;		/* Here-documents to read. */
+	struct	  redir **dtail;	/* End of docs. */
+	int	  depth;		/* Open compound commands. */
+	int	  eol;			/* T_NL seen: next line is needed. */
+	int	  err;			/* Syntax error, already reported. */
+};
+
 struct args {
 	char	 *file;			/* (Full) path of new process file. */
-	char	**realargv;		/* Immutable pointer to arg vectors. */
 	char	**argv;			/* Mutable pointer to arg vectors. */
 	int	  argc;			/* Argument count. */
+	char	**assign;		/* NAME=value words before argv. */
+	int	  nassign;		/* Count of assign. */
+	struct	  redir *redir;		/* Redirections, in order. */
+	int	  expand;		/* Has words to expand when run. */
+};
+
+/*
+ * A builtin command, listed in builtins.def.
+ */
+struct builtin {
+	const char	 *name;		/* Command name. */
+	int		(*fn)(struct args *);	/* Returns exit status. */
+	int		  pure;		/* Only writes output. */
+	int		  spawns;	/* Children write to fd 1. */
+};
+
+/*
+ * Output collected in memory, for $(...).
+ */
+struct capture {
+	char	*buf;			/* In the command arena. */
+	size_t	 len;			/* Bytes collected. */
+	size_t	 size;			/* Bytes allocated. */
+};
+
+/*
+ * Fields being built by expanding words.
+ */
+struct fields {
+	char	**v;			/* Finished fields. */
+	size_t	  n;			/* Count of finished fields. */
+	size_t	  cap;			/* Slots allocated in v. */
+	char	 *buf;			/* Field being built. */
+	size_t	  len;			/* Bytes in buf. */
+	size_t	  size;			/* Bytes allocated for buf. */
+	int	  open;			/* Field exists, even if empty. */
+};
+
+/*
+ * State of the test builtin's expression parser.
+ */
+struct texpr {
+	char	**av;			/* Arguments. */
+	int	  ac;			/* Argument count. */
+	int	  pos;			/* Next argument. */
+	int	  err;			/* Syntax error seen. */
+};
+
+struct pipeline {
+	struct	  args *cmds;		/* Commands, in pipeline order. */
+	int	  ncmds;		/* Number of commands. */
+	int	  ndocs;		/* Here-documents and -strings. */
 	enum	  proc_state ps;	/* Foreground or background process. */
 };
 
-struct proc {
-	struct	  proc *next;		/* Next process in process list. */
+enum node_type {
+	N_PIPE,				/* pipeline */
+	N_AND,				/* left && right */
+	N_OR,				/* left || right */
+	N_NOT,				/* ! left */
+	N_IF,				/* if left then right else els fi */
+	N_WHILE,			/* while left do right done */
+	N_UNTIL,			/* until left do right done */
+	N_FOR,				/* for var in words do right done */
+	N_CASE,				/* case words[0] in arms esac */
+	N_BG				/* left & */
+};
+
+/*
+ * A command of the syntax tree. Lists are chained through next, and
+ * the tree is only read when it runs, so a loop body is parsed once
+ * however many times it runs.
+ */
+struct node {
+	struct	  node *next;		/* Next command of the list. */
+	enum	  node_type type;
+	struct	  pipeline *pl;		/* N_PIPE. */
+	struct	  node *left;		/* Operand, or condition list. */
+	struct	  node *right;		/* Operand, or body list. */
+	struct	  node *els;		/* N_IF: else list, or elif N_IF. */
+	char	 *var;			/* N_FOR: variable name. */
+	char	**words;		/* N_FOR, N_CASE: raw words. */
+	int	  nwords;		/* Count of words. */
+	struct	  arm *arms;		/* N_CASE: items, in order. */
+};
+
+/*
+ * An item of a case command: patterns and the list they run.
+ */
+struct arm {
+	struct	  arm *next;		/* Next item. */
+	char	**pats;			/* Raw patterns. */
+	int	  npats;		/* Count of pats. */
+	struct	  node *body;		/* List, may be NULL. */
+};
+
+/*
+ * A shell variable, in an open addressing table. Its text is kept as
+ * "name=value", so that exported ones can be put in the environment
+ * of commands as they are.
+ */
+struct var {
+	char		*str;		/* "name=value", or NULL if free. */
+	size_t		 size;		/* Bytes allocated for str. */
+	size_t		 nlen;		/* Length of name. */
+	unsigned	 hash;		/* var_hash() of name. */
+	int		 exported;	/* In environment of commands. */
+};
+
+/*
+ * Resolved command path cache entry. A NULL path is a negative entry:
+ * the command was not found anywhere in PATH.
+ */
+struct pathent {
+	struct	  pathent *next;	/* Next entry in hash chain. */
+	char	 *name;			/* Command name, the hash key. */
+	char	 *path;			/* Full path of command, or NULL. */
+	unsigned  hits;			/* Times this entry was used. */
+};
+
+/*
+ * Bump allocator for everything belonging to the command being run.
+ * It is reset once per input line, so steady state use of the arena
+ * makes no calls to malloc(3).
+ */
+struct achunk {
+	struct	  achunk *next;		/* Previous, full chunk. */
+	size_t	  size;			/* Bytes in data. */
+	size_t	  used;			/* Bytes handed out from data. */
+	char	  data[];
+};
+
+struct arena {
+	struct	  achunk *head;		/* Chunk being allocated from. */
+	struct	  achunk *spare;	/* Released chunks, to reuse. */
+};
+
+/*
+ * A point in an arena to go back to, with arena_release().
+ */
+struct amark {
+	struct	  achunk *head;		/* Chunk then being allocated from. */
+	size_t	  used;			/* Its bytes then handed out. */
+};
+
+/*
+ * Free list of fixed size objects, for records that outlive a command.
+ */
+struct pool {
+	size_t	  size;			/* Object size. */
+	void	 *free;			/* Free objects, linked through. */
+};
+
+/*
+ * A child forked ahead of time, blocked on its end of a socket until
+ * it is sent a command to exec. It is the shell's own child, so the
+ * command it becomes is waited for like any other.
+ */
+struct zygote {
+	pid_t	  pid;			/* Process id. */
+	int	  sock;			/* Shell's end of its socket. */
+};
+
+struct job;
+
+/*
+ * A process of a background job. Found by pid through the job table
+ * hash, or directly from the epoll event for its pidfd.
+ */
+struct jproc {
+	struct	  jproc *hnext;		/* Next entry in pid hash chain. */
+	struct	  jproc *jnext;		/* Next process of the same job. */
+	struct	  job *job;		/* Job this process belongs to. */
 	pid_t	  pid;			/* Process id. */
-	struct	  args *a;		/* Process command arguments. */
+	int	  pidfd;		/* pidfd_open(2) fd, or -1. */
+};
+
+/*
+ * A background job: every stage of one background pipeline, or the
+ * subshell running an and-or list or compound command.
+ */
+struct job {
+	struct	  job *next;		/* Next job in launch order. */
+	struct	  job *prev;		/* Previous job in launch order. */
+	struct	  jproc *procs;		/* One per pipeline stage. */
+	pid_t	  pid;			/* Pid of the last stage. */
+	int	  nprocs;		/* Number of processes. */
+	int	  nlive;		/* Processes not yet reaped. */
+	char	 *cmd;			/* Command text, for bglist. */
 };
 
+extern char		**environ;
+
 static char		 prompt[PROMPT_SIZE];	/* Shell prompt. PS1. */
+static int		 prompt_dirty;	/* prompt needs re-rendering. */
+static char		 pwd[PATH_MAX];	/* Logical current directory. */
+static char		 oldpwd[PATH_MAX];	/* Previous directory. */
+static int		 fflag;		/* Launch with fork(2), not spawn. */
+static int		 nflag;		/* Parse commands, do not run them. */
+static int		 pipe_size;	/* F_SETPIPE_SZ size; 0 for default. */
+static int		 cwd_fd = -1;	/* O_PATH fd of cwd, for zygotes. */
+static int		 compiling;	/* Parsing a script for the cache. */
+static int		 compile_err;	/* The parser complained meanwhile. */
+static int		 last_status;	/* $?, of the last pipeline run. */
+static int		 loop_depth;	/* Loops being run. */
+static int		 loop_brk;	/* Loops left to break out of. */
+static int		 loop_cont;	/* Loops out to a continue. */
+
+static struct zygote	 zpool[ZYGOTE_MAX];	/* Zygotes ready to exec. */
+static int		 zpool_n;	/* Zygotes in zpool. */
+static int		 zygote_size;	/* Zygotes to keep; 0 for none. */
+static int		 zmother = -1;	/* Socket to the zygote mother. */
+static pid_t		 zmother_pid;	/* Process that clones zygotes. */
+
+static struct pathent	*pathtab[PATHTAB_SIZE];	/* Command path cache. */
+static char		*pathtab_path;	/* PATH the cache was built from. */
+
+static struct var	*vartab;	/* Shell variables, linear probing. */
+static size_t		 vartab_size;	/* Slots in vartab, power of 2. */
+static size_t		 nvars;		/* Variables in vartab. */
+static size_t		 nexported;	/* Of those, exported. */
+static char		**envp;		/* Cached environment of commands. */
+static size_t		 envp_size;	/* Slots allocated in envp. */
+static int		 env_dirty = 1;	/* envp must be rebuilt. */
 
-#if 0
-static struct proc	*bghead = NULL;	/* Bg processes list head. */
+static struct job	*bghead = NULL;	/* Bg jobs list head. */
+static struct job	*bgtail = NULL;	/* Bg jobs list tail. */
+static size_t		 bgcnt;		/* Number of bg jobs. */
+static struct jproc	**bgtab;	/* Bg processes by pid. */
+static size_t		 bgtab_size;	/* Buckets in bgtab. */
+static size_t		 bgnprocs;	/* Processes in bgtab. */
+static int		 bg_epfd = -1;	/* epoll(7) set of bg pidfds. */
+static size_t		 bgnopidfd;	/* Bg processes with no pidfd. */
+
+static struct arena	 cmd_arena;	/* Per command allocations. */
+static struct hist	 stats[PH_MAX];	/* Latency of each phase. */
+static struct obuf	 bout = { NULL, STDOUT_FILENO, 0, 0, 0, { 0 } };
+static struct input	*input;		/* Source of the current line. */
+#ifndef USE_READLINE
+static char		*histfile;	/* History kept here, or NULL. */
 #endif
+static const char	*phase_names[PH_MAX] = {
+	"read", "parse", "builtin", "spawn", "wait", "prompt"
+};
+static char		 lex_special[256];	/* Bytes ending a run. */
+static const char	*(*lex_scan)(const char *);	/* Fastest scan. */
+static struct pool	 job_pool = { sizeof(struct job), NULL };
+static struct pool	 jproc_pool = { sizeof(struct jproc), NULL };
 
 static void		 cwd_prompt(void);
-static struct args	**args_parse(char **);
-static void		 args_free(struct args **);
+static void		 pwd_init(void);
+static int		 pwd_canon(char *, size_t, const char *, const char *);
+static int		 line_run(char *);
+static int		 pipe_run(struct pipeline *);
+static int		 node_run(struct node *);
+static int		 node_one(struct node *);
+static int		 node_loop(struct node *);
+static int		 node_for(struct node *);
+static int		 node_case(struct node *);
+static int		 node_bg(struct node *);
+static int		 loop_stop(void);
+static int		 script_run(char *, size_t);
+static int		 script_file(const char *);
+static char		*script_map(int, const struct stat *);
+static int		 cache_path(const char *, char *, char *);
+static int		 cache_header(struct cache_hdr *, const char *,
+			    const struct stat *);
+static void		*cache_load(const char *, const char *,
+			    const struct stat *, struct creader *, size_t *);
+static int		 cache_compile(char *, size_t, const char *,
+			    const struct stat *, struct cbuf *);
+static void		 cache_save(const char *, const struct cbuf *);
+static int		 cache_exec(struct creader *);
+static void		 cache_put(struct cbuf *, const void *, size_t);
+static void		 cache_num(struct cbuf *, uint32_t);
+static void		 cache_str(struct cbuf *, const char *, size_t);
+static void		 cache_list(struct cbuf *, const struct node *);
+static void		 cache_node(struct cbuf *, const struct node *);
+static void		 cache_words(struct cbuf *, char **, int);
+static void		 cache_pipeline(struct cbuf *, const struct pipeline *);
+static void		 cache_reader(struct creader *, const void *, size_t);
+static uint32_t		 cache_get(struct creader *);
+static char		*cache_getstr(struct creader *, size_t *);
+static struct node	*cache_getlist(struct creader *);
+static struct node	*cache_getnode(struct creader *);
+static char		**cache_getwords(struct creader *, int *);
+static struct pipeline	*cache_decode(struct creader *);
+static void		 parse_warn(const char *, ...)
+			    __attribute__ ((__format__ (__printf__, 1, 2)));
+static int		 parse_line(char *, struct node **);
+static void		 parse_next(struct parser *);
+static void		 parse_newlines(struct parser *);
+static int		 parse_is(const struct parser *, const char *);
+static int		 parse_closer(const struct parser *);
+static int		 parse_compound(const struct parser *);
+static void		 parse_near(struct parser *);
+static int		 parse_expect(struct parser *, const char *);
+static struct node	*parse_list(struct parser *, int);
+static struct node	*parse_andor(struct parser *);
+static struct node	*parse_pipeline(struct parser *);
+static struct node	*parse_if(struct parser *);
+static struct node	*parse_while(struct parser *);
+static struct node	*parse_for(struct parser *);
+static struct node	*parse_case(struct parser *);
+static char		**parse_words(struct parser *, int *, int);
+static struct node	*node_new(enum node_type);
+static struct pipeline	*args_parse(struct parser *);
+static struct redir	*args_redir(struct lexer *, enum token, char *);
+static char		*input_line(struct input *, const char *);
+static void		 tty_init(void);
+static char		*tty_read(const char *);
+static void		 tty_history(const char *);
+#ifndef USE_READLINE
+static void		 tty_atexit(void);
+static void		 tty_complete(const char *, linenoiseCompletions *);
+static void		 tty_dir(linenoiseCompletions *, const char *,
+			    const char *, size_t, const char *, int);
+static void		 tty_add(linenoiseCompletions *, const char *,
+			    const char *, const char *, const char *);
+static int		 str_cmp(const void *, const void *);
+#endif
+static char		*heredoc_read(const char *, int, size_t *);
+static int		 heredoc_open(struct pipeline *);
+static void		 heredoc_close(struct pipeline *);
+static void		 lex_init(struct lexer *, char *);
+static enum token	 lex_next(struct lexer *, char **);
+static enum token	 lex_raw(struct lexer *, char **, const char *,
+			    const char *, int);
+static int		 lex_dollar(const char *);
+static const char	*lex_skip(const char *, int);
+static const char	*lex_paren(const char *);
+static int		 expand_args(struct args *);
+static int		 expand_list(struct fields *, char **, int);
+static char		*expand_one(char *);
+static int		 expand_word(const char *, struct fields *, int);
+static const char	*expand_var(const char *, struct fields *, int);
+static void		 field_add(struct fields *, const char *, size_t);
+static void		 field_split(struct fields *, const char *, size_t);
+static void		 field_end(struct fields *);
+static void		 field_push(struct fields *, char *);
+static char		*subst_run(const char *, size_t, size_t *);
+static void		 capture_add(struct capture *, const char *, size_t);
+static void		 capture_fd(struct capture *, int);
+static const char	*lex_name(enum token, const char *);
+static void		 lex_setup(void);
+static const char	*lex_scan_scalar(const char *);
+#ifdef __SSE2__
+static const char	*lex_scan_sse2(const char *);
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+static const char	*lex_scan_avx2(const char *);
+#endif
+
+static int		 builtin_run(struct args *);
+static const struct builtin *builtin_find(const char *);
+static unsigned		 builtin_hash(const char *);
+static int		 exit_builtin(struct args *);
+static int		 break_builtin(struct args *);
+static int		 true_builtin(struct args *);
+static int		 false_builtin(struct args *);
+static int		 echo_builtin(struct args *);
+static int		 stdout_status(void);
+static void		 out_write(struct obuf *, const char *, size_t);
+static void		 out_putc(struct obuf *, int);
+static void		 out_puts(struct obuf *, const char *);
+static void		 out_printf(struct obuf *, const char *, ...)
+			    __attribute__ ((__format__ (__printf__, 2, 3)));
+static void		 out_flush(struct obuf *);
+static void		 out_direct(struct obuf *, const char *, size_t);
+static void		 out_atexit(void);
+static int		 esc_char(const char **, int);
+static int		 printf_builtin(struct args *);
+static intmax_t		 printf_int(const char *, int *);
+static double		 printf_float(const char *, int *);
+static int		 printf_once(const char *, char ***, char **, int *);
+static int		 pwd_builtin(struct args *);
+static int		 test_builtin(struct args *);
+static int		 test_short(struct texpr *);
+static int		 test_or(struct texpr *);
+static int		 test_and(struct texpr *);
+static int		 test_not(struct texpr *);
+static int		 test_unop(const char *);
+static int		 test_binop(const char *);
+static int		 test_unary(struct texpr *, const char *, const char *);
+static int		 test_binary(struct texpr *, const char *, const char *,
+			    const char *);
+static intmax_t		 test_int(struct texpr *, const char *);
+static int		 timespec_cmp(const struct timespec *,
+			    const struct timespec *);
+static int		 cd_builtin(struct args *);
+static int		 cd_to(const char *, const char *, int, int);
+static int		 proc_run(struct pipeline *, struct rusage *);
+static int		 proc_wait(pid_t, struct rusage *);
+static int		 time_run(struct pipeline *);
+
+static uint64_t		 stat_now(void);
+static uint64_t		 stat_add(enum phase, uint64_t);
+static unsigned		 hist_bucket(uint64_t);
+static uint64_t		 hist_high(unsigned);
+static uint64_t		 hist_pct(const struct hist *, double);
+static int		 ssistat_builtin(struct args *);
+static pid_t		 proc_spawn(struct args *, int, int);
+static pid_t		 proc_fork(struct args *, int, int);
+static int		 redir_flags(enum redir_type);
+static int		 redir_builtin(const struct builtin *, struct args *);
+static int		 assign_builtin(const struct builtin *, struct args *);
+static void		 redir_child(struct args *);
+static int		 redir_check(struct args *);
+static int		 pipesize_builtin(struct args *);
+static pid_t		 zygote_launch(struct args *, const char *, int, int);
+static void		 zygote_main(int) __attribute__ ((__noreturn__));
+static void		 zygote_fill(void);
+static void		 zygote_mother(int) __attribute__ ((__noreturn__));
+static pid_t		 zygote_pid(int);
+static void		 zygote_trim(int);
+static void		 zygote_forget(void);
+static void		 zygote_atexit(void);
+static int		 zygote_builtin(struct args *);
+
+static void		*arena_alloc(struct arena *, size_t);
+static void		*arena_grow(struct arena *, void *, size_t, size_t);
+static void		 arena_reset(struct arena *);
+static void		 arena_mark(struct arena *, struct amark *);
+static void		 arena_release(struct arena *, const struct amark *);
+static void		*pool_get(struct pool *);
+static void		 pool_put(struct pool *, void *);
 
-static int		 builtin_run(struct args **, const char *);
-static struct proc	**proc_run(struct args **, const char *);
-#if 0
-static void		 proc_free(struct proc **);
+static unsigned		 hash_str(const char *);
+static const char	*path_lookup(const char *);
+static char		*path_search(const char *, const char *);
+static const char	*cmd_lookup(struct args *);
+static void		 path_forget(const char *);
+static void		 path_clear(void);
+static int		 path_relative(const char *);
+static int		 hash_builtin(struct args *);
 
-static void		 bg_add(struct proc **);
-static void		 bg_print(struct proc **, char *);
+static unsigned		 var_hash(const char *, size_t);
+static int		 var_char(int, int);
+static int		 var_valid(const char *, size_t);
+static int		 var_cmp(const void *, const void *);
+static struct var	*var_slot(const char *, size_t);
+static struct var	*var_find(const char *, size_t);
+static const char	*var_get(const char *);
+static void		 var_set(const char *, size_t, const char *, int);
+static void		 var_unset(const char *);
+static void		 var_grow(void);
+static void		 var_init(void);
+static char		**var_env(void);
+static char		**var_env_cmd(struct args *);
+static size_t		 var_assign(const char *);
+static int		 var_assign_run(struct args *);
+static int		 export_builtin(struct args *);
+static int		 unset_builtin(struct args *);
+
+static void		 bg_add(const char *, size_t, const pid_t *, int);
+static void		 node_text(struct capture *, const struct node *);
+static void		 pipe_text(struct capture *, const struct pipeline *);
+static void		 word_text(struct capture *, const char *);
+static void		 bg_print(struct job *, const char *);
 static void		 bg_list(void);
-static struct proc	**bg_find(pid_t);
-static void		 bg_remove(struct proc **);
-static void		 bg_free(struct proc *);
-#endif
+static int		 bglist_builtin(struct args *);
+static void		 bg_hash_insert(struct jproc *);
+static struct jproc	*bg_find(pid_t);
+static void		 bg_done(struct jproc *);
+static void		 bg_remove(struct job *);
+static void		 bg_job_free(struct job *);
+static void		 bg_reap(int);
+static void		 bg_free(void);
+static void		 bg_forget(void);
+static int		 wait_builtin(struct args *);
+static int		 parallel_builtin(struct args *);
+static int		 parallel_read(int, char **, char ***);
+static int		 status_code(int);
 
 static void		 usage(void) __attribute__ ((__noreturn__));
 
+#include "builtins.h"
+
 /*
  * SSI: Simple Shell Interpreter
  *
  * Very basic Bourne Shell functionality.
  *
- * Caveats: Quoted arguments are not supported.
- *          Backslash escapes are not supported.
- *          'cd ~' will change to the user's home directory, but
+ * Caveats: 'cd ~' will change to the user's home directory, but
  *          no filename expansion is done on '~'.
  */
 int
 main(int argc, char *argv[])
 {
-	char		*line;			/* Readline returned line. */
-	const char	*home_dir;		/* User's home directory. */
-	struct args	**args;			/* Ptr to arguments struct. */
-	struct proc	**np;			/* Ptr to new process. */
-#if 0
-	pid_t		 ch_pid = 0;		/* Child process ID. */
-	struct proc	**bg_pid;		/* Ptr to ptr to bg struct. */
-#endif
+	char		*line;			/* tty_read() returned line. */
+	char		*cmd = NULL;		/* -c command string. */
+	int		 ch;			/* getopt(3) option. */
+	int		 ret = 0;		/* Last exit status. */
+	uint64_t	 t;			/* Start of current phase. */
+	static struct input tty_in = { NULL, NULL, 1 };
 
-	if (argc > 1) {
+	while ((ch = getopt(argc, argv, "c:fn")) != -1) {
+		switch (ch) {
+		case 'c':		/* Run command string, then exit. */
+			cmd = optarg;
+			break;
+		case 'f':		/* Always fork(2) and execvp(3). */
+			fflag = 1;
+			break;
+		case 'n':		/* Only parse, e.g. to check syntax. */
+			nflag = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1 || (cmd != NULL && argc > 0)) {
 		usage();
 	}
-	argc--;
-	argv++;			/* XXX To satiate the compiler. */
 
-	if ((home_dir = getenv("HOME")) == NULL) {
+	var_init();
+	if (var_get("HOME") == NULL) {
 		fprintf(stderr, "HOME environment variable not set");
 		err(1, "getenv");
 	}
 
+	lex_setup();
+	pwd_init();
+	bout.lbf = isatty(STDOUT_FILENO);
+	if (atexit(out_atexit) != 0) {
+		err(1, "atexit");
+	}
+
+	if (cmd != NULL) {			/* ssi -c command */
+		ret = script_run(cmd, strlen(cmd));
+		bg_free();
+		return ret;
+	}
+	if (argc == 1) {			/* ssi file */
+		ret = script_file(argv[0]);
+		bg_free();
+		return ret;
+	}
+
+	input = &tty_in;
+	tty_init();
 	cwd_prompt();
-	while ((line = readline(prompt)) != NULL) {
-#if 0
+	t = stat_now();
+	while ((line = tty_read(prompt)) != NULL) {
+		stat_add(PH_READ, t);
+
 		/* Check for processes in bglist that have finished. */
-		ch_pid = waitpid(WAIT_MYPGRP, NULL, WNOHANG);
-		while (ch_pid > 0) {		/* Child exited. */
-			/* Remove child from background process list. */
-			bg_pid = bg_find(ch_pid);
-			bg_remove(bg_pid);
-			free(*bg_pid);
-			/* Check for more children exiting. */
-			ch_pid = waitpid(WAIT_MYPGRP, NULL, WNOHANG);
-		}
-#endif
+		bg_reap(0);
 
-		/* Get arguments struct from command line. */
-		if ((args = args_parse(&line)) == NULL) {
-			free(line);
-			line = NULL;
-			continue;		/* Skip blank lines. */
+		/* Skip blank lines. Parsing splits line, so save it first. */
+		if (line[strspn(line, " \t")] != '\0') {
+			tty_history(line);
 		}
 
-		add_history(line);		/* Readline history. */
-
-		if ((np = proc_run(args, home_dir)) != NULL) {
-#if 0
-			/* Background process. */
-			bg_add(np);
-			np = NULL;
-#endif
-		}
+		ret = line_run(line);
 
 		/* Do not need the line anymore. Free it. */
 		free(line);
 		line = NULL;
+		arena_reset(&cmd_arena);
+		out_flush(&bout);
 
+		t = stat_now();
 		cwd_prompt();
+		t = stat_add(PH_PROMPT, t);
 	}
 
-#if 0
 	/* Free all structs for background processes, but dont kill them. */
-	bg_free(bghead);
-#endif
+	bg_free();
 
-	return 0;
+	return ret;
 }
 
-static void
-cwd_prompt(void)
+/*
+ * Parse and run the command starting on line, reading any more lines
+ * it needs from input. Lines are split up in place.
+ * Returns the exit status of the command, 2 for a syntax error, or
+ * $? as it was for a blank line.
+ */
+static int
+line_run(char *line)
 {
-	char		*buf;
-	char		*p;
+	struct node	*n;
+	uint64_t	 t;
 	int		 ret;
 
-	if ((buf = calloc(PATH_MAX, sizeof(char))) == NULL) {
-		err(1, "calloc");
+	/* Get the syntax tree of the command. */
+	t = stat_now();
+	ret = parse_line(line, &n);
+	stat_add(PH_PARSE, t);
+	if (ret == -1) {
+		return last_status = 2;
 	}
-
-	if ((p = getcwd(buf, PATH_MAX)) == NULL) {
-		err(1, "getcwd");
+	if (n == NULL || nflag) {
+		return last_status;
 	}
 
-	ret = snprintf(prompt, PROMPT_SIZE, "SSI: %s > ", buf);
-	if (ret == -1 || ret >= PROMPT_SIZE) {
-		free(buf);
-		buf = NULL;
-		err(1, "snprintf");
-	}
-	free(buf);
-	buf = NULL;
+	return node_run(n);
 }
 
 /*
- * Parse supplied string of text into separate arguments.
- * First argument is the command name.
- *
- * Note: Does not work with quotes or filenames with spaces, yet.
+ * Run parsed pipeline pl. Returns its exit status.
  */
-static struct args **
-args_parse(char **line)
+static int
+pipe_run(struct pipeline *pl)
 {
-	enum lex_state {
-			  IFS,
-			  OTHER
-	} l_state;
-
-	const char	 *ifs = " \t";	/* Delimiters between args. */
-	int		  argc;		/* Count of arguments in string. */
-	char		**argv;		/* Pointer to array of arg vectors. */
-	char		 *c;		/* Current token in string. */
+	/* 'time' times the whole pipeline, so is not a plain builtin. */
+	if (pl->cmds[0].argc > 0 && !strcmp(pl->cmds[0].argv[0], "time")) {
+		return time_run(pl);
+	}
 
-	char		 *p;		/* Pointer to strdup'd line. */
-	char		**ap;		/* Pointer to walk along line. */
-	struct args	*args;		/* All arg details from this line. */
-	struct args	**retargs;	/* All arg details from this line. */
+	return proc_run(pl, NULL);
+}
 
-	if (strlen(*line) == 0) {	/* Only work on strings with tokens. */
-		return NULL;
+/*
+ * Run list n a command at a time, setting $? after each, until the
+ * end or a break or continue. Returns the exit status of the last.
+ */
+static int
+node_run(struct node *n)
+{
+	for (; n != NULL && loop_brk == 0 && loop_cont == 0; n = n->next) {
+		last_status = node_one(n);
 	}
 
-	/* Choose initial state as IFS if first char is in ifs. */
-	(strspn(*line, ifs) > 0) ? (l_state = IFS) : (l_state = OTHER);
+	return last_status;
+}
 
-	/* Split line up based on ifs whitespace; count number of arguments. */
-	argc = 0;
-	for (c = *line; *c != '\0'; c++) {
-		switch (l_state) {
-		case IFS:
-			c += strspn(c, ifs) - 1;
-			l_state = OTHER;
-			break;
-		case OTHER:
-			argc++;
-			c += strcspn(c, ifs) - 1;
-			l_state = IFS;
-			break;
-		/* No default case since state is an enum; no other cases. */
-		}
-	}
+/*
+ * Run the single command n. Returns its exit status.
+ */
+static int
+node_one(struct node *n)
+{
+	int	 ret;
 
-	/* No args, just whitespace. Do nothing. */
-	if (argc == 0) {
-		return NULL;
+	switch (n->type) {
+	case N_PIPE:
+		return pipe_run(n->pl);
+	case N_AND:
+	case N_OR:
+		ret = last_status = node_one(n->left);
+		if (loop_brk == 0 && loop_cont == 0 &&
+		    (ret == 0) == (n->type == N_AND)) {
+			ret = node_one(n->right);
+		}
+		return ret;
+	case N_NOT:
+		return !node_one(n->left);
+	case N_IF:
+		ret = node_run(n->left);
+		if (loop_brk != 0 || loop_cont != 0) {
+			return ret;
+		}
+		if (ret == 0) {
+			return node_run(n->right);
+		}
+		return n->els != NULL ? node_run(n->els) : 0;
+	case N_WHILE:
+	case N_UNTIL:
+		return node_loop(n);
+	case N_FOR:
+		return node_for(n);
+	case N_CASE:
+		return node_case(n);
+	case N_BG:
+		return node_bg(n->left);
 	}
 
-	/* Need an argv on the heap, not on the stack, so calloc(). */
-	if ((argv = calloc((size_t)argc, sizeof(*argv))) == NULL) {
-		err(1, "calloc");
-	}
+	return 0;
+}
 
-	/* Need a copy of the line, since it will be clobbered. */
-	if ((p = strdup(*line)) == NULL) {
-		err(1, "strdup");
-	}
+/*
+ * while and until. Every pass goes back to the same point of the
+ * command arena, so a loop runs in constant memory, and a loop of
+ * builtins makes no calls to malloc(3) at all. Not inside $(...),
+ * though, whose output grows in the arena as the loop runs.
+ */
+static int
+node_loop(struct node *n)
+{
+	struct amark	 m;
+	int		 ret = 0;
+	int		 st;
 
-	/* Build argv. */
-	ap = argv;
-	while (ap < &argv[argc] && (*ap = strsep(&p, ifs)) != NULL) {
-		if (**ap != '\0') {
-			ap++;
+	loop_depth++;
+	arena_mark(&cmd_arena, &m);
+	for (;;) {
+		st = node_run(n->left);
+		if (loop_brk == 0 && loop_cont == 0) {
+			if ((st == 0) != (n->type == N_WHILE)) {
+				break;
+			}
+			ret = node_run(n->right);
+		}
+		if (bout.cap == NULL) {
+			arena_release(&cmd_arena, &m);
+		}
+		if (loop_stop()) {
+			break;
 		}
 	}
-	argv[argc] = (char *)NULL;		/* Last item must be NULL. */
+	loop_depth--;
 
-	/* bg without any arguments.
-	 * Must be done here since accessing argv[1] is a segfault.
-	 */
-	if (argc == 1 && !strcmp(argv[0], "bg")) {
-		warnx("%s: missing command argument", argv[0]);
-		free(argv);
-		argv = NULL;
-		free(p);
-		p = NULL;
+	return ret;
+}
 
-		return NULL;
-	}
+/*
+ * for name in words. The words are expanded once, before the first
+ * pass; passes reuse the arena as in node_loop().
+ */
+static int
+node_for(struct node *n)
+{
+	struct fields	 f;
+	struct amark	 m;
+	size_t		 vlen = strlen(n->var);
+	size_t		 i;
+	int		 ret = 0;
 
-	/* Allocate space on the heap for the struct to return. */
-	if ((args = calloc(1, sizeof(args))) == NULL) {
-		err(1, "calloc");
+	memset(&f, 0, sizeof(f));
+	if (expand_list(&f, n->words, n->nwords) == -1) {
+		return 1;
 	}
 
-	/* Populate the args struct. */
-	if (!strcmp(argv[0], "bg")) {
-		args->file = argv[1];		/* Skip first token (bg). */
-		args->realargv = argv;		/* For passing to free(). */
-		args->argv = &argv[1];		/* for passing to execvp(). */
-		args->argc = argc - 1;		/* - 1 because skipped bg. */
-		args->ps = STATE_BG;		/* Background execution. */
-	} else {
-		args->file = argv[0];		/* Use first token as file. */
-		args->realargv = argv;		/* For passing to free(). */
-		args->argv = argv;		/* for passing to execvp(). */
-		args->argc = argc;
-		args->ps = STATE_FG;		/* Foreground execution. */
+	loop_depth++;
+	arena_mark(&cmd_arena, &m);
+	for (i = 0; i < f.n; i++) {
+		var_set(n->var, vlen, f.v[i], 0);
+		ret = node_run(n->right);
+		if (bout.cap == NULL) {
+			arena_release(&cmd_arena, &m);
+		}
+		if (loop_stop()) {
+			break;
+		}
 	}
+	loop_depth--;
 
-	free(p);
-	p = NULL;
-	retargs = &args;
-	return retargs;
+	return ret;
 }
 
-static void
-args_free(struct args **aa)
+/*
+ * After a pass of a loop, returns 1 if a break, or a continue of an
+ * outer loop, ends it.
+ */
+static int
+loop_stop(void)
 {
-	struct args *a = *aa;
+	if (loop_brk > 0) {
+		loop_brk--;
+		return 1;
+	}
+	if (loop_cont > 1) {
+		loop_cont--;
+		return 1;
+	}
+	loop_cont = 0;
 
-	free(a->realargv);
-	a->realargv = NULL;
-	a->argv = NULL;
-	free(a);
+	return 0;
 }
 
+/*
+ * case: run the list of the first item with a pattern that matches
+ * the word, as fnmatch(3) sees it.
+ */
 static int
-builtin_run(struct args **aa, const char *home_dir)
+node_case(struct node *n)
 {
-	const char	*cmd;
-	struct args	*a = *aa;
-
-	cmd = basename(a->argv[0]);
-
-	if (!strcmp(cmd, "exit")) {		/* Exit shell. */
-		args_free(&a);
-		a = NULL;
+	struct arm	*arm;
+	const char	*word;
+	const char	*pat;
+	int		 i;
 
-		exit(0);
-	} else if (!strcmp(cmd, "cd")) {
-		switch (a->argc) {
-		case 1:				/* No args to cd. */
-			if (chdir(home_dir) == -1) {
-				warn("%s: %s", cmd, home_dir);
+	if ((word = expand_one(n->words[0])) == NULL) {
+		return 1;
+	}
+	for (arm = n->arms; arm != NULL; arm = arm->next) {
+		for (i = 0; i < arm->npats; i++) {
+			if ((pat = expand_one(arm->pats[i])) == NULL) {
+				return 1;
 			}
-			break;
-		case 2:				/* Only one arg to cd. */
-			if (!strcmp(a->argv[1], "~")) {
-				if (chdir(home_dir) == -1) {
-					warn("%s: %s", cmd, home_dir);
-				}
-			} else {		/* Plain cd dir. */
-				if (chdir(a->argv[1]) == -1) {
-					warn("%s: %s", cmd, a->argv[1]);
-				}
+			if (fnmatch(pat, word, 0) == 0) {
+				return arm->body != NULL ?
+				    node_run(arm->body) : 0;
 			}
-			break;
-		default:			/* More than one arg to cd. */
-			warnx("%s: too many arguments", cmd);
-			return 1;
 		}
-	} else if (!strcmp(cmd, "bglist")) {
-#if 0
-		/* Run through the bglist and print it out. */
-		bg_list();
-#endif
-	} else {				/* Not a builtin. */
-		return 1;
 	}
 
 	return 0;
 }
 
-static struct proc **
-proc_run(struct args **aa, const char *home_dir)
+/*
+ * An and-or list or compound command ended by &: run it in a forked
+ * subshell, as a background job. A lone pipeline is backgrounded by
+ * pipe_run() instead, without the extra process.
+ */
+static int
+node_bg(struct node *n)
 {
+	struct capture	 c = { NULL, 0, 0 };
 	pid_t		 pid;
-	struct proc	**np;
-	struct proc	*p;
-	struct args	*a = *aa;
-
-	if (builtin_run(aa, home_dir) == 0) {	/* Try builtin cmd first. */
-		args_free(aa);
-		aa = NULL;
-		return NULL;			/* Was a builtin command. */
-	} else {				/* fork() and exec() child. */
-		if ((pid = fork()) == -1) {
-			warn("fork");
-			args_free(aa);
-			aa = NULL;
 
-			return NULL;
-		}
+	out_flush(&bout);		/* Child must not repeat output. */
+	if ((pid = fork()) == -1) {
+		warn("fork");
+		return 1;
+	}
 
-		if (a->ps == STATE_BG) {	/* Background exec(). */
-			if (pid == 0) {		/* Child. */
+	if (pid == 0) {				/* Child. */
+		bout.cap = NULL;		/* Output goes to fd 1. */
+		zygote_forget();		/* Not its children. */
+		bg_forget();
+		last_status = node_one(n);
+		out_flush(&bout);
+		_exit(last_status);
+	}
 
-				/* Okay, now finally run the damn thing. */
-				if (execvp(a->file, a->argv) == -1) {
-					warnx("%s: not found", a->file);
-					args_free(aa);
-					aa = NULL;
+	node_text(&c, n);
+	bg_add(c.buf, c.len, &pid, 1);
 
-					_exit(127);	/* 127 cmd not found. */
-				}
-			} else {		/* Parent. */
-				/* Wait for non-blocking child. */
-				if (waitpid(WAIT_MYPGRP, NULL, WNOHANG) == -1) {
-					err(1, "waitpid");
-				}
+	return 0;
+}
 
-				/* Build up process struct. */
-				if ((p = calloc(1, sizeof(p))) == NULL) {
-					err(1, "calloc");
-				}
-				p->next = NULL;
-				p->pid = pid;
-				p->a = a;
+/*
+ * Run every line of the writable buffer buf of len bytes.
+ * Lines are NUL terminated in place, so tokens are slices of buf and
+ * nothing is copied. Returns the exit status of the last line.
+ */
+static int
+script_run(char *buf, size_t len)
+{
+	struct input	 in;
+	struct input	*prev = input;
+	char		*line;
+	int		 ret = 0;
+	uint64_t	 t;
+
+	in.p = buf;
+	in.end = buf + len;
+	in.tty = 0;
+	input = &in;
+
+	for (;;) {
+		t = stat_now();
+		line = input_line(&in, NULL);
+		stat_add(PH_READ, t);
+		if (line == NULL) {
+			break;
+		}
+		bg_reap(0);
+		ret = line_run(line);
+		arena_reset(&cmd_arena);
+	}
+
+	input = prev;
+
+	return ret;
+}
+
+/*
+ * Next line of in, without its newline, or NULL at the end. A script
+ * line is split off in place; a terminal line is read with tty_read()
+ * showing prompt, and copied into the command arena.
+ */
+static char *
+input_line(struct input *in, const char *prompt_str)
+{
+	char	*line;
+	char	*nl;
+	size_t	 n;
+
+	if (in->tty) {
+		if ((nl = tty_read(prompt_str)) == NULL) {
+			return NULL;
+		}
+		n = strlen(nl) + 1;
+		line = memcpy(arena_alloc(&cmd_arena, n), nl, n);
+		free(nl);
+		return line;
+	}
+
+	if (in->p >= in->end) {
+		return NULL;
+	}
+	line = in->p;
+	if ((nl = memchr(line, '\n', (size_t)(in->end - line))) == NULL) {
+		/* Final line has no newline and no room for a NUL. */
+		n = (size_t)(in->end - line);
+		line = memcpy(arena_alloc(&cmd_arena, n + 1), line, n);
+		line[n] = '\0';
+		in->p = in->end;
+		return line;
+	}
+	*nl = '\0';
+	in->p = nl + 1;
+
+	return line;
+}
+
+/*
+ * Set up line editing for commands read from a terminal: history is
+ * loaded from $HISTFILE, or ~/.ssi_history, and tab completes command
+ * and file names. An empty HISTFILE keeps history for this session only.
+ */
+static void
+tty_init(void)
+{
+#ifndef USE_READLINE
+	const char	*file;
+	const char	*home;
+	size_t		 n;
+
+	/*
+	 * linenoise reads lines that are not typed at a terminal with
+	 * stdio. Unbuffered, it takes no more than a line from commands
+	 * that read the rest of standard input.
+	 */
+	if (setvbuf(stdin, NULL, _IONBF, 0) != 0) {
+		err(1, "setvbuf");
+	}
+	if (!isatty(STDIN_FILENO)) {
+		return;
+	}
+
+	linenoiseHistorySetMaxLen(HISTORY_SIZE);
+	linenoiseSetCompletionCallback(tty_complete);
+
+	if ((file = var_get("HISTFILE")) != NULL) {
+		if (*file == '\0') {
+			return;
+		}
+		if ((histfile = strdup(file)) == NULL) {
+			err(1, "strdup");
+		}
+	} else {
+		home = var_get("HOME");
+		n = strlen(home) + sizeof("/" HISTORY_FILE);
+		if ((histfile = malloc(n)) == NULL) {
+			err(1, "malloc");
+		}
+		snprintf(histfile, n, "%s/%s", home, HISTORY_FILE);
+	}
+	linenoiseHistoryLoad(histfile);		/* Missing is fine. */
+	if (atexit(tty_atexit) != 0) {
+		err(1, "atexit");
+	}
+#endif
+}
+
+/*
+ * Read a line from the terminal showing prompt_str. Returns the line,
+ * to be free(3)d, or NULL at the end of input. Ctrl-C throws away the
+ * line being edited and starts another.
+ */
+static char *
+tty_read(const char *prompt_str)
+{
+#ifdef USE_READLINE
+	return readline(prompt_str);
+#else
+	char	*line;
+
+	for (;;) {
+		errno = 0;
+		if ((line = linenoise(prompt_str)) != NULL ||
+		    errno != EAGAIN) {
+			return line;
+		}
+	}
+#endif
+}
+
+/*
+ * Remember line in the history, and write it to the history file.
+ * Appends are cheap: linenoise only syncs the file now and then.
+ */
+static void
+tty_history(const char *line)
+{
+#ifdef USE_READLINE
+	add_history(line);
+#else
+	if (linenoiseHistoryAdd(line) && histfile != NULL) {
+		linenoiseHistoryAppend(histfile, 0);
+	}
+#endif
+}
+
+#ifndef USE_READLINE
+/*
+ * Write out and sync what is left of the history at exit.
+ */
+static void
+tty_atexit(void)
+{
+	linenoiseHistoryAppend(histfile, 1);
+}
+
+/*
+ * Tab completion of the last word of buf. The first word of a command
+ * completes to builtins and commands in PATH, others to file names.
+ * linenoise swaps in the whole line, so each completion is all of buf
+ * with the word finished.
+ */
+static void
+tty_complete(const char *buf, linenoiseCompletions *lc)
+{
+	const char	*word;
+	const char	*name;
+	const char	*p;
+	const char	*dir;
+	const char	*end;
+	size_t		 i;
+	size_t		 n;
+
+	word = buf + strlen(buf);
+	while (word > buf && strchr(" \t;&|()<>", word[-1]) == NULL) {
+		word--;
+	}
+	for (p = word; p > buf && (p[-1] == ' ' || p[-1] == '\t'); p--)
+		;
+
+	if ((name = strrchr(word, '/')) != NULL) {
+		name++;
+		tty_dir(lc, buf, word == name - 1 ? "/" : word,
+		    word == name - 1 ? 1 : (size_t)(name - 1 - word), name, 0);
+	} else if (p == buf || strchr(";&|(", p[-1]) != NULL) {
+		name = word;
+		n = strlen(name);
+		for (i = 0; i <= BUILTIN_MASK; i++) {
+			if (builtins[i].name != NULL &&
+			    !strncmp(builtins[i].name, name, n)) {
+				tty_add(lc, buf, name, builtins[i].name, "");
+			}
+		}
+		if ((dir = var_get("PATH")) == NULL) {
+			dir = "/usr/bin:/bin";
+		}
+		for (; dir != NULL; dir = *end ? end + 1 : NULL) {
+			end = strchrnul(dir, ':');
+			tty_dir(lc, buf, end == dir ? "." : dir,
+			    end == dir ? 1 : (size_t)(end - dir), name, 1);
+		}
+	} else {
+		tty_dir(lc, buf, ".", 1, word, 0);
+	}
+
+	/* Sorted, and each name once: PATH often lists a command twice. */
+	qsort(lc->cvec, lc->len, sizeof(*lc->cvec), str_cmp);
+	for (i = n = 0; i < lc->len; i++) {
+		if (n > 0 && !strcmp(lc->cvec[n - 1], lc->cvec[i])) {
+			free(lc->cvec[i]);
+		} else {
+			lc->cvec[n++] = lc->cvec[i];
+		}
+	}
+	lc->len = n;
+}
+
+/*
+ * Add to lc each entry of the dirlen bytes at dir that starts with
+ * name, the rest of buf. Directories get a trailing slash; with cmds,
+ * only executable files are taken.
+ */
+static void
+tty_dir(linenoiseCompletions *lc, const char *buf, const char *dir,
+    size_t dirlen, const char *name, int cmds)
+{
+	char		 path[PATH_MAX];
+	struct dirent	*de;
+	struct stat	 sb;
+	DIR		*d;
+	size_t		 n;
+
+	if (dirlen >= sizeof(path)) {
+		return;
+	}
+	memcpy(path, dir, dirlen);
+	path[dirlen] = '\0';
+	if ((d = opendir(path)) == NULL) {
+		return;
+	}
+	n = strlen(name);
+	while ((de = readdir(d)) != NULL) {
+		/* Dot files only when asked for, and never . or .. */
+		if (strncmp(de->d_name, name, n) != 0 ||
+		    (de->d_name[0] == '.' && (name[0] != '.' ||
+		    de->d_name[1 + (de->d_name[1] == '.')] == '\0'))) {
+			continue;
+		}
+		if (fstatat(dirfd(d), de->d_name, &sb, 0) == -1) {
+			continue;
+		}
+		if (cmds && (!S_ISREG(sb.st_mode) ||
+		    faccessat(dirfd(d), de->d_name, X_OK, 0) == -1)) {
+			continue;
+		}
+		tty_add(lc, buf, name, de->d_name,
+		    S_ISDIR(sb.st_mode) ? "/" : "");
+	}
+	closedir(d);
+}
+
+/*
+ * Add to lc buf with name, its last word or the end of it, replaced by
+ * s and suffix.
+ */
+static void
+tty_add(linenoiseCompletions *lc, const char *buf, const char *name,
+    const char *s, const char *suffix)
+{
+	char	 line[2 * PATH_MAX];
+	int	 len;
+
+	len = snprintf(line, sizeof(line), "%.*s%s%s", (int)(name - buf), buf,
+	    s, suffix);
+	if (len >= 0 && (size_t)len < sizeof(line)) {
+		linenoiseAddCompletion(lc, line);
+	}
+}
+
+/*
+ * qsort(3) order of strings.
+ */
+static int
+str_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+#endif
+
+/*
+ * Read the body of a here-document from the lines after the current
+ * one, up to a line that is just delim. With strip, leading tabs are
+ * removed from each line and the delimiter. Returns the body, its
+ * length in *lenp, in the command arena.
+ */
+static char *
+heredoc_read(const char *delim, int strip, size_t *lenp)
+{
+	char	*body;
+	char	*nb;
+	char	*line;
+	size_t	 cap = 256;
+	size_t	 len = 0;
+	size_t	 n;
+
+	body = arena_alloc(&cmd_arena, cap);
+	for (;;) {
+		if (input == NULL || (line = input_line(input, "> ")) == NULL) {
+			parse_warn("here-document ended by end of file "
+			    "(wanted '%s')", delim);
+			break;
+		}
+		if (strip) {
+			line += strspn(line, "\t");
+		}
+		if (!strcmp(line, delim)) {
+			break;
+		}
+		n = strlen(line);
+		if (len + n + 1 > cap) {
+			while (len + n + 1 > cap) {
+				cap *= 2;
+			}
+			nb = arena_alloc(&cmd_arena, cap);
+			memcpy(nb, body, len);
+			body = nb;
+		}
+		memcpy(body + len, line, n);
+		len += n;
+		body[len++] = '\n';
+	}
+	*lenp = len;
+
+	return body;
+}
+
+/*
+ * Put the text of each here-document of pl in an anonymous memfd, to
+ * be passed to its command as a file. Unlike a pipe, a memfd takes
+ * any size without the shell blocking, and nothing touches the disk.
+ * Returns -1 if one could not be made.
+ */
+static int
+heredoc_open(struct pipeline *pl)
+{
+	struct redir	*r;
+	ssize_t		 w;
+	size_t		 off;
+	int		 i;
+
+	for (i = 0; i < pl->ncmds; i++) {
+		for (r = pl->cmds[i].redir; r != NULL; r = r->next) {
+			if (r->type != R_DOC) {
+				continue;
+			}
+			r->src = memfd_create("ssi-heredoc", MFD_CLOEXEC);
+			if (r->src == -1) {
+				warn("memfd_create");
+				heredoc_close(pl);
+				return -1;
+			}
+			/* pwrite(2) leaves the offset at 0 for the reader. */
+			for (off = 0; off < r->len; off += (size_t)w) {
+				w = pwrite(r->src, r->file + off, r->len - off,
+				    (off_t)off);
+				if (w == -1) {
+					warn("here-document");
+					heredoc_close(pl);
+					return -1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Expand the words of a marked with EXP_MARK into fields, and its
+ * assignments and redirection targets into single words, just before
+ * a runs. The parsed words and redirections are left as they are,
+ * for a loop to run them again; a gets copies in the command arena.
+ * Returns -1 on error.
+ */
+static int
+expand_args(struct args *a)
+{
+	struct fields	  f;
+	struct redir	 *r;
+	struct redir	**rtail;
+	size_t		  n;
+	size_t		  j;
+	int		  i;
+
+	if (a->nassign > 0) {
+		a->assign = memcpy(arena_alloc(&cmd_arena,
+		    (size_t)a->nassign * sizeof(*a->assign)), a->assign,
+		    (size_t)a->nassign * sizeof(*a->assign));
+	}
+
+	/* Assignment values are single words, never split. */
+	for (i = 0; i < a->nassign; i++) {
+		if (a->assign[i][0] != EXP_MARK) {
+			continue;
+		}
+		n = var_assign(a->assign[i]);
+		memset(&f, 0, sizeof(f));
+		for (j = 0; j < n; j++) {
+			field_add(&f, a->assign[i] + 2 + 2 * j, 1);
+		}
+		field_add(&f, "=", 1);
+		if (expand_word(a->assign[i] + 1 + 2 * (n + 1), &f, 0) == -1) {
+			return -1;
+		}
+		field_add(&f, "", 1);
+		a->assign[i] = f.buf;
+	}
+
+	memset(&f, 0, sizeof(f));
+	if (expand_list(&f, a->argv, a->argc) == -1) {
+		return -1;
+	}
+	field_push(&f, NULL);
+	a->argv = f.v;
+	a->argc = (int)f.n - 1;
+	a->file = a->argv[0];
+
+	for (rtail = &a->redir; *rtail != NULL; rtail = &r->next) {
+		r = memcpy(arena_alloc(&cmd_arena, sizeof(*r)), *rtail,
+		    sizeof(*r));
+		*rtail = r;
+		if (r->type == R_DOC || r->file == NULL ||
+		    r->file[0] != EXP_MARK) {
+			continue;
+		}
+		memset(&f, 0, sizeof(f));
+		if (expand_word(r->file + 1, &f, 0) == -1) {
+			return -1;
+		}
+		field_end(&f);
+		if (f.n != 1) {
+			warnx("ambiguous redirect");
+			return -1;
+		}
+		r->file = f.v[0];
+	}
+	a->expand = 0;
+
+	return 0;
+}
+
+/*
+ * Expand the n words of v onto f, one or more fields from each word
+ * marked with EXP_MARK, and the others as they are. Returns -1 on
+ * error.
+ */
+static int
+expand_list(struct fields *f, char **v, int n)
+{
+	int	 i;
+
+	for (i = 0; i < n; i++) {
+		if (v[i][0] != EXP_MARK) {
+			field_push(f, v[i]);
+			continue;
+		}
+		if (expand_word(v[i] + 1, f, 1) == -1) {
+			return -1;
+		}
+		field_end(f);
+	}
+
+	return 0;
+}
+
+/*
+ * Expand word w, if it is marked with EXP_MARK, into a single word
+ * in the command arena, as for an assignment. Returns NULL on error.
+ */
+static char *
+expand_one(char *w)
+{
+	struct fields	 f;
+
+	if (w[0] != EXP_MARK) {
+		return w;
+	}
+	memset(&f, 0, sizeof(f));
+	if (expand_word(w + 1, &f, 0) == -1) {
+		return NULL;
+	}
+	field_add(&f, "", 1);
+
+	return f.buf;
+}
+
+/*
+ * Expand raw word p, as left by lex_raw(), onto f: remove quotes and
+ * backslashes, substitute variables and run command substitutions.
+ * With split, the result of an expansion outside "" is split into
+ * fields at blanks.
+ */
+static int
+expand_word(const char *p, struct fields *f, int split)
+{
+	const char	*q;
+	char		*out;
+	size_t		 n;
+	int		 dq = 0;
+
+	while (*p != '\0') {
+		switch (*p) {
+		case '\'':
+			if (dq) {
+				break;
+			}
+			q = strchr(p + 1, '\'');
+			field_add(f, p + 1, (size_t)(q - p - 1));
+			f->open = 1;
+			p = q + 1;
+			continue;
+		case '"':
+			dq = !dq;
+			f->open = 1;
+			p++;
+			continue;
+		case '\\':
+			if (p[1] == '\0') {
+				break;
+			}
+			if (!dq || strchr("$`\"\\\n", p[1]) != NULL) {
+				p++;
+			}
+			break;
+		case '$':
+			if (p[1] == '{' || p[1] == '?' ||
+			    var_char((unsigned char)p[1], 1)) {
+				p = expand_var(p + 1, f, split && !dq);
+				if (p == NULL) {
+					return -1;
+				}
+				continue;
+			}
+			if (p[1] != '(') {
+				break;
+			}
+			if ((q = lex_paren(p + 2)) == NULL) {
+				warnx("syntax error: unterminated $(");
+				return -1;
+			}
+			out = subst_run(p + 2, (size_t)(q - p - 3), &n);
+			if (dq || !split) {
+				field_add(f, out, n);
+			} else {
+				field_split(f, out, n);
+			}
+			p = q;
+			continue;
+		}
+		field_add(f, p++, 1);
+		f->open = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Substitute the variable named at p, just past its '$', either NAME
+ * or {NAME}, onto f. An unset variable is empty, and ? is the exit
+ * status of the last pipeline. Returns the byte after the name, or
+ * NULL if it is not a valid one.
+ */
+static const char *
+expand_var(const char *p, struct fields *f, int split)
+{
+	const char	*name = p;
+	const char	*end;
+	struct var	*v;
+	const char	*val;
+	char		 num[16];
+
+	if (*p == '?' || !strncmp(p, "{?}", 3)) {
+		snprintf(num, sizeof(num), "%d", last_status);
+		field_add(f, num, strlen(num));
+		return p + (*p == '?' ? 1 : 3);
+	}
+	if (*p == '{') {
+		name = ++p;
+		if ((p = strchr(p, '}')) == NULL || !var_valid(name,
+		    (size_t)(p - name))) {
+			warnx("${%.*s: bad substitution",
+			    p != NULL ? (int)(p - name) + 1 : (int)strlen(name),
+			    name);
+			return NULL;
+		}
+		end = p++;
+	} else {
+		while (var_char((unsigned char)*p, p == name)) {
+			p++;
+		}
+		end = p;
+	}
+
+	v = var_find(name, (size_t)(end - name));
+	if (v == NULL || v->str[v->nlen] != '=') {
+		return p;
+	}
+	val = v->str + v->nlen + 1;
+	if (split) {
+		field_split(f, val, strlen(val));
+	} else {
+		field_add(f, val, strlen(val));
+	}
+
+	return p;
+}
+
+/*
+ * Append n bytes of s to the field being built.
+ */
+static void
+field_add(struct fields *f, const char *s, size_t n)
+{
+	size_t	 size;
+
+	if (f->len + n + 1 > f->size) {
+		size = f->size ? f->size * 2 : 64;
+		while (size < f->len + n + 1) {
+			size *= 2;
+		}
+		f->buf = arena_grow(&cmd_arena, f->buf, f->size, size);
+		f->size = size;
+	}
+	memcpy(f->buf + f->len, s, n);
+	f->len += n;
+}
+
+/*
+ * Append the n bytes of unquoted expansion s: blanks end fields and
+ * are dropped, so one substitution may make many arguments, or none.
+ */
+static void
+field_split(struct fields *f, const char *s, size_t n)
+{
+	const char	*end = s + n;
+	const char	*w;
+
+	while (s < end) {
+		if (*s == ' ' || *s == '\t' || *s == '\n') {
+			field_end(f);
+			s++;
+			continue;
+		}
+		w = s;
+		while (s < end && *s != ' ' && *s != '\t' && *s != '\n') {
+			s++;
+		}
+		field_add(f, w, (size_t)(s - w));
+		f->open = 1;
+	}
+}
+
+/*
+ * Finish the field being built, if there is one.
+ */
+static void
+field_end(struct fields *f)
+{
+	char	*v;
+
+	if (!f->open && f->len == 0) {
+		return;
+	}
+	v = arena_alloc(&cmd_arena, f->len + 1);
+	memcpy(v, f->buf, f->len);
+	field_push(f, v);
+	f->len = 0;
+	f->open = 0;
+}
+
+/*
+ * Add the finished field s.
+ */
+static void
+field_push(struct fields *f, char *s)
+{
+	if (f->n == f->cap) {
+		f->v = arena_grow(&cmd_arena, f->v, f->cap * sizeof(*f->v),
+		    (f->cap ? f->cap * 2 : 16) * sizeof(*f->v));
+		f->cap = f->cap ? f->cap * 2 : 16;
+	}
+	f->v[f->n++] = s;
+}
+
+/*
+ * Run the n bytes of commands at cmd and return their output, with
+ * its length in *lenp, less trailing newlines.
+ * Output is collected in the command arena: pure builtins write into
+ * it straight from their output buffer, with no fork or pipe at all,
+ * and other commands write to a pipe that is read with large read(2)
+ * calls into the same growing buffer.
+ */
+static char *
+subst_run(const char *cmd, size_t n, size_t *lenp)
+{
+	struct capture	 cap = { NULL, 0, 0 };
+	struct capture	*prevcap;
+	struct input	 in;
+	struct input	*prev = input;
+	char		*line;
+	int		 lbf;
+	int		 depth = loop_depth;
+
+	/* Lines are split in place, so work on a copy. */
+	in.p = memcpy(arena_alloc(&cmd_arena, n + 1), cmd, n);
+	in.end = in.p + n;
+	in.tty = 0;
+
+	out_flush(&bout);
+	prevcap = bout.cap;
+	lbf = bout.lbf;
+	bout.cap = &cap;
+	bout.lbf = 0;
+	input = &in;
+	loop_depth = 0;			/* break cannot leave the $(...). */
+
+	while ((line = input_line(&in, NULL)) != NULL) {
+		line_run(line);
+	}
+
+	loop_depth = depth;
+	input = prev;
+	out_flush(&bout);
+	bout.cap = prevcap;
+	bout.lbf = lbf;
+
+	while (cap.len > 0 && cap.buf[cap.len - 1] == '\n') {
+		cap.len--;
+	}
+	*lenp = cap.len;
+
+	return cap.buf != NULL ? cap.buf : "";
+}
+
+/*
+ * Append n bytes of s to capture c.
+ */
+static void
+capture_add(struct capture *c, const char *s, size_t n)
+{
+	size_t	 size;
+
+	if (c->len + n > c->size) {
+		size = c->size ? c->size * 2 : 4096;
+		while (size < c->len + n) {
+			size *= 2;
+		}
+		c->buf = arena_grow(&cmd_arena, c->buf, c->size, size);
+		c->size = size;
+	}
+	memcpy(c->buf + c->len, s, n);
+	c->len += n;
+}
+
+/*
+ * Read fd to its end into capture c, at least SUBST_READ bytes at a
+ * time straight into its buffer.
+ */
+static void
+capture_fd(struct capture *c, int fd)
+{
+	ssize_t	 n;
+	size_t	 size;
+
+	for (;;) {
+		if (c->size - c->len < SUBST_READ) {
+			size = c->size ? c->size * 2 : SUBST_READ;
+			while (size - c->len < SUBST_READ) {
+				size *= 2;
+			}
+			c->buf = arena_grow(&cmd_arena, c->buf, c->size, size);
+			c->size = size;
+		}
+		if ((n = read(fd, c->buf + c->len, c->size - c->len)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			warn("read");
+			return;
+		}
+		if (n == 0) {
+			return;
+		}
+		c->len += (size_t)n;
+	}
+}
+
+/*
+ * Close the memfds of the here-documents of pl, once launched.
+ */
+static void
+heredoc_close(struct pipeline *pl)
+{
+	struct redir	*r;
+	int		 i;
+
+	for (i = 0; i < pl->ncmds; i++) {
+		for (r = pl->cmds[i].redir; r != NULL; r = r->next) {
+			if (r->type == R_DOC && r->src > 0) {
+				close(r->src);
+				r->src = 0;
+			}
+		}
+	}
+}
+
+/*
+ * Run script file path. The file is mapped privately and writably, so
+ * lines can be split in place without reading or copying the file;
+ * only the pages that get NUL terminators are copied by the kernel.
+ *
+ * A script is compiled on its first run: every line is parsed up
+ * front into a cache file, which later runs map and run as it is,
+ * without reading or parsing the script at all. A script that the
+ * parser complains about is only ever run line by line, so that its
+ * messages come out in order.
+ */
+static int
+script_file(const char *path)
+{
+	struct stat	 sb;
+	struct creader	 cr;
+	struct cbuf	 cb = { NULL, 0, 0 };
+	char		 rpath[PATH_MAX];	/* Script, the cache key. */
+	char		 cpath[PATH_MAX];	/* Its cache file. */
+	char		*buf;
+	void		*cache = NULL;
+	size_t		 clen = 0;
+	int		 fd;
+	int		 ret;
+	int		 cached;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		err(127, "%s", path);
+	}
+	if (fstat(fd, &sb) == -1) {
+		err(1, "%s", path);
+	}
+	if (!S_ISREG(sb.st_mode)) {
+		errx(126, "%s: not a regular file", path);
+	}
+	if (sb.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	cached = !nflag && cache_path(path, rpath, cpath) == 0;
+	if (cached &&
+	    (cache = cache_load(cpath, rpath, &sb, &cr, &clen)) != NULL) {
+		close(fd);
+		ret = cache_exec(&cr);
+		if (cr.bad) {
+			unlink(cpath);
+		}
+		munmap(cache, clen);
+		return ret;
+	}
+
+	buf = script_map(fd, &sb);
+	if (cached) {
+		if (cache_compile(buf, (size_t)sb.st_size, rpath, &sb,
+		    &cb) == 0) {
+			close(fd);
+			munmap(buf, (size_t)sb.st_size);
+			cache_save(cpath, &cb);
+			clen = CACHE_RECORDS(strlen(rpath));
+			cache_reader(&cr, cb.buf + clen, cb.len - clen);
+			ret = cache_exec(&cr);
+			free(cb.buf);
+			return ret;
+		}
+		free(cb.buf);
+		unlink(cpath);		/* Any for an older version. */
+
+		/* Parsing split the lines, so map the script afresh. */
+		munmap(buf, (size_t)sb.st_size);
+		buf = script_map(fd, &sb);
+	}
+	close(fd);
+
+	ret = script_run(buf, (size_t)sb.st_size);
+
+	munmap(buf, (size_t)sb.st_size);
+
+	return ret;
+}
+
+/*
+ * Map the open script fd, of the size in sb, privately and writably.
+ */
+static char *
+script_map(int fd, const struct stat *sb)
+{
+	char	*buf;
+
+	buf = mmap(NULL, (size_t)sb->st_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	(void)madvise(buf, (size_t)sb->st_size, MADV_SEQUENTIAL);
+
+	return buf;
+}
+
+/*
+ * Work out the cache file of script path: its real path, in rpath,
+ * hashed into a name in $XDG_CACHE_HOME/ssi, or ~/.cache/ssi, in
+ * cpath. Both buffers are PATH_MAX bytes. Returns -1 if there is no
+ * cache directory to use, or if it exists but someone else could
+ * have written compiled scripts into it.
+ */
+static int
+cache_path(const char *path, char *rpath, char *cpath)
+{
+	struct stat	 sb;
+	const char	*dir;
+	const char	*s;
+	char		*slash;
+	uint64_t	 h = 14695981039346656037u;
+	int		 bad;
+	int		 n;
+
+	if (realpath(path, rpath) == NULL) {
+		return -1;
+	}
+	for (s = rpath; *s != '\0'; s++) {
+		h = (h ^ (unsigned char)*s) * 1099511628211u;
+	}
+
+	if ((dir = var_get("XDG_CACHE_HOME")) != NULL && dir[0] == '/') {
+		n = snprintf(cpath, PATH_MAX, "%s/ssi/%016" PRIx64, dir, h);
+	} else if ((dir = var_get("HOME")) != NULL && dir[0] == '/') {
+		n = snprintf(cpath, PATH_MAX, "%s/.cache/ssi/%016" PRIx64,
+		    dir, h);
+	} else {
+		return -1;
+	}
+	if (n < 0 || n >= PATH_MAX) {
+		return -1;
+	}
+
+	/* It must be ours, and writable by no one else. */
+	slash = strrchr(cpath, '/');
+	*slash = '\0';
+	bad = stat(cpath, &sb) == 0 && (sb.st_uid != geteuid() ||
+	    (sb.st_mode & (S_IWGRP | S_IWOTH)) != 0);
+	*slash = '/';
+
+	return bad ? -1 : 0;
+}
+
+/*
+ * Fill in h, the header that the cache file of script rpath, whose
+ * stat is sb, must have. It also names the ssi that wrote it, so a
+ * rebuilt shell never runs records made by an older one.
+ * Returns -1 if ssi cannot find itself.
+ */
+static int
+cache_header(struct cache_hdr *h, const char *rpath, const struct stat *sb)
+{
+	static struct stat	 exe;
+	static int		 have_exe;
+
+	if (!have_exe) {
+		if (stat("/proc/self/exe", &exe) == -1) {
+			return -1;
+		}
+		have_exe = 1;
+	}
+
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, CACHE_MAGIC, sizeof(h->magic));
+	h->format = CACHE_FORMAT;
+	h->pathlen = (uint32_t)strlen(rpath);
+	h->exe_size = (uint64_t)exe.st_size;
+	h->exe_mtime = (int64_t)exe.st_mtim.tv_sec * 1000000000 +
+	    exe.st_mtim.tv_nsec;
+	h->size = (uint64_t)sb->st_size;
+	h->mtime = (int64_t)sb->st_mtim.tv_sec * 1000000000 +
+	    sb->st_mtim.tv_nsec;
+	h->dev = (uint64_t)sb->st_dev;
+	h->ino = (uint64_t)sb->st_ino;
+
+	return 0;
+}
+
+/*
+ * Map cache file cpath, if it is the compiled form of the script
+ * rpath as it is now, described by sb. Returns the mapping, of *lenp
+ * bytes, with cr set up to read its records; or NULL.
+ */
+static void *
+cache_load(const char *cpath, const char *rpath, const struct stat *sb,
+    struct creader *cr, size_t *lenp)
+{
+	struct cache_hdr	 want;
+	struct stat		 cs;
+	char			*p;
+	size_t			 off;
+	int			 fd;
+
+	if (cache_header(&want, rpath, sb) == -1) {
+		return NULL;
+	}
+	if ((fd = open(cpath, O_RDONLY | O_CLOEXEC)) == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &cs) == -1 || cs.st_uid != geteuid() ||
+	    (size_t)cs.st_size < sizeof(want) + want.pathlen) {
+		close(fd);
+		return NULL;
+	}
+	want.len = (uint64_t)cs.st_size;
+
+	/* Writable, but private: argv strings are used in place. */
+	p = mmap(NULL, (size_t)cs.st_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+	if (memcmp(p, &want, sizeof(want)) != 0 ||
+	    memcmp(p + sizeof(want), rpath, want.pathlen) != 0) {
+		munmap(p, (size_t)cs.st_size);
+		return NULL;
+	}
+
+	off = CACHE_RECORDS(want.pathlen);
+	cache_reader(cr, p + off, (size_t)cs.st_size - off);
+	*lenp = (size_t)cs.st_size;
+
+	return p;
+}
+
+/*
+ * Parse every line of the n byte script buf, the script rpath with
+ * stat sb, into cb: a cache file header, then the records of the list
+ * of commands of each line, with any lines after it that it takes up.
+ * Lines are split in place. Returns -1, with nothing said,
+ * if the parser had anything to complain about.
+ */
+static int
+cache_compile(char *buf, size_t n, const char *rpath,
+    const struct stat *sb, struct cbuf *cb)
+{
+	struct cache_hdr	 h;
+	struct input		 in;
+	struct input		*prev = input;
+	struct node		*list;
+	char			*line;
+	uint64_t		 t;
+
+	if (cache_header(&h, rpath, sb) == -1) {
+		return -1;
+	}
+	cache_put(cb, &h, sizeof(h));
+	cache_put(cb, rpath, h.pathlen);
+	cache_put(cb, "\0\0\0\0\0\0\0", CACHE_RECORDS(h.pathlen) - cb->len);
+
+	in.p = buf;
+	in.end = buf + n;
+	in.tty = 0;
+	input = &in;
+	compiling = 1;
+	compile_err = 0;
+
+	t = stat_now();
+	while (!compile_err && (line = input_line(&in, NULL)) != NULL) {
+		if (parse_line(line, &list) == 0 && list != NULL &&
+		    !compile_err) {
+			cache_list(cb, list);
+		}
+		arena_reset(&cmd_arena);
+	}
+	stat_add(PH_PARSE, t);
+
+	compiling = 0;
+	input = prev;
+	if (compile_err) {
+		return -1;
+	}
+
+	h.len = cb->len;
+	memcpy(cb->buf, &h, sizeof(h));
+
+	return 0;
+}
+
+/*
+ * Write cb to cache file cpath, making its directory if need be.
+ * It is written to a temporary file and renamed into place, so that
+ * other shells only ever see a whole cache file. Failing to write a
+ * cache is not an error, so nothing is reported.
+ */
+static void
+cache_save(const char *cpath, const struct cbuf *cb)
+{
+	char		 tmp[PATH_MAX + 8];
+	char		*slash;
+	size_t		 off;
+	ssize_t		 w;
+	int		 fd;
+	int		 i;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cpath);
+	if ((fd = mkstemp(tmp)) == -1) {
+		/* Make .../ssi, or its parent first, then try again. */
+		for (i = 2; i > 0; i--) {
+			memcpy(tmp, cpath, strlen(cpath) + 1);
+			slash = strrchr(tmp, '/');
+			*slash = '\0';
+			if (i == 2 && (slash = strrchr(tmp, '/')) != NULL) {
+				*slash = '\0';
+			}
+			(void)mkdir(tmp, 0700);
+		}
+		snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cpath);
+		if ((fd = mkstemp(tmp)) == -1) {
+			return;
+		}
+	}
+
+	for (off = 0; off < cb->len; off += (size_t)w) {
+		if ((w = write(fd, cb->buf + off, cb->len - off)) == -1) {
+			close(fd);
+			unlink(tmp);
+			return;
+		}
+	}
+	if (close(fd) == -1 || rename(tmp, cpath) == -1) {
+		unlink(tmp);
+	}
+}
+
+/*
+ * Run the lists read by cr, one for each line of the script. Returns
+ * the exit status of the last. If a record is cut short, cr->bad is
+ * set.
+ */
+static int
+cache_exec(struct creader *cr)
+{
+	struct node	*n;
+	int		 ret = 0;
+	uint64_t	 t;
+
+	while (cr->p < cr->end) {
+		t = stat_now();
+		n = cache_getlist(cr);
+		stat_add(PH_PARSE, t);
+		if (cr->bad) {
+			warnx("corrupt script cache");
+			return 1;
+		}
+		bg_reap(0);
+		ret = node_run(n);
+		arena_reset(&cmd_arena);
+	}
+
+	return ret;
+}
+
+/*
+ * Append n bytes of p to cb.
+ */
+static void
+cache_put(struct cbuf *cb, const void *p, size_t n)
+{
+	size_t	 cap;
+
+	if (cb->len + n > cb->cap) {
+		cap = cb->cap ? cb->cap * 2 : 65536;
+		while (cap < cb->len + n) {
+			cap *= 2;
+		}
+		if ((cb->buf = realloc(cb->buf, cap)) == NULL) {
+			err(1, "realloc");
+		}
+		cb->cap = cap;
+	}
+	memcpy(cb->buf + cb->len, p, n);
+	cb->len += n;
+}
+
+/*
+ * Append the number v to cb, in as few bytes as it needs.
+ */
+static void
+cache_num(struct cbuf *cb, uint32_t v)
+{
+	unsigned char	 b[5];
+	size_t		 n = 0;
+
+	while (v >= 0x80) {
+		b[n++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	b[n++] = (unsigned char)v;
+	cache_put(cb, b, n);
+}
+
+/*
+ * Append the n byte string s, which may be NULL, to cb.
+ */
+static void
+cache_str(struct cbuf *cb, const char *s, size_t n)
+{
+	if (s == NULL) {
+		cache_num(cb, 0);
+		return;
+	}
+	cache_num(cb, (uint32_t)n + 1);
+	cache_put(cb, s, n);
+	cache_put(cb, "", 1);
+}
+
+/*
+ * Append the records of list n to cb, ended by CR_END.
+ */
+static void
+cache_list(struct cbuf *cb, const struct node *n)
+{
+	for (; n != NULL; n = n->next) {
+		cache_node(cb, n);
+	}
+	cache_num(cb, CR_END);
+}
+
+/*
+ * Append the record of the single command n to cb.
+ */
+static void
+cache_node(struct cbuf *cb, const struct node *n)
+{
+	const struct arm	*arm;
+	uint32_t		 narms = 0;
+
+	switch (n->type) {
+	case N_PIPE:
+		cache_pipeline(cb, n->pl);
+		break;
+	case N_AND:
+	case N_OR:
+		cache_num(cb, n->type == N_AND ? CR_AND : CR_OR);
+		cache_node(cb, n->left);
+		cache_node(cb, n->right);
+		break;
+	case N_NOT:
+	case N_BG:
+		cache_num(cb, n->type == N_NOT ? CR_NOT : CR_BG);
+		cache_node(cb, n->left);
+		break;
+	case N_IF:
+		cache_num(cb, CR_IF);
+		cache_list(cb, n->left);
+		cache_list(cb, n->right);
+		cache_list(cb, n->els);
+		break;
+	case N_WHILE:
+	case N_UNTIL:
+		cache_num(cb, n->type == N_WHILE ? CR_WHILE : CR_UNTIL);
+		cache_list(cb, n->left);
+		cache_list(cb, n->right);
+		break;
+	case N_FOR:
+		cache_num(cb, CR_FOR);
+		cache_str(cb, n->var, strlen(n->var));
+		cache_words(cb, n->words, n->nwords);
+		cache_list(cb, n->right);
+		break;
+	case N_CASE:
+		cache_num(cb, CR_CASE);
+		cache_words(cb, n->words, n->nwords);
+		for (arm = n->arms; arm != NULL; arm = arm->next) {
+			narms++;
+		}
+		cache_num(cb, narms);
+		for (arm = n->arms; arm != NULL; arm = arm->next) {
+			cache_words(cb, arm->pats, arm->npats);
+			cache_list(cb, arm->body);
+		}
+		break;
+	}
+}
+
+/*
+ * Append the count of the n words of v, then the words, to cb.
+ */
+static void
+cache_words(struct cbuf *cb, char **v, int n)
+{
+	int	 i;
+
+	cache_num(cb, (uint32_t)n);
+	for (i = 0; i < n; i++) {
+		cache_str(cb, v[i], strlen(v[i]));
+	}
+}
+
+/*
+ * Append the record of pipeline pl to cb, with everything needed to
+ * run it. Here-document bodies go in it whole.
+ */
+static void
+cache_pipeline(struct cbuf *cb, const struct pipeline *pl)
+{
+	const struct args	*a;
+	const struct redir	*r;
+	uint32_t		 nredir;
+	int			 i;
+	int			 j;
+
+	cache_num(cb, CR_PIPE);
+	cache_num(cb, pl->ps == STATE_BG);
+	cache_num(cb, (uint32_t)pl->ncmds);
+	cache_num(cb, (uint32_t)pl->ndocs);
+	for (i = 0; i < pl->ncmds; i++) {
+		a = &pl->cmds[i];
+		nredir = 0;
+		for (r = a->redir; r != NULL; r = r->next) {
+			nredir++;
+		}
+		cache_num(cb, (uint32_t)a->nassign);
+		cache_num(cb, (uint32_t)a->argc);
+		cache_num(cb, nredir);
+		cache_num(cb, (uint32_t)a->expand);
+		for (j = 0; j < a->nassign; j++) {
+			cache_str(cb, a->assign[j], strlen(a->assign[j]));
+		}
+		for (j = 0; j < a->argc; j++) {
+			cache_str(cb, a->argv[j], strlen(a->argv[j]));
+		}
+		for (r = a->redir; r != NULL; r = r->next) {
+			cache_num(cb, r->type);
+			cache_num(cb, (uint32_t)r->fd);
+			cache_num(cb, (uint32_t)r->src);
+			cache_str(cb, r->file, r->type == R_DOC ? r->len :
+			    r->file != NULL ? strlen(r->file) : 0);
+		}
+	}
+}
+
+/*
+ * Set up cr to read the n bytes of records at p.
+ */
+static void
+cache_reader(struct creader *cr, const void *p, size_t n)
+{
+	cr->p = p;
+	cr->end = cr->p + n;
+	cr->bad = 0;
+}
+
+/*
+ * Next number of cr. Reading past the end marks cr bad.
+ */
+static uint32_t
+cache_get(struct creader *cr)
+{
+	uint32_t	 v = 0;
+	int		 shift;
+
+	for (shift = 0; shift < 35; shift += 7) {
+		if (cr->p >= cr->end) {
+			break;
+		}
+		v |= (uint32_t)(*cr->p & 0x7f) << shift;
+		if (*cr->p++ < 0x80) {
+			return v;
+		}
+	}
+	cr->bad = 1;
+
+	return 0;
+}
+
+/*
+ * Next string of cr, used where it is, with its length in *lenp.
+ */
+static char *
+cache_getstr(struct creader *cr, size_t *lenp)
+{
+	const unsigned char	*s;
+	uint32_t		 n;
+
+	if ((n = cache_get(cr)) == 0) {
+		return NULL;
+	}
+	if (n > (size_t)(cr->end - cr->p) || cr->p[n - 1] != '\0') {
+		cr->bad = 1;
+		return NULL;
+	}
+	s = cr->p;
+	cr->p += n;
+	*lenp = n - 1;
+
+	return (char *)(uintptr_t)s;
+}
+
+/*
+ * Rebuild the next list of cr in the command arena, up to its CR_END.
+ * Returns NULL for an empty list, or with cr->bad set, a bad one.
+ */
+static struct node *
+cache_getlist(struct creader *cr)
+{
+	struct node	 *head = NULL;
+	struct node	**tail = &head;
+	struct node	 *n;
+
+	while (!cr->bad) {
+		if (cr->p < cr->end && *cr->p == CR_END) {
+			cr->p++;
+			return head;
+		}
+		if ((n = cache_getnode(cr)) != NULL) {
+			*tail = n;
+			tail = &n->next;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Rebuild the next single command of cr. Its strings are left where
+ * they are. Returns NULL, with cr->bad set, if it is cut short.
+ */
+static struct node *
+cache_getnode(struct creader *cr)
+{
+	struct node	 *n;
+	struct arm	 *arm;
+	struct arm	**tail;
+	size_t		  len;
+	uint32_t	  rec;
+	uint32_t	  narms;
+	uint32_t	  i;
+
+	n = arena_alloc(&cmd_arena, sizeof(*n));
+	switch ((rec = cache_get(cr))) {
+	case CR_PIPE:
+		n->type = N_PIPE;
+		n->pl = cache_decode(cr);
+		break;
+	case CR_AND:
+	case CR_OR:
+		n->type = rec == CR_AND ? N_AND : N_OR;
+		if ((n->left = cache_getnode(cr)) != NULL) {
+			n->right = cache_getnode(cr);
+		}
+		break;
+	case CR_NOT:
+	case CR_BG:
+		n->type = rec == CR_NOT ? N_NOT : N_BG;
+		n->left = cache_getnode(cr);
+		break;
+	case CR_IF:
+		n->type = N_IF;
+		n->left = cache_getlist(cr);
+		n->right = cache_getlist(cr);
+		n->els = cache_getlist(cr);
+		break;
+	case CR_WHILE:
+	case CR_UNTIL:
+		n->type = rec == CR_WHILE ? N_WHILE : N_UNTIL;
+		n->left = cache_getlist(cr);
+		n->right = cache_getlist(cr);
+		break;
+	case CR_FOR:
+		n->type = N_FOR;
+		if ((n->var = cache_getstr(cr, &len)) == NULL) {
+			cr->bad = 1;
+		}
+		n->words = cache_getwords(cr, &n->nwords);
+		n->right = cache_getlist(cr);
+		break;
+	case CR_CASE:
+		n->type = N_CASE;
+		n->words = cache_getwords(cr, &n->nwords);
+		if (n->nwords != 1) {
+			cr->bad = 1;
+		}
+		narms = cache_get(cr);
+		tail = &n->arms;
+		for (i = 0; i < narms && !cr->bad; i++) {
+			arm = arena_alloc(&cmd_arena, sizeof(*arm));
+			arm->pats = cache_getwords(cr, &arm->npats);
+			arm->body = cache_getlist(cr);
+			*tail = arm;
+			tail = &arm->next;
+		}
+		break;
+	default:
+		cr->bad = 1;
+	}
+
+	return cr->bad ? NULL : n;
+}
+
+/*
+ * Next count of words and the words of cr, into an array in the
+ * command arena, with the count in *np.
+ */
+static char **
+cache_getwords(struct creader *cr, int *np)
+{
+	char		**v;
+	size_t		  len;
+	uint32_t	  n;
+	uint32_t	  i;
+
+	n = cache_get(cr);
+	if (cr->bad || n > (size_t)(cr->end - cr->p)) {
+		cr->bad = 1;
+		*np = 0;
+		return NULL;
+	}
+	v = arena_alloc(&cmd_arena, (n + 1) * sizeof(*v));
+	for (i = 0; i < n; i++) {
+		if ((v[i] = cache_getstr(cr, &len)) == NULL) {
+			cr->bad = 1;
+		}
+	}
+	*np = (int)n;
+
+	return v;
+}
+
+/*
+ * Rebuild the pipeline of a CR_PIPE record of cr in the command arena.
+ * Its strings are left where they are. Returns NULL if the record is
+ * cut short.
+ */
+static struct pipeline *
+cache_decode(struct creader *cr)
+{
+	struct pipeline	 *pl;
+	struct args	 *a;
+	struct redir	 *r;
+	struct redir	**rtail;
+	char		**v;
+	size_t		  len;
+	uint32_t	  n;
+	uint32_t	  nredir;
+	uint32_t	  j;
+	int		  i;
+
+	pl = arena_alloc(&cmd_arena, sizeof(*pl));
+	pl->ps = cache_get(cr) ? STATE_BG : STATE_FG;
+	pl->ncmds = (int)cache_get(cr);
+	pl->ndocs = (int)cache_get(cr);
+	if (cr->bad || pl->ncmds <= 0 || pl->ncmds > cr->end - cr->p) {
+		cr->bad = 1;
+		return NULL;
+	}
+	pl->cmds = arena_alloc(&cmd_arena,
+	    (size_t)pl->ncmds * sizeof(*pl->cmds));
+
+	for (i = 0; i < pl->ncmds; i++) {
+		a = &pl->cmds[i];
+		a->nassign = (int)cache_get(cr);
+		a->argc = (int)cache_get(cr);
+		nredir = cache_get(cr);
+		a->expand = (int)cache_get(cr);
+		n = (uint32_t)a->nassign + (uint32_t)a->argc;
+		if (cr->bad || (a->argc == 0 && (a->nassign == 0 ||
+		    pl->ncmds > 1)) || n > (size_t)(cr->end - cr->p)) {
+			cr->bad = 1;
+			return NULL;
+		}
+		v = arena_alloc(&cmd_arena, (n + 1) * sizeof(*v));
+		for (j = 0; j < n; j++) {
+			if ((v[j] = cache_getstr(cr, &len)) == NULL) {
+				cr->bad = 1;
+			}
+		}
+		a->assign = v;
+		a->argv = v + a->nassign;
+		a->file = a->argv[0];
+
+		rtail = &a->redir;
+		for (j = 0; j < nredir && !cr->bad; j++) {
+			r = arena_alloc(&cmd_arena, sizeof(*r));
+			r->type = (enum redir_type)cache_get(cr);
+			r->fd = (int)cache_get(cr);
+			r->src = (int)cache_get(cr);
+			r->file = cache_getstr(cr, &r->len);
+			r->cmd = i;
+			if (r->type > R_DOC || (r->file == NULL &&
+			    r->type != R_DUP && r->type != R_CLOSE)) {
+				cr->bad = 1;
+			}
+			*rtail = r;
+			rtail = &r->next;
+		}
+	}
+
+	return cr->bad ? NULL : pl;
+}
+
+/*
+ * Render the prompt from the logical PWD, but only if the directory
+ * has changed since the last time.
+ */
+static void
+cwd_prompt(void)
+{
+	int		 ret;
+
+	if (!prompt_dirty) {
+		return;
+	}
+
+	ret = snprintf(prompt, PROMPT_SIZE, "SSI: %s > ", pwd);
+	if (ret == -1 || ret >= PROMPT_SIZE) {
+		err(1, "snprintf");
+	}
+	prompt_dirty = 0;
+}
+
+/*
+ * Parse the command starting on line into *np: usually just the line,
+ * but a compound command, or a line ending in |, && or ||, goes on
+ * over the lines after it, read from input. *np is NULL for a blank
+ * line. Returns -1 on a syntax error, already reported.
+ * Lines are split up in place: the tree points into them, so they
+ * must outlive it.
+ */
+static int
+parse_line(char *line, struct node **np)
+{
+	struct parser	 p;
+	struct redir	*r;
+	size_t		 len;
+
+	memset(&p, 0, sizeof(p));
+	p.dtail = &p.docs;
+	lex_init(&p.lx, line);
+	parse_next(&p);
+
+	*np = parse_list(&p, 1);
+	if (!p.err && p.t != T_NL) {
+		parse_near(&p);
+	}
+
+	/* Bodies of here-documents on a bad line are not commands. */
+	for (r = p.docs; r != NULL; r = r->dnext) {
+		(void)heredoc_read(r->delim, r->strip, &len);
+	}
+
+	return p.err ? -1 : 0;
+}
+
+/*
+ * Move p on to its next token. The end of a line is T_NL, once its
+ * here-documents have been read. The line after it is only read if a
+ * command is still open; if not, or at the end of input, the next
+ * token is T_EOF.
+ */
+static void
+parse_next(struct parser *p)
+{
+	struct redir	*r;
+	char		*line;
+
+	if (p->eol) {
+		if (p->depth == 0 || input == NULL ||
+		    (line = input_line(input, "> ")) == NULL) {
+			p->t = T_EOF;
+			return;
+		}
+		lex_init(&p->lx, line);
+		p->eol = 0;
+	}
+
+	if ((p->t = lex_next(&p->lx, &p->word)) == T_ERROR) {
+		p->err = 1;
+	} else if (p->t == T_EOF) {
+		/* Here-document bodies follow the line, in order. */
+		for (r = p->docs; r != NULL; r = r->dnext) {
+			r->file = heredoc_read(r->delim, r->strip, &r->len);
+		}
+		p->docs = NULL;
+		p->dtail = &p->docs;
+		p->eol = 1;
+		p->t = T_NL;
+	}
+}
+
+/*
+ * Skip newlines, reading on past the end of the line even outside a
+ * compound command, as after | or &&.
+ */
+static void
+parse_newlines(struct parser *p)
+{
+	p->depth++;
+	while (p->t == T_NL) {
+		parse_next(p);
+	}
+	p->depth--;
+}
+
+/*
+ * Is the current token of p the reserved word w?
+ */
+static int
+parse_is(const struct parser *p, const char *w)
+{
+	return p->t == T_WORD && !strcmp(p->word, w);
+}
+
+/*
+ * Does the current token of p end a list, rather than start a command?
+ */
+static int
+parse_closer(const struct parser *p)
+{
+	return p->t == T_DSEMI || parse_is(p, "then") ||
+	    parse_is(p, "elif") || parse_is(p, "else") ||
+	    parse_is(p, "fi") || parse_is(p, "do") ||
+	    parse_is(p, "done") || parse_is(p, "esac");
+}
+
+/*
+ * Does the current token of p start a compound command?
+ */
+static int
+parse_compound(const struct parser *p)
+{
+	return parse_is(p, "if") || parse_is(p, "while") ||
+	    parse_is(p, "until") || parse_is(p, "for") ||
+	    parse_is(p, "case");
+}
+
+/*
+ * Report a syntax error at the current token of p, unless one has
+ * been already.
+ */
+static void
+parse_near(struct parser *p)
+{
+	if (p->err) {
+		return;
+	}
+	if (p->t == T_EOF) {
+		parse_warn("syntax error: unexpected end of file");
+	} else {
+		parse_warn("syntax error near '%s'", lex_name(p->t, p->word));
+	}
+	p->err = 1;
+}
+
+/*
+ * Expect the reserved word w, and move past it. Returns -1 if it is
+ * not there.
+ */
+static int
+parse_expect(struct parser *p, const char *w)
+{
+	if (p->err || !parse_is(p, w)) {
+		parse_near(p);
+		return -1;
+	}
+	parse_next(p);
+
+	return 0;
+}
+
+/*
+ * Parse a list: and-or lists ended by ;, & or, in a compound command,
+ * newlines. It runs up to a reserved word that closes it, or outside
+ * compound commands to the end of the line. Only with empty may it
+ * have no commands. Returns NULL for an empty list or an error.
+ */
+static struct node *
+parse_list(struct parser *p, int empty)
+{
+	struct node	 *head = NULL;
+	struct node	**tail = &head;
+	struct node	 *n;
+	struct node	 *bg;
+
+	for (;;) {
+		while (p->t == T_NL && p->depth > 0) {
+			parse_next(p);
+		}
+		if (p->err || p->t == T_NL || p->t == T_EOF ||
+		    parse_closer(p)) {
+			break;
+		}
+		if ((n = parse_andor(p)) == NULL) {
+			return NULL;
+		}
+		if (p->t == T_AMP) {
+			/* The whole and-or list goes in the background. */
+			if (n->type == N_PIPE) {
+				n->pl->ps = STATE_BG;
+			} else {
+				bg = node_new(N_BG);
+				bg->left = n;
+				n = bg;
+			}
+		}
+		*tail = n;
+		tail = &n->next;
+
+		if (p->t != T_AMP && p->t != T_SEMI) {
+			continue;	/* Newline, or end of the list. */
+		}
+		parse_next(p);
+	}
+
+	if (head == NULL && !empty) {
+		parse_near(p);
+	}
+
+	return p->err ? NULL : head;
+}
+
+/*
+ * Parse pipelines joined by && and ||, which group to the left.
+ */
+static struct node *
+parse_andor(struct parser *p)
+{
+	struct node	*n;
+	struct node	*op;
+
+	if ((n = parse_pipeline(p)) == NULL) {
+		return NULL;
+	}
+	while (p->t == T_ANDIF || p->t == T_ORIF) {
+		op = node_new(p->t == T_ANDIF ? N_AND : N_OR);
+		parse_next(p);
+		parse_newlines(p);
+		op->left = n;
+		if ((op->right = parse_pipeline(p)) == NULL) {
+			return NULL;
+		}
+		n = op;
+	}
+
+	return n;
+}
+
+/*
+ * Parse a pipeline, with an optional leading !, or a compound command.
+ * Compound commands cannot be in a pipeline or be redirected.
+ */
+static struct node *
+parse_pipeline(struct parser *p)
+{
+	struct node	*n;
+
+	if (parse_is(p, "!")) {
+		n = node_new(N_NOT);
+		parse_next(p);
+		return (n->left = parse_pipeline(p)) != NULL ? n : NULL;
+	}
+
+	if (!parse_compound(p)) {
+		n = node_new(N_PIPE);
+		return (n->pl = args_parse(p)) != NULL ? n : NULL;
+	}
+
+	p->depth++;
+	if (parse_is(p, "if")) {
+		n = parse_if(p);
+	} else if (parse_is(p, "for")) {
+		n = parse_for(p);
+	} else if (parse_is(p, "case")) {
+		n = parse_case(p);
+	} else {
+		n = parse_while(p);
+	}
+	if (n == NULL) {
+		return NULL;
+	}
+	p->depth--;
+
+	/* At the closing word, which the next token must end. */
+	parse_next(p);
+	switch (p->t) {
+	case T_NL:
+	case T_EOF:
+	case T_SEMI:
+	case T_AMP:
+	case T_ANDIF:
+	case T_ORIF:
+	case T_DSEMI:
+		return n;
+	default:
+		if (parse_closer(p)) {
+			return n;
+		}
+		parse_near(p);
+		return NULL;
+	}
+}
+
+/*
+ * if list then list [elif list then list]... [else list] fi
+ * Each elif is an N_IF as the else list of the one before.
+ */
+static struct node *
+parse_if(struct parser *p)
+{
+	struct node	 *n = NULL;
+	struct node	**np = &n;
+
+	do {				/* At "if" or "elif". */
+		parse_next(p);
+		*np = node_new(N_IF);
+		if (((*np)->left = parse_list(p, 0)) == NULL ||
+		    parse_expect(p, "then") == -1 ||
+		    ((*np)->right = parse_list(p, 0)) == NULL) {
+			return NULL;
+		}
+		np = &(*np)->els;
+	} while (parse_is(p, "elif"));
+
+	if (parse_is(p, "else")) {
+		parse_next(p);
+		if ((*np = parse_list(p, 0)) == NULL) {
+			return NULL;
+		}
+	}
+	if (!parse_is(p, "fi")) {
+		parse_near(p);
+		return NULL;
+	}
+
+	return n;
+}
+
+/*
+ * while list do list done, and until list do list done
+ */
+static struct node *
+parse_while(struct parser *p)
+{
+	struct node	*n;
+
+	n = node_new(parse_is(p, "while") ? N_WHILE : N_UNTIL);
+	parse_next(p);
+	if ((n->left = parse_list(p, 0)) == NULL ||
+	    parse_expect(p, "do") == -1 ||
+	    (n->right = parse_list(p, 0)) == NULL) {
+		return NULL;
+	}
+	if (!parse_is(p, "done")) {
+		parse_near(p);
+		return NULL;
+	}
+
+	return n;
+}
+
+/*
+ * for name [in word...] do list done
+ * The words are kept raw, to be expanded each time the loop starts.
+ * With no "in", there are no words: ssi has no positional parameters.
+ */
+static struct node *
+parse_for(struct parser *p)
+{
+	struct node	*n;
+
+	n = node_new(N_FOR);
+	parse_next(p);
+	if (p->t != T_WORD || !var_valid(p->word, strlen(p->word))) {
+		parse_near(p);
+		return NULL;
+	}
+	n->var = p->word;
+	parse_next(p);
+	while (p->t == T_NL) {
+		parse_next(p);
+	}
+
+	if (parse_is(p, "in")) {
+		parse_next(p);
+		n->words = parse_words(p, &n->nwords, 0);
+		if (p->t != T_SEMI && p->t != T_NL) {
+			parse_near(p);
+			return NULL;
+		}
+		parse_next(p);
+	} else if (p->t == T_SEMI) {
+		parse_next(p);
+	}
+	while (p->t == T_NL) {
+		parse_next(p);
+	}
+
+	if (parse_expect(p, "do") == -1 ||
+	    (n->right = parse_list(p, 0)) == NULL) {
+		return NULL;
+	}
+	if (!parse_is(p, "done")) {
+		parse_near(p);
+		return NULL;
+	}
+
+	return n;
+}
+
+/*
+ * case word in [[(] pattern [| pattern]...) list ;;]... esac
+ * The last item need not end with ;;.
+ */
+static struct node *
+parse_case(struct parser *p)
+{
+	struct node	 *n;
+	struct arm	 *arm;
+	struct arm	**tail;
+
+	n = node_new(N_CASE);
+	tail = &n->arms;
+	parse_next(p);
+	if (p->t != T_WORD) {
+		parse_near(p);
+		return NULL;
+	}
+	n->words = arena_alloc(&cmd_arena, sizeof(*n->words));
+	n->words[0] = p->word;
+	n->nwords = 1;
+	parse_next(p);
+	while (p->t == T_NL) {
+		parse_next(p);
+	}
+	if (parse_expect(p, "in") == -1) {
+		return NULL;
+	}
+
+	for (;;) {
+		while (p->t == T_NL) {
+			parse_next(p);
+		}
+		if (parse_is(p, "esac")) {
+			break;
+		}
+		if (p->t == T_LPAREN) {
+			parse_next(p);
+		}
+		arm = arena_alloc(&cmd_arena, sizeof(*arm));
+		arm->pats = parse_words(p, &arm->npats, 1);
+		if (arm->npats == 0 || p->t != T_RPAREN) {
+			parse_near(p);
+			return NULL;
+		}
+		parse_next(p);
+		arm->body = parse_list(p, 1);
+		if (p->err) {
+			return NULL;
+		}
+		*tail = arm;
+		tail = &arm->next;
+		if (p->t != T_DSEMI) {
+			break;
+		}
+		parse_next(p);
+	}
+	if (!parse_is(p, "esac")) {
+		parse_near(p);
+		return NULL;
+	}
+
+	return n;
+}
+
+/*
+ * Collect the words from the current token of p on, into an array in
+ * the command arena, with their count in *np. With piped, the words
+ * are patterns separated by |.
+ */
+static char **
+parse_words(struct parser *p, int *np, int piped)
+{
+	char	**v = NULL;
+	size_t	  n = 0;
+	size_t	  cap = 0;
+
+	while (p->t == T_WORD) {
+		if (n == cap) {
+			v = arena_grow(&cmd_arena, v, cap * sizeof(*v),
+			    (cap ? cap * 2 : 8) * sizeof(*v));
+			cap = cap ? cap * 2 : 8;
+		}
+		v[n++] = p->word;
+		parse_next(p);
+		if (piped) {
+			if (p->t != T_PIPE) {
+				break;
+			}
+			parse_next(p);
+			if (p->t != T_WORD) {
+				parse_near(p);
+			}
+		}
+	}
+	*np = (int)n;
+
+	return v;
+}
+
+/*
+ * A new node of type t, in the command arena.
+ */
+static struct node *
+node_new(enum node_type t)
+{
+	struct node	*n;
+
+	n = arena_alloc(&cmd_arena, sizeof(*n));
+	n->type = t;
+
+	return n;
+}
+
+/*
+ * Parse a pipeline of simple commands from p.
+ * The lexer emits words straight into one argv, with a NULL in place
+ * of each '|', which is then split into NULL terminated command argvs.
+ * First argument of each command is the command name.
+ */
+static struct pipeline *
+args_parse(struct parser *p)
+{
+	enum token	  t;		/* Current token. */
+	size_t		  argc;		/* Count of argv slots used. */
+	size_t		  cap;		/* Count of argv slots allocated. */
+	char		**argv;		/* Pointer to array of arg vectors. */
+	char		**nargv;
+	char		**ap;		/* Pointer to walk along argv. */
+	struct pipeline	 *pl;		/* All commands of the pipeline. */
+	struct args	 *a;		/* Current command in pipeline. */
+	struct redir	 *redirs = NULL;	/* Redirections of all commands. */
+	struct redir	**rtail = &redirs;
+	struct redir	 *r;
+	int		  ncmds;	/* Number of commands in pipeline. */
+	int		  ndocs = 0;	/* Here-documents and -strings. */
+	int		  i;
+
+	/* The argv lives as long as the command, so use its arena. */
+	cap = 16;
+	argv = arena_alloc(&cmd_arena, cap * sizeof(*argv));
+	argc = 0;
+	ncmds = 1;
+
+	while ((t = p->t) == T_WORD || t == T_PIPE || t >= T_IONUM) {
+		if (t >= T_IONUM) {		/* Redirection. */
+			if ((r = args_redir(&p->lx, t, p->word)) == NULL) {
+				p->err = 1;
+				return NULL;
+			}
+			r->cmd = ncmds - 1;
+			*rtail = r;
+			rtail = &r->next;
+			if (r->type == R_DOC) {
+				ndocs++;
+			}
+			if (r->type == R_DOC && r->file == NULL) {
+				*p->dtail = r;	/* Body follows the line. */
+				p->dtail = &r->dnext;
+			}
+			parse_next(p);
+			continue;
+		}
+
+		if (argc + 2 > cap) {	/* Room for word and NULL. */
+			nargv = arena_alloc(&cmd_arena,
+			    cap * 2 * sizeof(*argv));
+			memcpy(nargv, argv, argc * sizeof(*argv));
+			argv = nargv;
+			cap *= 2;
+		}
+		if (t == T_WORD) {
+			argv[argc++] = p->word;
+			parse_next(p);
+			continue;
+		}
+
+		ncmds++;
+		argv[argc++] = NULL;		/* Command separator. */
+		parse_next(p);
+		parse_newlines(p);
+		if (parse_compound(p)) {
+			parse_near(p);
+			return NULL;
+		}
+	}
+	if (p->err) {
+		return NULL;
+	}
+
+	/* No words at all. */
+	if (argc == 0) {
+		if (redirs != NULL) {
+			parse_warn("syntax error: missing command");
+			p->err = 1;
+		}
+		parse_near(p);
+		return NULL;
+	}
+	argv[argc] = (char *)NULL;		/* Last item must be NULL. */
+
+	/* bg without any arguments.
+	 * Must be done here since accessing argv[1] is a segfault.
+	 */
+	if (argc == 1 && !strcmp(argv[0], "bg")) {
+		parse_warn("%s: missing command argument", argv[0]);
+		p->err = 1;
+		return NULL;
+	}
+
+	/* Allocate space in the arena for the pipeline to return. */
+	pl = arena_alloc(&cmd_arena, sizeof(*pl));
+	pl->cmds = arena_alloc(&cmd_arena, (size_t)ncmds * sizeof(*pl->cmds));
+
+	/* Populate the pipeline. */
+	pl->ncmds = ncmds;
+	pl->ndocs = ndocs;
+	pl->ps = STATE_FG;
+	if (argv[0] != NULL && !strcmp(argv[0], "bg")) {
+		argv++;				/* Skip first token (bg). */
+		pl->ps = STATE_BG;		/* Background execution. */
+	}
+
+	/* Split argv at each NULL into command argvs. */
+	r = redirs;
+	for (i = 0; i < ncmds; i++) {
+		a = &pl->cmds[i];
+
+		/* Leading NAME=value words are assignments. */
+		a->assign = argv;
+		for (; *argv != NULL && var_assign(*argv) > 0; argv++) {
+			a->nassign++;
+			if (**argv == EXP_MARK) {
+				a->expand = 1;
+			}
+		}
+
+		a->argv = argv;			/* for passing to execvp(). */
+		a->file = argv[0];		/* Use first token as file. */
+		for (ap = argv; *ap != NULL; ap++) {
+			a->argc++;
+			if (**ap == EXP_MARK) {
+				a->expand = 1;
+			}
+		}
+		if (a->argc == 0 && (a->nassign == 0 || ncmds > 1)) {
+			if (ncmds > 1) {
+				parse_warn("syntax error near '|'");
+			} else {
+				parse_warn("syntax error: missing command");
+			}
+			p->err = 1;
+			return NULL;
+		}
+		argv = ap + 1;
+
+		/* Its redirections are the next run of the list. */
+		rtail = &a->redir;
+		for (; r != NULL && r->cmd == i; r = r->next) {
+			*rtail = r;
+			rtail = &r->next;
+			if (r->type != R_DOC && r->file != NULL &&
+			    r->file[0] == EXP_MARK) {
+				a->expand = 1;
+			}
+		}
+		*rtail = NULL;
+	}
+
+	return pl;
+}
+
+/*
+ * Parse the redirection starting with token t, which is an operator
+ * or the fd number before one, and the word it applies to.
+ */
+static struct redir *
+args_redir(struct lexer *lx, enum token t, char *word)
+{
+	struct redir	*r;
+	char		*target;
+	enum token	 tt;
+
+	r = arena_alloc(&cmd_arena, sizeof(*r));
+	if (t == T_IONUM) {
+		if (strlen(word) > 1) {		/* Only 0-9. */
+			parse_warn("%s: bad file descriptor", word);
+			return NULL;
+		}
+		r->fd = word[0] - '0';
+		t = lex_next(lx, &word);	/* Always < or >. */
+	} else {
+		r->fd = t == T_GT || t == T_DGT || t == T_GTAND ?
+		    STDOUT_FILENO : STDIN_FILENO;
+	}
+
+	if ((tt = lex_next(lx, &target)) != T_WORD) {
+		if (tt != T_ERROR) {
+			parse_warn("syntax error near '%s'", lex_name(tt, target));
+		}
+		return NULL;
+	}
+
+	switch (t) {
+	case T_LT:
+		r->type = R_IN;
+		break;
+	case T_GT:
+		r->type = R_OUT;
+		break;
+	case T_DGT:
+		r->type = R_APPEND;
+		break;
+	case T_DLT:
+	case T_DLTDASH:			/* Body is read after the line. */
+		r->type = R_DOC;
+		r->delim = target;
+		r->strip = t == T_DLTDASH;
+		return r;
+	case T_TLT:
+		r->type = R_DOC;
+		r->len = strlen(target) + 1;
+		r->file = memcpy(arena_alloc(&cmd_arena, r->len), target,
+		    r->len);
+		((char *)(uintptr_t)r->file)[r->len - 1] = '\n';
+		return r;
+	default:			/* <& and >& */
+		if (!strcmp(target, "-")) {
+			r->type = R_CLOSE;
+		} else if (target[0] >= '0' && target[0] <= '9' &&
+		    target[1] == '\0') {
+			r->type = R_DUP;
+			r->src = target[0] - '0';
+		} else {
+			parse_warn("%s: bad file descriptor", target);
+			return NULL;
+		}
+		return r;
+	}
+	r->file = target;
+
+	return r;
+}
+
+/*
+ * Report a syntax error. While compiling a script for the cache, any
+ * complaint instead means the script must be run line by line, where
+ * it will be reported in its place.
+ */
+static void
+parse_warn(const char *fmt, ...)
+{
+	va_list	 ap;
+
+	if (compiling) {
+		compile_err = 1;
+		return;
+	}
+	va_start(ap, fmt);
+	vwarnx(fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Set up the lexer to split line into tokens in place.
+ */
+static void
+lex_init(struct lexer *lx, char *line)
+{
+	lx->p = line;
+	lx->pend = '\0';
+}
+
+/*
+ * Return the next token of the line. For T_WORD, *wordp is set to the
+ * NUL terminated word, with quotes and backslashes removed.
+ *
+ * A word is unquoted in place: the write pointer never passes the read
+ * pointer, so nothing is copied out of the line. Runs of ordinary
+ * characters are skipped with lex_scan(), a block at a time.
+ * If a word ends right at an operator, its NUL may overwrite that
+ * operator, so it is remembered in pend for the next call.
+ */
+static enum token
+lex_next(struct lexer *lx, char **wordp)
+{
+	char		*r;		/* Read pointer. */
+	char		*w;		/* Write pointer. */
+	const char	*q;
+	int		 c;
+
+	r = lx->p;
+	if ((c = lx->pend) == '\0') {
+		while (*r == ' ' || *r == '\t' || *r == '\n') {
+			r++;
+		}
+		c = *r;
+	}
+	lx->pend = '\0';
+
+	switch (c) {
+	case '\0':
+	case '#':			/* Comment to end of line. */
+		lx->p = r;
+		return T_EOF;
+	case '|':
+	case '&':
+	case ';':
+		if (r[1] == c) {	/* ||, && and ;; */
+			lx->p = r + 2;
+			return c == '|' ? T_ORIF : c == '&' ? T_ANDIF : T_DSEMI;
+		}
+		lx->p = r + 1;
+		return c == '|' ? T_PIPE : c == '&' ? T_AMP : T_SEMI;
+	case '(':
+	case ')':
+		lx->p = r + 1;
+		return c == '(' ? T_LPAREN : T_RPAREN;
+	case '<':
+		if (r[1] == '<') {
+			if (r[2] == '<' || r[2] == '-') {
+				lx->p = r + 3;
+				return r[2] == '<' ? T_TLT : T_DLTDASH;
+			}
+			lx->p = r + 2;
+			return T_DLT;
+		}
+		if (r[1] == '&') {
+			lx->p = r + 2;
+			return T_LTAND;
+		}
+		lx->p = r + 1;
+		return T_LT;
+	case '>':
+		if (r[1] == '>' || r[1] == '&') {
+			lx->p = r + 2;
+			return r[1] == '>' ? T_DGT : T_GTAND;
+		}
+		lx->p = r + 1;
+		return T_GT;
+	}
+
+	*wordp = w = r;
+	for (;;) {
+		/* Copy the run of ordinary characters. */
+		q = lex_scan(r);
+		if (w != r) {
+			memmove(w, r, (size_t)(q - r));
+		}
+		w += q - r;
+		r = (char *)(uintptr_t)q;
+
+		switch (*r) {
+		case '\'':		/* Everything up to ' is literal. */
+			if ((q = strchr(r + 1, '\'')) == NULL) {
+				parse_warn("syntax error: unterminated quote");
+				return T_ERROR;
+			}
+			memmove(w, r + 1, (size_t)(q - r - 1));
+			w += q - r - 1;
+			r = (char *)(uintptr_t)q + 1;
+			break;
+		case '"':		/* Only \ and $ are special in "". */
+			for (r++; *r != '"'; r++) {
+				if (*r == '\0') {
+					parse_warn("syntax error: "
+					    "unterminated quote");
+					return T_ERROR;
+				}
+				if (*r == '$' && lex_dollar(r)) {
+					return lex_raw(lx, wordp, w, r, 1);
+				}
+				if (*r == '\\' && r[1] != '\0' &&
+				    strchr("$`\"\\\n", r[1]) != NULL) {
+					r++;
+				}
+				*w++ = *r;
+			}
+			r++;
+			break;
+		case '\\':		/* Next character is literal. */
+			r++;
+			if (*r != '\0') {
+				*w++ = *r++;
+			}
+			break;
+		case '$':
+			if (lex_dollar(r)) {
+				return lex_raw(lx, wordp, w, r, 0);
+			}
+			*w++ = *r++;		/* Literal. */
+			break;
+		default:		/* Blank, operator or end of line. */
+			c = *r;
+			if (c != '\0' && strchr("|&;<>()", c) != NULL) {
+				lx->pend = (char)c;
+				lx->p = r;
+			} else {
+				lx->p = c == '\0' ? r : r + 1;
+			}
+			/* Unquoted digits right before < or > name an fd. */
+			q = *wordp;
+			if ((c == '<' || c == '>') && w == r &&
+			    strspn(q, "0123456789") == (size_t)(w - q)) {
+				*w = '\0';
+				return T_IONUM;
+			}
+			*w = '\0';
+			return T_WORD;
+		}
+	}
+}
+
+/*
+ * The word at *wordp has an expansion at r, to be done when it runs.
+ * Its text before r, already unquoted up to w, is quoted again with
+ * backslashes and the rest of the word copied as it is, behind an
+ * EXP_MARK, into the command arena. dq is set if r is inside "".
+ */
+static enum token
+lex_raw(struct lexer *lx, char **wordp, const char *w, const char *r,
+    int dq)
+{
+	const char	*end;
+	const char	*p;
+	char		*raw;
+	char		*o;
+
+	if ((end = lex_skip(r, dq)) == NULL) {
+		parse_warn("syntax error: unterminated quote, $( or ${");
+		return T_ERROR;
+	}
+
+	raw = o = arena_alloc(&cmd_arena,
+	    2 * (size_t)(w - *wordp) + (size_t)(end - r) + 3);
+	*o++ = EXP_MARK;
+	for (p = *wordp; p < w; p++) {
+		*o++ = '\\';
+		*o++ = *p;
+	}
+	if (dq) {
+		*o++ = '"';
+	}
+	memcpy(o, r, (size_t)(end - r));
+	o[end - r] = '\0';
+
+	lx->p = (char *)(uintptr_t)end;	/* Blank, operator or end. */
+	*wordp = raw;
+
+	return T_WORD;
+}
+
+/*
+ * Does the '$' at p start an expansion: $(, ${, $? or $name?
+ */
+static int
+lex_dollar(const char *p)
+{
+	return p[1] == '(' || p[1] == '{' || p[1] == '?' ||
+	    var_char((unsigned char)p[1], 1);
+}
+
+/*
+ * Find the end of the raw word at p: the first blank, operator or NUL
+ * outside quotes and $(...). dq is set if p is inside "".
+ * Returns NULL if a quote or $( is not closed.
+ */
+static const char *
+lex_skip(const char *p, int dq)
+{
+	for (;;) {
+		switch (*p) {
+		case '\0':
+			return dq ? NULL : p;
+		case '"':
+			dq = !dq;
+			p++;
+			break;
+		case '\\':
+			p += p[1] != '\0' ? 2 : 1;
+			break;
+		case '$':
+			if (p[1] == '{') {
+				if ((p = strchr(p, '}')) == NULL) {
+					return NULL;
+				}
+				p++;
+			} else if (p[1] != '(') {
+				p++;
+			} else if ((p = lex_paren(p + 2)) == NULL) {
+				return NULL;
+			}
+			break;
+		case '\'':
+			if (!dq && (p = strchr(p + 1, '\'')) == NULL) {
+				return NULL;
+			}
+			p++;
+			break;
+		case ' ':
+		case '\t':
+		case '\n':
+		case '|':
+		case '&':
+		case ';':
+		case '<':
+		case '>':
+		case '(':
+		case ')':
+			if (!dq) {
+				return p;
+			}
+			p++;
+			break;
+		default:
+			p++;
+		}
+	}
+}
+
+/*
+ * Find the end of the command substitution whose text starts at p,
+ * just past its "$(". Returns the byte after its ')', or NULL.
+ */
+static const char *
+lex_paren(const char *p)
+{
+	int	 depth = 1;
+
+	for (;;) {
+		switch (*p) {
+		case '\0':
+			return NULL;
+		case '\'':
+			if ((p = strchr(p + 1, '\'')) == NULL) {
+				return NULL;
+			}
+			break;
+		case '"':
+			for (p++; *p != '"'; p++) {
+				if (*p == '\0') {
+					return NULL;
+				}
+				if (*p == '\\' && p[1] != '\0') {
+					p++;
+				}
+			}
+			break;
+		case '\\':
+			if (p[1] != '\0') {
+				p++;
+			}
+			break;
+		case '(':
+			depth++;
+			break;
+		case ')':
+			if (--depth == 0) {
+				return p + 1;
+			}
+			break;
+		}
+		p++;
+	}
+}
+
+/*
+ * Printable name of token t, for error messages.
+ */
+static const char *
+lex_name(enum token t, const char *word)
+{
+	switch (t) {
+	case T_WORD:
+	case T_IONUM:
+		return word;
+	case T_PIPE:
+		return "|";
+	case T_AMP:
+		return "&";
+	case T_SEMI:
+		return ";";
+	case T_DSEMI:
+		return ";;";
+	case T_ANDIF:
+		return "&&";
+	case T_ORIF:
+		return "||";
+	case T_LPAREN:
+		return "(";
+	case T_RPAREN:
+		return ")";
+	case T_LT:
+		return "<";
+	case T_GT:
+		return ">";
+	case T_DGT:
+		return ">>";
+	case T_LTAND:
+		return "<&";
+	case T_GTAND:
+		return ">&";
+	case T_DLT:
+		return "<<";
+	case T_DLTDASH:
+		return "<<-";
+	case T_TLT:
+		return "<<<";
+	default:
+		return "newline";
+	}
+}
+
+/*
+ * Find the first byte at or after p that ends a run of ordinary word
+ * characters: a blank, quote, backslash, '$', operator or the NUL.
+ * The vector versions read whole aligned blocks, which never cross a
+ * page boundary, so they may safely look past the terminating NUL.
+ */
+static const char *
+lex_scan_scalar(const char *p)
+{
+	while (!lex_special[(unsigned char)*p]) {
+		p++;
+	}
+
+	return p;
+}
+
+#ifdef __SSE2__
+static inline __m128i
+lex_mask_sse2(__m128i x)
+{
+	__m128i		 m;
+
+	m = _mm_cmpeq_epi8(x, _mm_setzero_si128());
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('\t')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('\n')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('\'')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('"')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('\\')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('$')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('|')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('&')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(';')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('<')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('>')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('(')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(')')));
+
+	return m;
+}
+
+static const char *
+lex_scan_sse2(const char *p)
+{
+	const __m128i	*v;
+	unsigned	 mask;
+	size_t		 off;
+
+	off = (uintptr_t)p & 15;
+	v = (const __m128i *)(const void *)(p - off);
+	mask = (unsigned)_mm_movemask_epi8(lex_mask_sse2(_mm_load_si128(v)));
+	mask &= ~0u << off;		/* Ignore bytes before p. */
+	while (mask == 0) {
+		v++;
+		mask = (unsigned)_mm_movemask_epi8(
+		    lex_mask_sse2(_mm_load_si128(v)));
+	}
+
+	return (const char *)v + __builtin_ctz(mask);
+}
+#endif /* __SSE2__ */
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__ ((__target__ ("avx2")))
+static inline __m256i
+lex_mask_avx2(__m256i x)
+{
+	__m256i		 m;
+
+	m = _mm256_cmpeq_epi8(x, _mm256_setzero_si256());
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\'')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('$')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('|')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('&')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(';')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('<')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('>')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('(')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(')')));
+
+	return m;
+}
+
+__attribute__ ((__target__ ("avx2")))
+static const char *
+lex_scan_avx2(const char *p)
+{
+	const __m256i	*v;
+	unsigned	 mask;
+	size_t		 off;
+
+	off = (uintptr_t)p & 31;
+	v = (const __m256i *)(const void *)(p - off);
+	mask = (unsigned)_mm256_movemask_epi8(
+	    lex_mask_avx2(_mm256_load_si256(v)));
+	mask &= ~0u << off;		/* Ignore bytes before p. */
+	while (mask == 0) {
+		v++;
+		mask = (unsigned)_mm256_movemask_epi8(
+		    lex_mask_avx2(_mm256_load_si256(v)));
+	}
+
+	return (const char *)v + __builtin_ctz(mask);
+}
+#endif /* __x86_64__ || __i386__ */
+
+/*
+ * Pick the widest lex_scan() the CPU supports.
+ */
+static void
+lex_setup(void)
+{
+	const char	*s;
+
+	for (s = " \t\n'\"\\$|&;<>()"; *s != '\0'; s++) {
+		lex_special[(unsigned char)*s] = 1;
+	}
+	lex_special[0] = 1;
+
+	lex_scan = lex_scan_scalar;
+#ifdef __SSE2__
+	lex_scan = lex_scan_sse2;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		lex_scan = lex_scan_avx2;
+	}
+#endif
+}
+
+/*
+ * Run a as a builtin command if it is one.
+ * Returns the exit status of the builtin, or -1 if not a builtin.
+ */
+static int
+builtin_run(struct args *a)
+{
+	const struct builtin	*b;
+
+	const char		*s;
+	size_t			 n;
+	int			 i;
+
+	if ((b = builtin_find(a->argv[0])) == NULL) {
+		return -1;
+	}
+
+	/* A child of its own: prefix assignments need not be undone. */
+	for (i = 0; i < a->nassign; i++) {
+		s = a->assign[i];
+		n = (size_t)(strchr(s, '=') - s);
+		var_set(s, n, s + n + 1, 1);
+	}
+
+	return b->fn(a);
+}
+
+/*
+ * Find the builtin command called name in the perfect hash table
+ * generated from builtins.def, or return NULL if there is none.
+ * A path such as /bin/pwd never names a builtin.
+ */
+static const struct builtin *
+builtin_find(const char *name)
+{
+	const struct builtin	*b;
+
+	b = &builtins[builtin_hash(name) & BUILTIN_MASK];
+	if (b->name == NULL || strcmp(b->name, name) != 0) {
+		return NULL;
+	}
+
+	return b;
+}
+
+/*
+ * Seeded FNV-1a. Must match hash() in mkbuiltins.c.
+ */
+static unsigned
+builtin_hash(const char *s)
+{
+	unsigned	 h = 2166136261u ^ BUILTIN_SEED;
+
+	while (*s != '\0') {
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	}
+
+	return h ^ (h >> 15);
+}
+
+/*
+ * exit [n]
+ *
+ * Exit with status n, or by default that of the last pipeline.
+ */
+static int
+exit_builtin(struct args *a)
+{
+	char		*ep;
+	long		 n = last_status;
+
+	switch (a->argc) {
+	case 1:
+		break;
+	case 2:
+		errno = 0;
+		n = strtol(a->argv[1], &ep, 10);
+		if (a->argv[1][0] == '\0' || *ep != '\0' || errno != 0) {
+			warnx("%s: %s: numeric argument required",
+			    a->argv[0], a->argv[1]);
+			n = 2;
+		}
+		break;
+	default:
+		warnx("%s: too many arguments", a->argv[0]);
+		return 1;
+	}
+
+	exit((int)(n & 0xff));
+}
+
+/*
+ * break [n], continue [n]
+ *
+ * Leave the n innermost loops, or go on to the next pass of the nth.
+ */
+static int
+break_builtin(struct args *a)
+{
+	char		*ep;
+	long		 n = 1;
+
+	switch (a->argc) {
+	case 1:
+		break;
+	case 2:
+		errno = 0;
+		n = strtol(a->argv[1], &ep, 10);
+		if (a->argv[1][0] == '\0' || *ep != '\0' || errno != 0 ||
+		    n < 1) {
+			warnx("%s: %s: loop count out of range", a->argv[0],
+			    a->argv[1]);
+			return 1;
+		}
+		break;
+	default:
+		warnx("%s: too many arguments", a->argv[0]);
+		return 1;
+	}
+	if (loop_depth == 0) {
+		warnx("%s: only meaningful in a loop", a->argv[0]);
+		return 1;
+	}
+
+	if (n > loop_depth) {
+		n = loop_depth;
+	}
+	if (!strcmp(a->argv[0], "break")) {
+		loop_brk = (int)n;
+	} else {
+		loop_cont = (int)n;
+	}
+
+	return 0;
+}
+
+/*
+ * true, :
+ */
+static int
+true_builtin(struct args *a)
+{
+	(void)a;
+
+	return 0;
+}
+
+/*
+ * false
+ */
+static int
+false_builtin(struct args *a)
+{
+	(void)a;
+
+	return 1;
+}
+
+/*
+ * echo [-neE] [string ...]
+ *
+ * Write the strings separated by spaces and followed by a newline,
+ * as /bin/echo does: -n drops the newline, -e expands backslash
+ * escapes and -E, the default, does not.
+ */
+static int
+echo_builtin(struct args *a)
+{
+	const char	*s;
+	const char	*p;
+	int		 nl = 1;		/* Trailing newline. */
+	int		 esc = 0;		/* Expand escapes. */
+	int		 c;
+	int		 i;
+
+	for (i = 1; i < a->argc && a->argv[i][0] == '-' &&
+	    a->argv[i][1] != '\0' &&
+	    a->argv[i][strspn(a->argv[i] + 1, "neE") + 1] == '\0'; i++) {
+		for (p = a->argv[i] + 1; *p != '\0'; p++) {
+			if (*p == 'n') {
+				nl = 0;
+			} else {
+				esc = *p == 'e';
+			}
+		}
+	}
+
+	for (; i < a->argc; i++) {
+		s = a->argv[i];
+		if (!esc) {
+			out_puts(&bout, s);
+		} else {
+			while (*s != '\0') {
+				if (*s != '\\' || s[1] == '\0') {
+					out_putc(&bout, *s++);
+				} else if (s++, (c = esc_char(&s, 1)) == -1) {
+					return stdout_status();	/* \c */
+				} else {
+					out_putc(&bout, c);
+				}
+			}
+		}
+		if (i < a->argc - 1) {
+			out_putc(&bout, ' ');
+		}
+	}
+	if (nl) {
+		out_putc(&bout, '\n');
+	}
+
+	return stdout_status();
+}
+
+/*
+ * Status of a builtin that wrote to stdout: 1 if writing failed.
+ */
+static int
+stdout_status(void)
+{
+	if (bout.err) {
+		bout.err = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Append n bytes of s to the buffer of o, writing it out when full.
+ * Large writes go straight to the descriptor.
+ */
+static void
+out_write(struct obuf *o, const char *s, size_t n)
+{
+	if (o->len + n > sizeof(o->buf)) {
+		out_flush(o);
+		if (n >= sizeof(o->buf)) {
+			out_direct(o, s, n);
+			return;
+		}
+	}
+	memcpy(o->buf + o->len, s, n);
+	o->len += n;
+
+	if (o->lbf && memchr(s, '\n', n) != NULL) {
+		out_flush(o);
+	}
+}
+
+static void
+out_putc(struct obuf *o, int c)
+{
+	if (o->len == sizeof(o->buf)) {
+		out_flush(o);
+	}
+	o->buf[o->len++] = (char)c;
+
+	if (o->lbf && c == '\n') {
+		out_flush(o);
+	}
+}
+
+static void
+out_puts(struct obuf *o, const char *s)
+{
+	out_write(o, s, strlen(s));
+}
+
+/*
+ * printf(3) into the buffer of o.
+ */
+static void
+out_printf(struct obuf *o, const char *fmt, ...)
+{
+	va_list		 ap;
+	char		*p;
+	int		 n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(o->buf + o->len, sizeof(o->buf) - o->len, fmt, ap);
+	va_end(ap);
+	if (n < 0) {
+		return;
+	}
+	if ((size_t)n < sizeof(o->buf) - o->len) {
+		o->len += (size_t)n;
+		if (o->lbf && memchr(o->buf + o->len - n, '\n',
+		    (size_t)n) != NULL) {
+			out_flush(o);
+		}
+		return;
+	}
+
+	/* Did not fit after what is buffered; format it again. */
+	p = arena_alloc(&cmd_arena, (size_t)n + 1);
+	va_start(ap, fmt);
+	vsnprintf(p, (size_t)n + 1, fmt, ap);
+	va_end(ap);
+	out_write(o, p, (size_t)n);
+}
+
+/*
+ * Write out everything buffered in o. A failed write is remembered
+ * in o->err and the output dropped.
+ */
+static void
+out_flush(struct obuf *o)
+{
+	if (o->len > 0) {
+		out_direct(o, o->buf, o->len);
+		o->len = 0;
+	}
+}
+
+/*
+ * write(2) all n bytes of s to the descriptor of o, or add them to
+ * its capture.
+ */
+static void
+out_direct(struct obuf *o, const char *s, size_t n)
+{
+	ssize_t	 w;
+
+	if (o->cap != NULL) {
+		capture_add(o->cap, s, n);
+		return;
+	}
+	while (n > 0) {
+		if ((w = write(o->fd, s, n)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			o->err = 1;
+			return;
+		}
+		s += w;
+		n -= (size_t)w;
+	}
+}
+
+/*
+ * Builtin output still buffered when the shell exits.
+ */
+static void
+out_atexit(void)
+{
+	out_flush(&bout);
+}
+
+/*
+ * Return the character of the backslash escape at *sp, which points
+ * just past the backslash, and advance *sp past the escape. Returns
+ * -1 for \c. Octal escapes are \0ooo if zero is set, as in echo and
+ * %b, and \ooo otherwise, as in printf formats. An unknown escape is
+ * returned as a backslash, leaving *sp at the character after it.
+ */
+static int
+esc_char(const char **sp, int zero)
+{
+	const char	*s = *sp;
+	int		 c = 0;
+	int		 n;
+
+	switch (*s) {
+	case 'a':	c = '\a';	break;
+	case 'b':	c = '\b';	break;
+	case 'f':	c = '\f';	break;
+	case 'n':	c = '\n';	break;
+	case 'r':	c = '\r';	break;
+	case 't':	c = '\t';	break;
+	case 'v':	c = '\v';	break;
+	case '\\':	c = '\\';	break;
+	case 'c':
+		*sp = s + 1;
+		return -1;
+	default:
+		if (*s < '0' || *s > '7' || (zero && *s != '0')) {
+			return '\\';
+		}
+		if (zero) {
+			s++;
+		}
+		for (n = 0; n < 3 && *s >= '0' && *s <= '7'; n++) {
+			c = c * 8 + (*s++ - '0');
+		}
+		*sp = s;
+		return c & 0xff;
+	}
+	*sp = s + 1;
+
+	return c;
+}
+
+/*
+ * printf format [argument ...]
+ *
+ * POSIX printf(1). The format is reused until every argument has
+ * been consumed; missing arguments count as empty or zero.
+ */
+static int
+printf_builtin(struct args *a)
+{
+	char	**av;
+	char	**end;
+	char	**start;
+	int	  stop = 0;			/* \c seen in %b. */
+	int	  ret = 0;
+
+	if (a->argc < 2) {
+		warnx("usage: %s format [argument ...]", a->argv[0]);
+		return 2;
+	}
+	av = a->argv + 2;
+	end = a->argv + a->argc;
+
+	do {
+		start = av;
+		ret |= printf_once(a->argv[1], &av, end, &stop);
+	} while (!stop && av < end && av != start);
+
+	return ret | stdout_status();
+}
+
+/*
+ * Numeric value of printf argument s: a C integer constant, or the
+ * character after a leading quote. Warns if s is not all number.
+ */
+static intmax_t
+printf_int(const char *s, int *ret)
+{
+	intmax_t	 v;
+	char		*end;
+
+	if (*s == '\'' || *s == '"') {
+		return (unsigned char)s[1];
+	}
+	errno = 0;
+	v = strtoimax(s, &end, 0);
+	if (end == s || *end != '\0') {
+		warnx("printf: %s: invalid number", s);
+		*ret = 1;
+	} else if (errno == ERANGE) {
+		warn("printf: %s", s);
+		*ret = 1;
+	}
+
+	return v;
+}
+
+/*
+ * Floating value of printf argument s.
+ */
+static double
+printf_float(const char *s, int *ret)
+{
+	double	 v;
+	char	*end;
+
+	if (*s == '\'' || *s == '"') {
+		return (unsigned char)s[1];
+	}
+	errno = 0;
+	v = strtod(s, &end);
+	if (end == s || *end != '\0') {
+		warnx("printf: %s: invalid number", s);
+		*ret = 1;
+	} else if (errno == ERANGE) {
+		warn("printf: %s", s);
+		*ret = 1;
+	}
+
+	return v;
+}
+
+/*
+ * Write fmt once, taking arguments from *avp up to end.
+ * The conversion specifications are handed to printf(3) one at a
+ * time with a checked conversion, so the format is not a literal.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+static int
+printf_once(const char *fmt, char ***avp, char **end, int *stop)
+{
+	char		 spec[64];	/* One conversion for printf(3). */
+	const char	*arg;
+	const char	*p;
+	char		*b;
+	char		*q;
+	size_t		 n;
+	int		 ret = 0;
+	int		 c;
+
+	for (p = fmt; *p != '\0'; p++) {
+		if (*p == '\\' && p[1] != '\0') {
+			p++;
+			if ((c = esc_char(&p, 0)) == -1) {
+				*stop = 1;
+				return ret;
+			}
+			out_putc(&bout, c);
+			p--;
+			continue;
+		}
+		if (*p != '%') {
+			out_putc(&bout, *p);
+			continue;
+		}
+		if (p[1] == '%') {
+			out_putc(&bout, '%');
+			p++;
+			continue;
+		}
+
+		/* %[flags][width][.precision]conversion */
+		n = strspn(p + 1, "-+ #0");
+		n += strspn(p + 1 + n, "0123456789");
+		if (p[1 + n] == '.') {
+			n++;
+			n += strspn(p + 1 + n, "0123456789");
+		}
+		if (n + 4 > sizeof(spec)) {
+			warnx("printf: %s: format too long", p);
+			return 1;
+		}
+		memcpy(spec, p, n + 1);
+		q = spec + n + 1;
+		p += n + 1;
+
+		arg = *avp < end ? *(*avp)++ : NULL;
+
+		switch (*p) {
+		case 'd':
+		case 'i':
+			q[0] = 'j';
+			q[1] = *p;
+			q[2] = '\0';
+			out_printf(&bout, spec, arg != NULL ?
+			    printf_int(arg, &ret) : 0);
+			break;
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+			q[0] = 'j';
+			q[1] = *p;
+			q[2] = '\0';
+			out_printf(&bout, spec, arg != NULL ?
+			    (uintmax_t)printf_int(arg, &ret) : 0);
+			break;
+		case 'a':
+		case 'A':
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+			q[0] = *p;
+			q[1] = '\0';
+			out_printf(&bout, spec, arg != NULL ?
+			    printf_float(arg, &ret) : 0.0);
+			break;
+		case 'c':
+			if (arg != NULL && arg[0] != '\0') {
+				q[0] = 'c';
+				q[1] = '\0';
+				out_printf(&bout, spec, arg[0]);
+			} else {
+				q[0] = 's';
+				q[1] = '\0';
+				out_printf(&bout, spec, "");
+			}
+			break;
+		case 's':
+			q[0] = 's';
+			q[1] = '\0';
+			out_printf(&bout, spec, arg != NULL ? arg : "");
+			break;
+		case 'b':
+			q[0] = 's';
+			q[1] = '\0';
+			if (arg == NULL) {
+				arg = "";
+			}
+			b = arena_alloc(&cmd_arena, strlen(arg) + 1);
+			for (q = b; *arg != '\0'; ) {
+				if (*arg != '\\' || arg[1] == '\0') {
+					*q++ = *arg++;
+				} else if (arg++, (c = esc_char(&arg, 1)) ==
+				    -1) {
+					*stop = 1;
+					break;
+				} else {
+					*q++ = (char)c;
+				}
+			}
+			*q = '\0';
+			out_printf(&bout, spec, b);
+			if (*stop) {
+				return ret;
+			}
+			break;
+		default:
+			warnx("printf: %%%c: invalid directive", *p);
+			return 1;
+		}
+	}
+
+	return ret;
+}
+#pragma GCC diagnostic pop
+
+/*
+ * pwd [-L | -P]
+ *
+ * Print the logical current directory, or with -P the physical one.
+ */
+static int
+pwd_builtin(struct args *a)
+{
+	char	 buf[PATH_MAX];
+	int	 i;
+
+	for (i = 1; i < a->argc; i++) {
+		if (!strcmp(a->argv[i], "-P")) {
+			if (getcwd(buf, sizeof(buf)) == NULL) {
+				warn("%s", a->argv[0]);
+				return 1;
+			}
+			out_printf(&bout, "%s\n", buf);
+			return stdout_status();
+		} else if (strcmp(a->argv[i], "-L") != 0) {
+			warnx("usage: %s [-L | -P]", a->argv[0]);
+			return 2;
+		}
+	}
+	out_printf(&bout, "%s\n", pwd);
+
+	return stdout_status();
+}
+
+/*
+ * test expression
+ * [ expression ]
+ *
+ * POSIX test(1). Returns 0 if the expression is true, 1 if false and
+ * 2 on error. Up to four arguments are decided by their number, as
+ * POSIX requires; longer expressions are parsed with -a, -o, ! and
+ * parentheses.
+ */
+static int
+test_builtin(struct args *a)
+{
+	struct texpr	 t;
+	int		 ac = a->argc - 1;
+	int		 r;
+
+	if (!strcmp(a->argv[0], "[")) {
+		if (ac == 0 || strcmp(a->argv[ac], "]") != 0) {
+			warnx("[: missing ]");
+			return 2;
+		}
+		ac--;
+	}
+
+	t.av = a->argv + 1;
+	t.ac = ac;
+	t.pos = 0;
+	t.err = 0;
+
+	if (ac <= 4 && (r = test_short(&t)) != -1) {
+		return r;
+	}
+	r = test_or(&t);
+	if (t.err == 0 && t.pos != t.ac) {
+		warnx("test: %s: unexpected operator", t.av[t.pos]);
+		t.err = 1;
+	}
+
+	return t.err ? 2 : !r;
+}
+
+/*
+ * Decide expressions of at most four arguments by their number.
+ * Returns the exit status, or -1 for the full parser to decide.
+ */
+static int
+test_short(struct texpr *t)
+{
+	char	**av = t->av;
+	int	  r;
+
+	switch (t->ac) {
+	case 0:
+		return 1;
+	case 1:
+		return av[0][0] == '\0';
+	case 2:
+		if (!strcmp(av[0], "!")) {
+			return av[1][0] != '\0';
+		}
+		if (test_unop(av[0])) {
+			r = test_unary(t, av[0], av[1]);
+			return t->err ? 2 : !r;
+		}
+		break;
+	case 3:
+		if (test_binop(av[1])) {
+			r = test_binary(t, av[0], av[1], av[2]);
+			return t->err ? 2 : !r;
+		}
+		if (!strcmp(av[0], "!")) {
+			t->av++;
+			t->ac--;
+			r = test_short(t);
+			t->av--;
+			t->ac++;
+			return r == -1 || r == 2 ? r : !r;
+		}
+		if (!strcmp(av[0], "(") && !strcmp(av[2], ")")) {
+			return av[1][0] == '\0';
+		}
+		break;
+	case 4:
+		if (!strcmp(av[0], "!")) {
+			t->av++;
+			t->ac--;
+			r = test_short(t);
+			t->av--;
+			t->ac++;
+			return r == -1 || r == 2 ? r : !r;
+		}
+		if (!strcmp(av[0], "(") && !strcmp(av[3], ")")) {
+			t->av++;
+			t->ac -= 2;
+			r = test_short(t);
+			t->av--;
+			t->ac += 2;
+			return r;
+		}
+		break;
+	}
+
+	return -1;
+}
+
+/*
+ * expr -o expr
+ */
+static int
+test_or(struct texpr *t)
+{
+	int	 r;
+
+	r = test_and(t);
+	while (t->pos < t->ac && !strcmp(t->av[t->pos], "-o")) {
+		t->pos++;
+		r = test_and(t) || r;
+	}
+
+	return r;
+}
+
+/*
+ * expr -a expr
+ */
+static int
+test_and(struct texpr *t)
+{
+	int	 r;
+
+	r = test_not(t);
+	while (t->pos < t->ac && !strcmp(t->av[t->pos], "-a")) {
+		t->pos++;
+		r = test_not(t) && r;
+	}
+
+	return r;
+}
+
+/*
+ * ! expr, ( expr ), unary and binary primaries and strings.
+ */
+static int
+test_not(struct texpr *t)
+{
+	char	**av = t->av + t->pos;
+	int	  left = t->ac - t->pos;
+	int	  r;
+
+	if (left <= 0) {
+		if (!t->err) {
+			warnx("test: argument expected");
+		}
+		t->err = 1;
+		return 0;
+	}
+	if (left >= 3 && test_binop(av[1])) {
+		t->pos += 3;
+		return test_binary(t, av[0], av[1], av[2]);
+	}
+	if (!strcmp(av[0], "!")) {
+		t->pos++;
+		return !test_not(t);
+	}
+	if (!strcmp(av[0], "(")) {
+		t->pos++;
+		r = test_or(t);
+		if (t->pos >= t->ac || strcmp(t->av[t->pos], ")") != 0) {
+			if (!t->err) {
+				warnx("test: missing )");
+			}
+			t->err = 1;
+			return 0;
+		}
+		t->pos++;
+		return r;
+	}
+	if (left >= 2 && test_unop(av[0])) {
+		t->pos += 2;
+		return test_unary(t, av[0], av[1]);
+	}
+	t->pos++;
+
+	return av[0][0] != '\0';
+}
+
+/*
+ * Is op a unary primary?
+ */
+static int
+test_unop(const char *op)
+{
+	return op[0] == '-' && op[1] != '\0' && op[2] == '\0' &&
+	    strchr("bcdefghLnprSstuwxz", op[1]) != NULL;
+}
+
+/*
+ * Is op a binary primary?
+ */
+static int
+test_binop(const char *op)
+{
+	static const char	*ops[] = {
+		"=", "!=", "-eq", "-ne", "-gt", "-ge", "-lt", "-le",
+		"-nt", "-ot", "-ef", NULL
+	};
+	const char		**o;
+
+	for (o = ops; *o != NULL; o++) {
+		if (!strcmp(*o, op)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+test_unary(struct texpr *t, const char *op, const char *arg)
+{
+	struct stat	 sb;
+
+	switch (op[1]) {
+	case 'n':
+		return arg[0] != '\0';
+	case 'z':
+		return arg[0] == '\0';
+	case 't':
+		return isatty((int)test_int(t, arg));
+	case 'r':
+		return access(arg, R_OK) == 0;
+	case 'w':
+		return access(arg, W_OK) == 0;
+	case 'x':
+		return access(arg, X_OK) == 0;
+	case 'h':
+	case 'L':
+		return lstat(arg, &sb) == 0 && S_ISLNK(sb.st_mode);
+	}
+
+	if (stat(arg, &sb) == -1) {
+		return 0;
+	}
+	switch (op[1]) {
+	case 'b':
+		return S_ISBLK(sb.st_mode);
+	case 'c':
+		return S_ISCHR(sb.st_mode);
+	case 'd':
+		return S_ISDIR(sb.st_mode);
+	case 'f':
+		return S_ISREG(sb.st_mode);
+	case 'g':
+		return (sb.st_mode & S_ISGID) != 0;
+	case 'p':
+		return S_ISFIFO(sb.st_mode);
+	case 'S':
+		return S_ISSOCK(sb.st_mode);
+	case 's':
+		return sb.st_size > 0;
+	case 'u':
+		return (sb.st_mode & S_ISUID) != 0;
+	}
+
+	return 1;				/* -e */
+}
+
+static int
+test_binary(struct texpr *t, const char *l, const char *op, const char *r)
+{
+	struct stat	 sl, sr;
+	intmax_t	 a, b;
+
+	if (!strcmp(op, "=")) {
+		return !strcmp(l, r);
+	} else if (!strcmp(op, "!=")) {
+		return strcmp(l, r) != 0;
+	} else if (op[1] == 'n' && op[2] == 't') {
+		return stat(l, &sl) == 0 && (stat(r, &sr) == -1 ||
+		    timespec_cmp(&sl.st_mtim, &sr.st_mtim) > 0);
+	} else if (op[1] == 'o' && op[2] == 't') {
+		return stat(r, &sr) == 0 && (stat(l, &sl) == -1 ||
+		    timespec_cmp(&sl.st_mtim, &sr.st_mtim) < 0);
+	} else if (op[1] == 'e' && op[2] == 'f') {
+		return stat(l, &sl) == 0 && stat(r, &sr) == 0 &&
+		    sl.st_dev == sr.st_dev && sl.st_ino == sr.st_ino;
+	}
+
+	a = test_int(t, l);
+	b = test_int(t, r);
+	switch (op[1] << 8 | op[2]) {
+	case 'e' << 8 | 'q':
+		return a == b;
+	case 'n' << 8 | 'e':
+		return a != b;
+	case 'g' << 8 | 't':
+		return a > b;
+	case 'g' << 8 | 'e':
+		return a >= b;
+	case 'l' << 8 | 't':
+		return a < b;
+	}
+
+	return a <= b;				/* -le */
+}
+
+/*
+ * Integer operand s of test, flagging an error if it is not one.
+ */
+static intmax_t
+test_int(struct texpr *t, const char *s)
+{
+	intmax_t	 v;
+	char		*end;
+
+	errno = 0;
+	v = strtoimax(s, &end, 10);
+	while (*end == ' ' || *end == '\t') {
+		end++;
+	}
+	if (end == s || *end != '\0' || errno == ERANGE) {
+		if (!t->err) {
+			warnx("test: %s: integer expected", s);
+		}
+		t->err = 1;
+	}
+
+	return v;
+}
+
+static int
+timespec_cmp(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec) {
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	}
+	if (a->tv_nsec != b->tv_nsec) {
+		return a->tv_nsec < b->tv_nsec ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/*
+ * cd [-L | -P] [dir | - | ~]
+ *
+ * Change directory. By default the new directory is worked out from
+ * the logical PWD, so '..' undoes the last component even across a
+ * symbolic link; -P resolves it physically instead. 'cd -' goes back
+ * to OLDPWD and prints it.
+ */
+static int
+cd_builtin(struct args *a)
+{
+	const char	*cmd = a->argv[0];
+	const char	*dir;
+	int		 physical = 0;	/* -P */
+	int		 print = 0;	/* Print new directory. */
+	int		 i;
+
+	for (i = 1; i < a->argc && a->argv[i][0] == '-' &&
+	    a->argv[i][1] != '\0'; i++) {
+		if (!strcmp(a->argv[i], "-P")) {
+			physical = 1;
+		} else if (!strcmp(a->argv[i], "-L")) {
+			physical = 0;
+		} else if (!strcmp(a->argv[i], "--")) {
+			i++;
+			break;
+		} else {
+			warnx("%s: %s: invalid option", cmd, a->argv[i]);
+			return 1;
+		}
+	}
+
+	switch (a->argc - i) {
+	case 0:					/* No args to cd. */
+		if ((dir = var_get("HOME")) == NULL) {
+			warnx("%s: HOME not set", cmd);
+			return 1;
+		}
+		break;
+	case 1:					/* Only one arg to cd. */
+		dir = a->argv[i];
+		if (!strcmp(dir, "~") && var_get("HOME") != NULL) {
+			dir = var_get("HOME");
+		} else if (!strcmp(dir, "-")) {
+			if (oldpwd[0] == '\0') {
+				warnx("%s: OLDPWD not set", cmd);
+				return 1;
+			}
+			dir = oldpwd;
+			print = 1;
+		}
+		break;
+	default:				/* More than one arg to cd. */
+		warnx("%s: too many arguments", cmd);
+		return 1;
+	}
+
+	return cd_to(cmd, dir, physical, print);
+}
+
+/*
+ * Change to dir, then update PWD and OLDPWD and mark the prompt for
+ * re-rendering. This is the only place the shell's idea of its
+ * current directory changes.
+ */
+static int
+cd_to(const char *cmd, const char *dir, int physical, int print)
+{
+	char		 buf[PATH_MAX];
+
+	if (cwd_fd != -1) {		/* Zygotes get the new one. */
+		close(cwd_fd);
+		cwd_fd = -1;
+	}
+
+	if (physical) {
+		if (chdir(dir) == -1) {
+			warn("%s: %s", cmd, dir);
+			return 1;
+		}
+		if (getcwd(buf, sizeof(buf)) == NULL) {
+			warn("%s: getcwd", cmd);
+			return 1;
+		}
+	} else {
+		if (pwd_canon(buf, sizeof(buf), pwd, dir) == -1) {
+			errno = ENAMETOOLONG;
+			warn("%s: %s", cmd, dir);
+			return 1;
+		}
+		if (chdir(buf) == -1) {
+			warn("%s: %s", cmd, dir);
+			return 1;
+		}
+	}
+
+	memcpy(oldpwd, pwd, sizeof(oldpwd));
+	memcpy(pwd, buf, sizeof(pwd));
+	var_set("OLDPWD", 6, oldpwd, 1);
+	var_set("PWD", 3, pwd, 1);
+	prompt_dirty = 1;
+
+	/* PATH lookups relative to the old directory are now stale. */
+	if (pathtab_path != NULL && path_relative(pathtab_path)) {
+		path_clear();
+	}
+
+	if (print) {
+		out_printf(&bout, "%s\n", pwd);
+	}
+
+	return 0;
+}
+
+/*
+ * Work out the absolute path of dir relative to directory base, and
+ * remove '.', '..' and repeated slashes without looking at the file
+ * system. Returns -1 if the result does not fit in size bytes.
+ */
+static int
+pwd_canon(char *buf, size_t size, const char *base, const char *dir)
+{
+	const char	*s;
+	const char	*end;
+	size_t		 len = 0;
+	size_t		 n;
+	int		 pass;
+
+	/* Pass 0 walks base, unless dir is absolute; pass 1 walks dir. */
+	for (pass = dir[0] == '/'; pass < 2; pass++) {
+		for (s = pass ? dir : base; *s != '\0'; s = end) {
+			while (*s == '/') {
+				s++;
+			}
+			end = strchrnul(s, '/');
+			n = (size_t)(end - s);
+			if (n == 0 || (n == 1 && s[0] == '.')) {
+				continue;
+			}
+			if (n == 2 && s[0] == '.' && s[1] == '.') {
+				while (len > 0 && buf[--len] != '/') {
+					continue;
+				}
+				continue;
+			}
+			if (len + 1 + n >= size) {
+				return -1;
+			}
+			buf[len++] = '/';
+			memcpy(buf + len, s, n);
+			len += n;
+		}
+	}
+
+	if (len == 0) {
+		buf[len++] = '/';
+	}
+	buf[len] = '\0';
+
+	return 0;
+}
+
+/*
+ * Set up PWD at startup. An inherited PWD is kept if it is canonical
+ * and names the current directory; otherwise use getcwd(3).
+ */
+static void
+pwd_init(void)
+{
+	const char	*env;
+	struct stat	 sa, sb;
+	char		 buf[PATH_MAX];
+
+	env = var_get("PWD");
+	if (env != NULL && env[0] == '/' &&
+	    pwd_canon(buf, sizeof(buf), "/", env) == 0 &&
+	    !strcmp(buf, env) && stat(env, &sa) == 0 &&
+	    stat(".", &sb) == 0 &&
+	    sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino) {
+		memcpy(pwd, buf, sizeof(pwd));
+	} else if (getcwd(pwd, sizeof(pwd)) == NULL) {
+		err(1, "getcwd");
+	}
+
+	if ((env = var_get("OLDPWD")) != NULL && strlen(env) < sizeof(oldpwd)) {
+		memcpy(oldpwd, env, strlen(env) + 1);
+	}
+
+	var_set("PWD", 3, pwd, 1);
+	prompt_dirty = 1;
+}
+
+/*
+ * Run every command of pipeline pl at once, each stage connected to
+ * the next with a pipe. A lone builtin runs in the shell itself.
+ * Returns the exit status of the last stage of a foreground pipeline.
+ * If ru is not NULL, the resource usage of each stage is added to it.
+ */
+static int
+proc_run(struct pipeline *pl, struct rusage *ru)
+{
+	pid_t		*pids;
+	struct args	*a;
+	int		 ret;
+	int		 fds[2];
+	int		 in = -1;		/* Read end for this stage. */
+	int		 out;			/* Write end for this stage. */
+	int		 i;
+	uint64_t	 t;
+	const struct builtin *b;
+	struct capture	*cap = bout.cap;	/* Output for $(...). */
+	struct capture	 text = { NULL, 0, 0 };	/* Of a background job. */
+	struct pipeline	 copy;
+
+	/* Expanding rewrites commands, which a loop runs again. */
+	for (i = 0; i < pl->ncmds && !pl->cmds[i].expand; i++)
+		;
+	if (i < pl->ncmds) {
+		copy = *pl;
+		copy.cmds = memcpy(arena_alloc(&cmd_arena, (size_t)pl->ncmds *
+		    sizeof(*pl->cmds)), pl->cmds,
+		    (size_t)pl->ncmds * sizeof(*pl->cmds));
+		pl = &copy;
+	}
+
+	for (i = 0; i < pl->ncmds; i++) {
+		a = &pl->cmds[i];
+		if (a->expand && expand_args(a) == -1) {
+			return 1;
+		}
+		if (a->argc == 0) {		/* Expanded to nothing. */
+			if (pl->ncmds == 1) {
+				return var_assign_run(a);
+			}
+			warnx("empty command in pipeline");
+			return 1;
+		}
+	}
+
+	if (pl->ndocs > 0 && heredoc_open(pl) == -1) {
+		return 1;
+	}
+
+	/* Only pure builtins can write straight into a capture. */
+	t = stat_now();
+	a = &pl->cmds[0];
+	if (pl->ncmds == 1 && (b = builtin_find(a->argv[0])) != NULL &&
+	    (cap == NULL || b->pure)) {
+		if (a->nassign > 0) {
+			ret = assign_builtin(b, a);
+		} else {
+			ret = a->redir == NULL ? b->fn(a) :
+			    redir_builtin(b, a);
+		}
+		stat_add(PH_BUILTIN, t);
+		if (pl->ndocs > 0) {
+			heredoc_close(pl);
+		}
+		return ret;			/* Was a builtin command. */
+	}
+
+	pids = arena_alloc(&cmd_arena, (size_t)pl->ncmds * sizeof(*pids));
+	for (i = 0; i < pl->ncmds; i++) {
+		pids[i] = -1;		/* Until the stage is started. */
+	}
+	out_flush(&bout);		/* Builtin output goes first. */
+	t = stat_now();
+
+	for (i = 0; i < pl->ncmds; i++) {
+		a = &pl->cmds[i];
+		out = -1;
+		if (i < pl->ncmds - 1 || cap != NULL) {
+			/* Close-on-exec, so no child holds a stray end. */
+			if (pipe2(fds, O_CLOEXEC) == -1) {
+				warn("pipe2");
+				pids[i] = -1;
+				break;
+			}
+			if (pipe_size > 0 &&
+			    fcntl(fds[1], F_SETPIPE_SZ, pipe_size) == -1) {
+				warn("F_SETPIPE_SZ");
+			}
+			out = fds[1];
+		}
+
+		/* Builtins in a pipeline run in a forked subshell. */
+		if (fflag || builtin_find(a->argv[0]) != NULL) {
+			pids[i] = proc_fork(a, in, out);
+		} else {
+			pids[i] = proc_spawn(a, in, out);
+		}
+
+		if (in != -1) {
+			close(in);
+		}
+		if (out != -1) {
+			close(out);
+			in = fds[0];
+		}
+	}
+	if (pl->ndocs > 0) {
+		heredoc_close(pl);
+	}
+	t = stat_add(PH_SPAWN, t);
+
+	/* Replace used zygotes while the pipeline runs. */
+	if (zpool_n < zygote_size) {
+		zygote_fill();
+	}
+
+	/* The last stage wrote into a pipe for $(...). Read it first. */
+	if (i == pl->ncmds && cap != NULL) {
+		capture_fd(cap, in);
+	}
+	if (in != -1) {
+		close(in);
+	}
+
+	if (pl->ps == STATE_BG) {		/* Background exec(). */
+		pipe_text(&text, pl);
+		bg_add(text.buf, text.len, pids, pl->ncmds);
+		return 0;
+	}
+
+	ret = 127;
+	for (i = 0; i < pl->ncmds; i++) {	/* Block for children. */
+		ret = pids[i] > 0 ? proc_wait(pids[i], ru) : 127;
+	}
+	stat_add(PH_WAIT, t);
+
+	return ret;
+}
+
+/*
+ * Wait for child pid with wait4(2), so that only that child is reaped
+ * and its resource usage is collected. If ru is not NULL, the child's
+ * usage is added to it. Returns the child's shell exit status.
+ */
+static int
+proc_wait(pid_t pid, struct rusage *ru)
+{
+	struct rusage	 cru;
+	int		 status;
+
+	while (wait4(pid, &status, 0, &cru) == -1) {
+		if (errno != EINTR) {
+			warn("wait4");
+			return 127;
+		}
+	}
+
+	if (ru != NULL) {
+		timeradd(&ru->ru_utime, &cru.ru_utime, &ru->ru_utime);
+		timeradd(&ru->ru_stime, &cru.ru_stime, &ru->ru_stime);
+		if (cru.ru_maxrss > ru->ru_maxrss) {
+			ru->ru_maxrss = cru.ru_maxrss;
+		}
+		ru->ru_nvcsw += cru.ru_nvcsw;
+		ru->ru_nivcsw += cru.ru_nivcsw;
+	}
+
+	return status_code(status);
+}
+
+/*
+ * time pipeline
+ *
+ * Run pipeline and report its wall clock time from the monotonic
+ * clock, the user and system CPU time, largest resident set size and
+ * voluntary and involuntary context switches of its processes, from
+ * wait4(2). A builtin is measured with getrusage(2) on the shell.
+ */
+static int
+time_run(struct pipeline *pl)
+{
+	struct timespec	 t0, t1;
+	struct rusage	 ru;
+	struct rusage	 self0, self1;
+	struct pipeline	 copy = *pl;
+	struct args	*a;
+	int		 ret = 0;
+
+	/* Strip 'time' off a copy of the first command: a loop may run
+	 * the pipeline again. */
+	copy.cmds = memcpy(arena_alloc(&cmd_arena, (size_t)pl->ncmds *
+	    sizeof(*pl->cmds)), pl->cmds, (size_t)pl->ncmds * sizeof(*pl->cmds));
+	pl = &copy;
+	a = &pl->cmds[0];
+	a->argv++;
+	a->argc--;
+	a->file = a->argv[0];
+	if (a->argc == 0 && pl->ncmds > 1) {
+		warnx("syntax error near '|'");
+		return 2;
+	}
+
+	memset(&ru, 0, sizeof(ru));
+	getrusage(RUSAGE_SELF, &self0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	if (a->argc > 0) {
+		ret = proc_run(pl, &ru);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	getrusage(RUSAGE_SELF, &self1);
+
+	/* Add what the shell itself spent, for builtins. */
+	timersub(&self1.ru_utime, &self0.ru_utime, &self1.ru_utime);
+	timersub(&self1.ru_stime, &self0.ru_stime, &self1.ru_stime);
+	timeradd(&ru.ru_utime, &self1.ru_utime, &ru.ru_utime);
+	timeradd(&ru.ru_stime, &self1.ru_stime, &ru.ru_stime);
+	ru.ru_nvcsw += self1.ru_nvcsw - self0.ru_nvcsw;
+	ru.ru_nivcsw += self1.ru_nivcsw - self0.ru_nivcsw;
+	if (ru.ru_maxrss == 0) {
+		ru.ru_maxrss = self1.ru_maxrss;
+	}
+
+	t1.tv_sec -= t0.tv_sec;
+	if ((t1.tv_nsec -= t0.tv_nsec) < 0) {
+		t1.tv_sec--;
+		t1.tv_nsec += 1000000000L;
+	}
+
+	out_flush(&bout);
+	fprintf(stderr, "real\t%lld.%09lds\n", (long long)t1.tv_sec,
+	    t1.tv_nsec);
+	fprintf(stderr, "user\t%lld.%06lds\n",
+	    (long long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec);
+	fprintf(stderr, "sys\t%lld.%06lds\n",
+	    (long long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec);
+	fprintf(stderr, "maxrss\t%ld KB\n", ru.ru_maxrss);
+	fprintf(stderr, "nvcsw\t%ld\n", ru.ru_nvcsw);
+	fprintf(stderr, "nivcsw\t%ld\n", ru.ru_nivcsw);
+
+	return ret;
+}
+
+/*
+ * Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static uint64_t
+stat_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Record the time since start in the histogram of phase ph.
+ * Returns the current time, so consecutive phases can be chained.
+ *
+ * Buckets are log-linear: values below HIST_SUB nanoseconds get a
+ * bucket each, and every power of two above that is split into
+ * HIST_SUB equal buckets, which bounds the error to 1/HIST_SUB.
+ */
+static uint64_t
+stat_add(enum phase ph, uint64_t start)
+{
+	struct hist	*h = &stats[ph];
+	uint64_t	 now;
+	uint64_t	 v;
+
+	now = stat_now();
+	v = now - start;
+
+	h->b[hist_bucket(v)]++;
+	if (h->count++ == 0 || v < h->min) {
+		h->min = v;
+	}
+	if (v > h->max) {
+		h->max = v;
+	}
+	h->sum += v;
+
+	return now;
+}
+
+/*
+ * Bucket index of value v.
+ */
+static unsigned
+hist_bucket(uint64_t v)
+{
+	unsigned	 e;
+
+	if (v < HIST_SUB) {
+		return (unsigned)v;
+	}
+	e = 63 - (unsigned)__builtin_clzll(v);	/* v >= 2^e */
+
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+	    (unsigned)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * Largest value that falls into bucket i.
+ */
+static uint64_t
+hist_high(unsigned i)
+{
+	unsigned	 e;
+	uint64_t	 lo;
+
+	if (i < HIST_SUB) {
+		return i;
+	}
+	e = i / HIST_SUB + HIST_SUB_BITS - 1;
+	lo = ((uint64_t)1 << e) +
+	    ((uint64_t)(i % HIST_SUB) << (e - HIST_SUB_BITS));
+
+	return lo + ((uint64_t)1 << (e - HIST_SUB_BITS)) - 1;
+}
+
+/*
+ * Value at percentile pct of histogram h: the top of the bucket that
+ * holds it, but never more than the largest value seen.
+ */
+static uint64_t
+hist_pct(const struct hist *h, double pct)
+{
+	uint64_t	 want;
+	uint64_t	 seen = 0;
+	unsigned	 i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	want = (uint64_t)(pct / 100.0 * (double)h->count + 0.5);
+	if (want == 0) {
+		want = 1;
+	}
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if ((seen += h->b[i]) >= want) {
+			return hist_high(i) < h->max ? hist_high(i) : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+/*
+ * ssistat [-r] [-o file]
+ *
+ * Print the count, p50, p99 and max latency of each phase of running
+ * a command. -o writes them, with every non-empty bucket, to file in
+ * a machine readable form, and -r resets the histograms afterwards.
+ */
+static int
+ssistat_builtin(struct args *a)
+{
+	const struct hist	*h;
+	const char		*file = NULL;
+	FILE			*fp;
+	int			 reset = 0;
+	int			 i;
+	unsigned		 k;
+
+	for (i = 1; i < a->argc; i++) {
+		if (!strcmp(a->argv[i], "-r")) {
+			reset = 1;
+		} else if (!strcmp(a->argv[i], "-o") && i + 1 < a->argc) {
+			file = a->argv[++i];
+		} else {
+			warnx("usage: %s [-r] [-o file]", a->argv[0]);
+			return 1;
+		}
+	}
+
+	if (file != NULL) {
+		if ((fp = fopen(file, "we")) == NULL) {
+			warn("%s: %s", a->argv[0], file);
+			return 1;
+		}
+		fprintf(fp, "# ssistat 1 ns\n");
+		for (i = 0; i < PH_MAX; i++) {
+			h = &stats[i];
+			fprintf(fp, "phase %s count %llu sum %llu min %llu "
+			    "p50 %llu p90 %llu p99 %llu p999 %llu max %llu\n",
+			    phase_names[i], (unsigned long long)h->count,
+			    (unsigned long long)h->sum,
+			    (unsigned long long)h->min,
+			    (unsigned long long)hist_pct(h, 50),
+			    (unsigned long long)hist_pct(h, 90),
+			    (unsigned long long)hist_pct(h, 99),
+			    (unsigned long long)hist_pct(h, 99.9),
+			    (unsigned long long)h->max);
+			for (k = 0; k < HIST_BUCKETS; k++) {
+				if (h->b[k] != 0) {
+					fprintf(fp, "bucket %s %llu %llu\n",
+					    phase_names[i],
+					    (unsigned long long)hist_high(k),
+					    (unsigned long long)h->b[k]);
+				}
+			}
+		}
+		if (fclose(fp) == EOF) {
+			warn("%s: %s", a->argv[0], file);
+			return 1;
+		}
+	} else if (!reset) {
+		out_printf(&bout, "%-8s %10s %12s %12s %12s\n", "phase",
+		    "count", "p50(us)", "p99(us)", "max(us)");
+		for (i = 0; i < PH_MAX; i++) {
+			h = &stats[i];
+			out_printf(&bout, "%-8s %10llu %12.3f %12.3f %12.3f\n",
+			    phase_names[i], (unsigned long long)h->count,
+			    (double)hist_pct(h, 50) / 1e3,
+			    (double)hist_pct(h, 99) / 1e3,
+			    (double)h->max / 1e3);
+		}
+	}
+
+	if (reset) {
+		memset(stats, 0, sizeof(stats));
+	}
+
+	return 0;
+}
+
+/*
+ * Launch a child with posix_spawn(3). On Linux this is built on
+ * clone(CLONE_VM|CLONE_VFORK), so the parent's page tables are never
+ * copied and the launch cost does not grow with the shell's size.
+ * The command is resolved through the PATH cache, so the child does a
+ * single execve(2), and a cached miss costs no syscalls at all.
+ * If in or out is not -1, it becomes the child's stdin or stdout.
+ */
+static pid_t
+proc_spawn(struct args *a, int in, int out)
+{
+	posix_spawn_file_actions_t	 fa;
+	pid_t				 pid;
+	int				 error;
+	int				 actions;
+	const char			*path;
+	const struct redir		*r;
+
+	if ((path = cmd_lookup(a)) == NULL) {
+		warnx("%s: not found", a->file);
+		return -1;
+	}
+	if (zpool_n > 0 && (pid = zygote_launch(a, path, in, out)) != 0) {
+		return pid;
+	}
+
+	/*
+	 * File actions allocate, so only set them up when needed.
+	 * Redirections follow the pipe ends, so 2>&1 joins the pipe.
+	 */
+	actions = in != -1 || out != -1 || a->redir != NULL;
+	if (actions) {
+		if ((error = posix_spawn_file_actions_init(&fa)) != 0) {
+			errno = error;
+			err(1, "posix_spawn_file_actions_init");
+		}
+		if (in != -1) {
+			posix_spawn_file_actions_adddup2(&fa, in,
+			    STDIN_FILENO);
+		}
+		if (out != -1) {
+			posix_spawn_file_actions_adddup2(&fa, out,
+			    STDOUT_FILENO);
+		}
+		for (r = a->redir; r != NULL; r = r->next) {
+			if (r->type == R_DUP || r->type == R_DOC) {
+				posix_spawn_file_actions_adddup2(&fa, r->src,
+				    r->fd);
+			} else if (r->type == R_CLOSE) {
+				posix_spawn_file_actions_addclose(&fa, r->fd);
+			} else {
+				posix_spawn_file_actions_addopen(&fa, r->fd,
+				    r->file, redir_flags(r->type), 0666);
+			}
+		}
+	}
+
+	error = posix_spawn(&pid, path, actions ? &fa : NULL, NULL, a->argv,
+	    a->nassign > 0 ? var_env_cmd(a) : var_env());
+	if (actions) {
+		posix_spawn_file_actions_destroy(&fa);
+	}
+	if (error != 0) {
+		path_forget(a->file);	/* Stale entry; search again. */
+		if (a->redir != NULL && redir_check(a)) {
+			return -1;	/* A file, not the command. */
+		}
+		if (error == ENOENT) {
+			warnx("%s: not found", a->file);
+		} else {
+			errno = error;
+			warn("%s", a->file);
+		}
+		return -1;
+	}
+
+	return pid;
+}
+
+/*
+ * Launch a child with a full fork(2) and execvp(3). Only needed when
+ * the child has to run shell code before exec(), such as a builtin in
+ * a pipeline, or when asked for with -f.
+ * If in or out is not -1, it becomes the child's stdin or stdout.
+ */
+static pid_t
+proc_fork(struct args *a, int in, int out)
+{
+	pid_t		 pid;
+	int		 ret;
+	const char	*path;
+
+	out_flush(&bout);		/* Child must not repeat output. */
+	if ((pid = fork()) == -1) {
+		warn("fork");
+		return -1;
+	}
+
+	if (pid == 0) {				/* Child. */
+		bout.cap = NULL;		/* Output goes to fd 1. */
+		zygote_forget();		/* Not its children. */
+		bg_forget();
+		if (in != -1 && dup2(in, STDIN_FILENO) == -1) {
+			err(1, "dup2");
+		}
+		if (out != -1 && dup2(out, STDOUT_FILENO) == -1) {
+			err(1, "dup2");
+		}
+		redir_child(a);
+		if ((ret = builtin_run(a)) != -1) {
+			out_flush(&bout);
+			_exit(ret);
+		}
+		if ((path = cmd_lookup(a)) != NULL) {
+			execve(path, a->argv,
+			    a->nassign > 0 ? var_env_cmd(a) : var_env());
+		}
+		warnx("%s: not found", a->file);
+		_exit(127);			/* 127 for cmd not found. */
+	}
+
+	return pid;
+}
+
+/*
+ * open(2) flags for a redirection to a file of type t.
+ */
+static int
+redir_flags(enum redir_type t)
+{
+	switch (t) {
+	case R_OUT:
+		return O_WRONLY | O_CREAT | O_TRUNC;
+	case R_APPEND:
+		return O_WRONLY | O_CREAT | O_APPEND;
+	default:
+		return O_RDONLY;
+	}
+}
+
+/*
+ * Run builtin b for a with its redirections, in the shell itself.
+ * Standard output is only pointed elsewhere in bout, which saves the
+ * dup2(2) calls to move the shell's own fd 1 away and back, unless b
+ * spawns children that write to it. Other descriptors are moved, and
+ * put back afterwards.
+ */
+static int
+redir_builtin(const struct builtin *b, struct args *a)
+{
+	const struct redir	*r;
+	int			 saved[REDIR_FDS];	/* Shell's own fds. */
+	int			 opened = -1;	/* File opened for bout. */
+	int			 fd;
+	struct capture		*cap = bout.cap;
+	int			 lbf = bout.lbf;
+	int			 ret = 0;
+	int			 i;
+
+	for (i = 0; i < REDIR_FDS; i++) {
+		saved[i] = -2;			/* Not moved. */
+	}
+	out_flush(&bout);
+
+	for (r = a->redir; r != NULL; r = r->next) {
+		if (r->type == R_DUP) {
+			fd = r->src == STDOUT_FILENO ? bout.fd : r->src;
+		} else if (r->type == R_DOC) {
+			fd = r->src;
+		} else if (r->type == R_CLOSE) {
+			fd = -1;
+		} else if ((fd = open(r->file, redir_flags(r->type) |
+		    O_CLOEXEC, 0666)) == -1) {
+			warn("%s", r->file);
+			ret = 1;
+			break;
+		}
+
+		if (r->fd == STDOUT_FILENO && !b->spawns) {
+			if (opened != -1) {
+				close(opened);
+			}
+			opened = r->file == NULL || r->type == R_DOC ?
+			    -1 : fd;
+			bout.fd = fd;
+			bout.lbf = 0;
+			bout.cap = NULL;
+			continue;
+		}
+
+		if (saved[r->fd] == -2) {
+			saved[r->fd] = fcntl(r->fd, F_DUPFD_CLOEXEC, REDIR_FDS);
+		}
+		if (fd == -1) {
+			close(r->fd);
+		} else if (dup2(fd, r->fd) == -1) {
+			warn("dup2");
+			ret = 1;
+		}
+		if (r->file != NULL && r->type != R_DOC) {
+			close(fd);
+		}
+		if (ret != 0) {
+			break;
+		}
+	}
+
+	if (ret == 0) {
+		ret = b->fn(a);
+	}
+
+	out_flush(&bout);
+	if (opened != -1) {
+		close(opened);
+	}
+	bout.fd = STDOUT_FILENO;
+	bout.lbf = lbf;
+	bout.cap = cap;
+	if (bout.err && ret == 0) {
+		ret = 1;
+	}
+	bout.err = 0;
+
+	for (i = 0; i < REDIR_FDS; i++) {
+		if (saved[i] == -1) {		/* Was closed. */
+			close(i);
+		} else if (saved[i] >= 0) {
+			dup2(saved[i], i);
+			close(saved[i]);
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Run builtin b for a with its NAME=value prefix assignments in
+ * effect, and exported, as they would be for a command. Afterwards
+ * the variables are put back as they were.
+ */
+static int
+assign_builtin(const struct builtin *b, struct args *a)
+{
+	struct var	*v;
+	char		**old;		/* "name=value" before, or NULL. */
+	int		*exported;
+	const char	*s;
+	char		*name;
+	char		*eq;
+	size_t		 n;
+	int		 ret;
+	int		 i;
+
+	if ((old = calloc((size_t)a->nassign, sizeof(*old))) == NULL ||
+	    (exported = calloc((size_t)a->nassign,
+	    sizeof(*exported))) == NULL) {
+		err(1, "calloc");
+	}
+	for (i = 0; i < a->nassign; i++) {
+		s = a->assign[i];
+		n = (size_t)(strchr(s, '=') - s);
+		if ((v = var_find(s, n)) != NULL) {
+			if ((old[i] = strdup(v->str)) == NULL) {
+				err(1, "strdup");
+			}
+			exported[i] = v->exported;
+		}
+		var_set(s, n, s + n + 1, 1);
+	}
+
+	ret = a->redir == NULL ? b->fn(a) : redir_builtin(b, a);
+
+	/* Backwards, so a name given twice gets its first old value. */
+	for (i = a->nassign - 1; i >= 0; i--) {
+		s = a->assign[i];
+		n = (size_t)(strchr(s, '=') - s);
+		eq = old[i] != NULL ? strchr(old[i], '=') : NULL;
+		if (eq == NULL) {	/* Was unset, or had no value. */
+			name = memcpy(arena_alloc(&cmd_arena, n + 1), s, n);
+			var_unset(name);
+			if (old[i] == NULL) {
+				continue;
+			}
+		}
+		var_set(s, n, eq != NULL ? eq + 1 : NULL, 0);
+		if (!exported[i] && (v = var_find(s, n)) != NULL &&
+		    v->exported) {
+			v->exported = 0;
+			nexported--;
+			env_dirty = 1;
+		}
+		free(old[i]);
+	}
+	free(old);
+	free(exported);
+
+	return ret;
+}
+
+/*
+ * Apply the redirections of a in a forked child, or exit.
+ */
+static void
+redir_child(struct args *a)
+{
+	const struct redir	*r;
+	int			 fd;
+
+	for (r = a->redir; r != NULL; r = r->next) {
+		if (r->type == R_CLOSE) {
+			close(r->fd);
+			continue;
+		}
+		if (r->type == R_DUP || r->type == R_DOC) {
+			fd = r->src;
+		} else if ((fd = open(r->file, redir_flags(r->type),
+		    0666)) == -1) {
+			warn("%s", r->file);
+			_exit(1);
+		}
+		if (fd != r->fd) {
+			if (dup2(fd, r->fd) == -1) {
+				warn("dup2");
+				_exit(1);
+			}
+			if (r->type != R_DUP && r->type != R_DOC) {
+				close(fd);
+			}
+		}
+	}
+}
+
+/*
+ * After posix_spawn(3) failed for a, report the redirection that
+ * could not be opened, if any, by trying them again.
+ * Returns 1 if one failed, 0 if the fault was the command's.
+ */
+static int
+redir_check(struct args *a)
+{
+	const struct redir	*r;
+	int			 fd;
+
+	for (r = a->redir; r != NULL; r = r->next) {
+		if (r->file == NULL || r->type == R_DOC) {
+			continue;
+		}
+		if ((fd = open(r->file, redir_flags(r->type) | O_CLOEXEC,
+		    0666)) == -1) {
+			warn("%s", r->file);
+			return 1;
+		}
+		close(fd);
+	}
+
+	return 0;
+}
+
+/*
+ * pipesize [bytes]
+ *
+ * Show or set the capacity requested with F_SETPIPE_SZ for each pipe
+ * in a pipeline. 0 leaves pipes at the system default size.
+ */
+static int
+pipesize_builtin(struct args *a)
+{
+	char		*ep;
+	long		 n;
+
+	switch (a->argc) {
+	case 1:
+		out_printf(&bout, "%d\n", pipe_size);
+		return 0;
+	case 2:
+		errno = 0;
+		n = strtol(a->argv[1], &ep, 10);
+		if (a->argv[1][0] == '\0' || *ep != '\0' || errno != 0 ||
+		    n < 0 || n > INT_MAX) {
+			warnx("%s: %s: invalid size", a->argv[0], a->argv[1]);
+			return 1;
+		}
+		pipe_size = (int)n;
+		return 0;
+	default:
+		warnx("%s: too many arguments", a->argv[0]);
+		return 1;
+	}
+}
+
+/*
+ * zygote [n]
+ *
+ * Show or set the number of zygotes: children forked ahead of time
+ * that wait to be sent a command, so launching one costs a message
+ * and an execve(2) instead of creating a process. 0 turns them off.
+ */
+static int
+zygote_builtin(struct args *a)
+{
+	static int	 registered;
+	char		*ep;
+	long		 n;
+
+	switch (a->argc) {
+	case 1:
+		out_printf(&bout, "%d\n", zygote_size);
+		return 0;
+	case 2:
+		errno = 0;
+		n = strtol(a->argv[1], &ep, 10);
+		if (a->argv[1][0] == '\0' || *ep != '\0' || errno != 0 ||
+		    n < 0 || n > ZYGOTE_MAX) {
+			warnx("%s: %s: invalid count", a->argv[0], a->argv[1]);
+			return 1;
+		}
+		if (!registered && n > 0) {
+			if (atexit(zygote_atexit) != 0) {
+				warn("atexit");
+				return 1;
+			}
+			registered = 1;
+		}
+		zygote_size = (int)n;
+		zygote_trim(zygote_size);
+		zygote_fill();
+		return 0;
+	default:
+		warnx("%s: too many arguments", a->argv[0]);
+		return 1;
+	}
+}
+
+/*
+ * Ask the zygote mother for zygotes until the pool holds zygote_size
+ * of them, starting the mother first if need be. Only the mother was
+ * forked from the shell: forking the shell for each zygote would make
+ * its every later write to memory a copy-on-write fault. The replies
+ * with the zygotes' pids are only read once each is needed.
+ */
+static void
+zygote_fill(void)
+{
+	union {
+		char		 buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr	 align;
+	} cm;
+	struct msghdr		 msg;
+	struct iovec		 iov;
+	struct cmsghdr		*c;
+	int			 sv[2];
+	char			 ch = 0;
+
+	if (zmother == -1) {
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+		    sv) == -1) {
+			warn("socketpair");
+			return;
+		}
+		out_flush(&bout);	/* Mother must not repeat output. */
+		if ((zmother_pid = fork()) == -1) {
+			warn("fork");
+			close(sv[0]);
+			close(sv[1]);
+			return;
+		}
+		if (zmother_pid == 0) {
+			zygote_mother(sv[1]);
+		}
+		close(sv[1]);
+		zmother = sv[0];
+	}
+
+	while (zpool_n < zygote_size) {
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+		    sv) == -1) {
+			warn("socketpair");
+			return;
+		}
+		memset(&msg, 0, sizeof(msg));
+		memset(&cm, 0, sizeof(cm));
+		iov.iov_base = &ch;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cm.buf;
+		msg.msg_controllen = sizeof(cm.buf);
+		c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(c), &sv[1], sizeof(int));
+		if (sendmsg(zmother, &msg, MSG_NOSIGNAL) == -1) {
+			warn("zygote");
+			close(sv[0]);
+			close(sv[1]);
+			return;
+		}
+		close(sv[1]);
+		zpool[zpool_n].pid = 0;		/* Reply not read yet. */
+		zpool[zpool_n].sock = sv[0];
+		zpool_n++;
+	}
+}
+
+/*
+ * Body of the zygote mother: for each socket sent on sock, clone a
+ * zygote that waits on it. CLONE_PARENT makes the zygote a child of
+ * the shell, which then waits for it like any other. Replies with the
+ * zygote's pid, or -1. Exits when the shell closes sock.
+ */
+static void
+zygote_mother(int sock)
+{
+	union {
+		char		 buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr	 align;
+	} cm;
+	struct msghdr		 msg;
+	struct iovec		 iov;
+	struct cmsghdr		*c;
+	pid_t			 pid;
+	ssize_t			 len;
+	int			 fd;
+	char			 ch;
+
+	zygote_forget();
+	if (sock > STDERR_FILENO + 1) {
+		close_range(STDERR_FILENO + 1, (unsigned)sock - 1, 0);
+	}
+	close_range((unsigned)sock + 1, ~0U, 0);
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = &ch;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cm.buf;
+		msg.msg_controllen = sizeof(cm.buf);
+		if ((len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 &&
+		    errno == EINTR) {
+			continue;
+		}
+		if (len <= 0 || (c = CMSG_FIRSTHDR(&msg)) == NULL ||
+		    c->cmsg_type != SCM_RIGHTS) {
+			_exit(0);		/* Shell has gone. */
+		}
+		memcpy(&fd, CMSG_DATA(c), sizeof(int));
+
+		pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0,
+		    NULL, NULL, 0);
+		if (pid == 0) {
+			close(sock);
+			zygote_main(fd);
+		}
+		close(fd);
+		if (send(sock, &pid, sizeof(pid), MSG_NOSIGNAL) == -1) {
+			_exit(0);
+		}
+	}
+}
+
+/*
+ * The pid of the zygote in zpool[i], which must be the first in the
+ * pool whose pid is not known yet. -1 if it was never started.
+ */
+static pid_t
+zygote_pid(int i)
+{
+	pid_t	 pid;
+
+	while (recv(zmother, &pid, sizeof(pid), 0) != (ssize_t)sizeof(pid)) {
+		if (errno != EINTR) {
+			pid = -1;
+			break;
+		}
+	}
+
+	return zpool[i].pid = pid;
+}
+
+/*
+ * Shut down the zygotes past the first n: closing its socket makes a
+ * zygote exit. With n 0, shut down the mother too.
+ */
+static void
+zygote_trim(int n)
+{
+	int	 i;
+
+	for (i = 0; i < zpool_n; i++) {
+		if (zpool[i].pid == 0) {
+			zygote_pid(i);
+		}
+	}
+	while (zpool_n > n) {
+		zpool_n--;
+		close(zpool[zpool_n].sock);
+		while (zpool[zpool_n].pid > 0 &&
+		    waitpid(zpool[zpool_n].pid, NULL, 0) == -1 &&
+		    errno == EINTR)
+			;
+	}
+	if (n == 0 && zmother != -1) {
+		close(zmother);
+		zmother = -1;
+		while (waitpid(zmother_pid, NULL, 0) == -1 && errno == EINTR)
+			;
+	}
+}
+
+/*
+ * In a forked child, let go of the shell's zygotes without stopping
+ * them.
+ */
+static void
+zygote_forget(void)
+{
+	while (zpool_n > 0) {
+		close(zpool[--zpool_n].sock);
+	}
+	if (zmother != -1) {
+		close(zmother);
+		zmother = -1;
+	}
+	zygote_size = 0;
+}
+
+static void
+zygote_atexit(void)
+{
+	zygote_trim(0);
+}
+
+/*
+ * Launch a, already found at path, through a zygote: send it argv,
+ * the environment, the redirections and the descriptors it needs,
+ * then wait for its execve(2). Returns the pid, -1 if the command
+ * could not be run, or 0 if a zygote cannot take it and it should be
+ * spawned the usual way.
+ */
+static pid_t
+zygote_launch(struct args *a, const char *path, int in, int out)
+{
+	static char		 buf[ZYGOTE_MSG];
+	union {
+		char		 buf[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+		struct cmsghdr	 align;
+	} cm;
+	struct msghdr		 msg;
+	struct iovec		 iov;
+	struct cmsghdr		*c;
+	const struct redir	*r;
+	struct zygote		 z;
+	char		       **env;
+	char		       **v;
+	int			 fds[ZYGOTE_FDS];
+	int			 hdr[3];
+	int			 nfds = 4;
+	int			 e;
+	size_t			 len = sizeof(hdr);
+	size_t			 n;
+	ssize_t			 ret;
+
+	if (zpool_n == 0) {
+		return 0;
+	}
+	if (cwd_fd == -1 && (cwd_fd = open(".",
+	    O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		return 0;
+	}
+
+	/* Header, then path, argv and envp, then the redirections. */
+	env = a->nassign > 0 ? var_env_cmd(a) : var_env();
+	hdr[0] = a->argc;
+	hdr[1] = 0;
+	hdr[2] = 0;
+	for (v = env; *v != NULL; v++) {
+		hdr[1]++;
+	}
+	n = strlen(path) + 1;
+	if (n > sizeof(buf) - len) {
+		return 0;
+	}
+	memcpy(buf + len, path, n);
+	len += n;
+	for (v = a->argv; *v != NULL; v++) {
+		if ((n = strlen(*v) + 1) > sizeof(buf) - len) {
+			return 0;
+		}
+		memcpy(buf + len, *v, n);
+		len += n;
+	}
+	for (v = env; *v != NULL; v++) {
+		if ((n = strlen(*v) + 1) > sizeof(buf) - len) {
+			return 0;
+		}
+		memcpy(buf + len, *v, n);
+		len += n;
+	}
+	for (r = a->redir; r != NULL; r = r->next) {
+		/* Descriptors above 2 are the shell's own; not sent. */
+		if (r->type == R_DUP && r->src > STDERR_FILENO) {
+			return 0;
+		}
+		if (sizeof(buf) - len < 3) {
+			return 0;
+		}
+		buf[len++] = (char)r->type;
+		buf[len++] = (char)r->fd;
+		if (r->type == R_DOC) {
+			if (nfds == ZYGOTE_FDS) {
+				return 0;
+			}
+			buf[len++] = (char)nfds;
+			fds[nfds++] = r->src;
+		} else {
+			buf[len++] = (char)r->src;
+		}
+		if (r->type == R_IN || r->type == R_OUT ||
+		    r->type == R_APPEND) {
+			if ((n = strlen(r->file) + 1) > sizeof(buf) - len) {
+				return 0;
+			}
+			memcpy(buf + len, r->file, n);
+			len += n;
+		}
+		hdr[2]++;
+	}
+	memcpy(buf, hdr, sizeof(hdr));
+
+	fds[0] = cwd_fd;
+	fds[1] = in != -1 ? in : STDIN_FILENO;
+	fds[2] = out != -1 ? out : STDOUT_FILENO;
+	fds[3] = STDERR_FILENO;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&cm, 0, sizeof(cm));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cm.buf;
+	msg.msg_controllen = CMSG_SPACE((size_t)nfds * sizeof(int));
+	c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN((size_t)nfds * sizeof(int));
+	memcpy(CMSG_DATA(c), fds, (size_t)nfds * sizeof(int));
+
+	/* The oldest zygote has long been asleep in recvmsg(2). */
+	if (zpool[0].pid == 0) {
+		zygote_pid(0);
+	}
+	z = zpool[0];
+	memmove(zpool, zpool + 1, (size_t)--zpool_n * sizeof(*zpool));
+	if (z.pid == -1 || sendmsg(z.sock, &msg, MSG_NOSIGNAL) == -1) {
+		close(z.sock);			/* Zygote died; lose it. */
+		if (z.pid > 0) {
+			waitpid(z.pid, NULL, 0);
+		}
+		return 0;
+	}
+
+	/* The socket is close-on-exec: EOF means execve(2) worked. */
+	while ((ret = recv(z.sock, &e, sizeof(e), 0)) == -1 &&
+	    errno == EINTR)
+		;
+	close(z.sock);
+	if (ret != (ssize_t)sizeof(e)) {
+		return z.pid;
+	}
+
+	waitpid(z.pid, NULL, 0);
+	path_forget(a->file);		/* Stale entry; search again. */
+	if (e == ENOENT) {
+		warnx("%s: not found", a->file);
+	} else {
+		errno = e;
+		warn("%s", a->file);
+	}
+
+	return -1;
+}
+
+/*
+ * Body of a zygote: wait on socket sock for a command from
+ * zygote_launch(), set up its directory, stdio and redirections and
+ * exec it. Exits when the shell closes the socket.
+ */
+static void
+zygote_main(int sock)
+{
+	static char		 buf[ZYGOTE_MSG];
+	union {
+		char		 buf[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+		struct cmsghdr	 align;
+	} cm;
+	struct msghdr		 msg;
+	struct iovec		 iov;
+	struct cmsghdr		*c;
+	struct redir		*rv;
+	struct args		 a;
+	char		       **env;
+	char			*p;
+	char			*path;
+	int			 fds[ZYGOTE_FDS];
+	int			 hdr[3];
+	int			 i;
+	int			 e;
+	ssize_t			 len;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf) - 1;	/* Room for a final NUL. */
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cm.buf;
+	msg.msg_controllen = sizeof(cm.buf);
+	while ((len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 &&
+	    errno == EINTR)
+		;
+	if (len < (ssize_t)sizeof(hdr) || (c = CMSG_FIRSTHDR(&msg)) == NULL ||
+	    c->cmsg_type != SCM_RIGHTS || c->cmsg_len < CMSG_LEN(4 *
+	    sizeof(int))) {
+		_exit(0);			/* Shell has gone. */
+	}
+	memcpy(fds, CMSG_DATA(c), c->cmsg_len - CMSG_LEN(0));
+	buf[len] = '\0';
+	memcpy(hdr, buf, sizeof(hdr));
+
+	memset(&a, 0, sizeof(a));
+	a.argc = hdr[0];
+	if ((a.argv = calloc((size_t)hdr[0] + 1, sizeof(*a.argv))) == NULL ||
+	    (env = calloc((size_t)hdr[1] + 1, sizeof(*env))) == NULL ||
+	    (rv = calloc((size_t)hdr[2] + 1, sizeof(*rv))) == NULL) {
+		err(127, "calloc");
+	}
+	path = p = buf + sizeof(hdr);
+	p += strlen(p) + 1;
+	for (i = 0; i < hdr[0]; i++) {
+		a.argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	for (i = 0; i < hdr[1]; i++) {
+		env[i] = p;
+		p += strlen(p) + 1;
+	}
+	for (i = 0; i < hdr[2]; i++) {
+		rv[i].type = (enum redir_type)p[0];
+		rv[i].fd = p[1];
+		rv[i].src = rv[i].type == R_DOC ? fds[(int)p[2]] : p[2];
+		p += 3;
+		if (rv[i].type == R_IN || rv[i].type == R_OUT ||
+		    rv[i].type == R_APPEND) {
+			rv[i].file = p;
+			p += strlen(p) + 1;
+		}
+		rv[i].next = i + 1 < hdr[2] ? &rv[i + 1] : NULL;
+	}
+	a.redir = hdr[2] > 0 ? rv : NULL;
+	a.file = a.argv[0];
+
+	if (fchdir(fds[0]) == -1) {
+		warn("fchdir");
+		_exit(1);
+	}
+	for (i = 0; i < 3; i++) {
+		if (dup2(fds[i + 1], i) == -1) {
+			warn("dup2");
+			_exit(1);
+		}
+	}
+	redir_child(&a);
+
+	execve(path, a.argv, env);
+	e = errno;
+	send(sock, &e, sizeof(e), MSG_NOSIGNAL);
+	_exit(127);
+}
+
+/*
+ * Allocate n zeroed bytes from arena ar. Memory is only given back,
+ * all at once, by arena_reset() or arena_release().
+ */
+static void *
+arena_alloc(struct arena *ar, size_t n)
+{
+	struct achunk	*c = ar->head;
+	struct achunk	**sp;
+	size_t		 size;
+	void		*p;
+
+	n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (c == NULL || c->size - c->used < n) {
+		/* A released chunk that is big enough, or a new one. */
+		for (sp = &ar->spare; *sp != NULL && (*sp)->size < n;
+		    sp = &(*sp)->next)
+			;
+		if ((c = *sp) != NULL) {
+			*sp = c->next;
+		} else {
+			size = ar->head != NULL ? ar->head->size * 2 :
+			    ARENA_SIZE;
+			while (size < n) {
+				size *= 2;
+			}
+			if ((c = malloc(sizeof(*c) + size)) == NULL) {
+				err(1, "malloc");
+			}
+			c->size = size;
+		}
+		c->used = 0;
+		c->next = ar->head;
+		ar->head = c;
+	}
+
+	p = c->data + c->used;
+	c->used += n;
+	memset(p, 0, n);
+
+	return p;
+}
+
+/*
+ * Grow p, the last allocation from arena ar, from n to size bytes.
+ * It is extended in place while its chunk has room, and otherwise
+ * moved. The new bytes are not zeroed. p may be NULL if n is 0.
+ */
+static void *
+arena_grow(struct arena *ar, void *p, size_t n, size_t size)
+{
+	struct achunk	*c = ar->head;
+	size_t		 an;
+	size_t		 asize;
+	void		*q;
+
+	an = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	asize = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (p != NULL && c != NULL && (char *)p + an == c->data + c->used &&
+	    c->used - an + asize <= c->size) {
+		c->used = c->used - an + asize;
+		return p;
+	}
+
+	q = arena_alloc(ar, size);
+	if (n > 0) {
+		memcpy(q, p, n);
+	}
+
+	return q;
+}
+
+/*
+ * Give back everything allocated from arena ar. If the last command
+ * outgrew the first chunk, the chunks are replaced by a single one as
+ * big as all of them, so the next command of that size needs no
+ * malloc(3) at all.
+ */
+static void
+arena_reset(struct arena *ar)
+{
+	struct achunk	*c;
+	struct achunk	*next;
+	struct amark	 start = { NULL, 0 };
+	size_t		 size = 0;
+
+	arena_release(ar, &start);
+	if (ar->spare == NULL) {
+		return;
+	}
+	if (ar->spare->next == NULL) {
+		ar->head = ar->spare;
+		ar->head->used = 0;
+		ar->spare = NULL;
+		return;
+	}
+
+	for (c = ar->spare; c != NULL; c = next) {
+		next = c->next;
+		size += c->size;
+		free(c);
+	}
+	ar->spare = NULL;
+	if ((c = malloc(sizeof(*c) + size)) == NULL) {
+		err(1, "malloc");
+	}
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+	ar->head = c;
+}
+
+/*
+ * Remember in m how much of arena ar is in use.
+ */
+static void
+arena_mark(struct arena *ar, struct amark *m)
+{
+	m->head = ar->head;
+	m->used = ar->head != NULL ? ar->head->used : 0;
+}
+
+/*
+ * Give back everything allocated from arena ar since mark m. Chunks
+ * started since are kept as spares, for the arena to fill again
+ * without calling malloc(3).
+ */
+static void
+arena_release(struct arena *ar, const struct amark *m)
+{
+	struct achunk	*c;
+
+	while ((c = ar->head) != m->head) {
+		ar->head = c->next;
+		c->next = ar->spare;
+		ar->spare = c;
+	}
+	if (c != NULL) {
+		c->used = m->used;
+	}
+}
+
+/*
+ * Get a zeroed object from pool pl, carving a new slab of objects out
+ * of the heap when the free list is empty.
+ */
+static void *
+pool_get(struct pool *pl)
+{
+	char		*slab;
+	void		*p;
+	size_t		 i;
+
+	if (pl->free == NULL) {
+		if ((slab = calloc(POOL_SLAB, pl->size)) == NULL) {
+			err(1, "calloc");
+		}
+		for (i = 0; i < POOL_SLAB; i++) {
+			pool_put(pl, slab + i * pl->size);
+		}
+	}
+
+	p = pl->free;
+	pl->free = *(void **)p;
+	memset(p, 0, pl->size);
+
+	return p;
+}
+
+/*
+ * Put object p back on the free list of pool pl.
+ */
+static void
+pool_put(struct pool *pl, void *p)
+{
+	*(void **)p = pl->free;
+	pl->free = p;
+}
+
+/*
+ * FNV-1a hash of a NUL terminated string.
+ */
+static unsigned
+hash_str(const char *s)
+{
+	unsigned	 h = 2166136261u;
+
+	while (*s != '\0') {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/*
+ * Find the full path of command name, searching PATH only on a cache
+ * miss. Names containing a slash are not searched for or cached.
+ * The cache is thrown away whenever PATH changes.
+ * Returns NULL if name is not found in PATH.
+ */
+static const char *
+path_lookup(const char *name)
+{
+	struct pathent	*pe;
+	const char	*path;
+	unsigned	 h;
+
+	if (strchr(name, '/') != NULL) {
+		return name;
+	}
+
+	if ((path = var_get("PATH")) == NULL) {
+		path = "/usr/bin:/bin";
+	}
+	if (pathtab_path == NULL || strcmp(path, pathtab_path) != 0) {
+		path_clear();
+		if ((pathtab_path = strdup(path)) == NULL) {
+			err(1, "strdup");
+		}
+	}
+
+	h = hash_str(name) & (PATHTAB_SIZE - 1);
+	for (pe = pathtab[h]; pe != NULL; pe = pe->next) {
+		if (!strcmp(pe->name, name)) {
+			pe->hits++;
+			return pe->path;
+		}
+	}
+
+	/* Miss. Search PATH and remember the result, found or not. */
+	if ((pe = calloc(1, sizeof(*pe))) == NULL) {
+		err(1, "calloc");
+	}
+	if ((pe->name = strdup(name)) == NULL) {
+		err(1, "strdup");
+	}
+	pe->path = path_search(pathtab_path, name);
+	pe->hits = 1;
+	pe->next = pathtab[h];
+	pathtab[h] = pe;
+
+	return pe->path;
+}
+
+/*
+ * Walk every directory in search path path looking for an executable
+ * regular file called name. An empty component means the current
+ * directory. Returns a newly allocated path, or NULL if not found.
+ */
+static char *
+path_search(const char *path, const char *name)
+{
+	char		 buf[PATH_MAX];
+	const char	*dir;
+	const char	*end;
+	struct stat	 sb;
+	int		 len;
+	char		*p;
+
+	for (dir = path; dir != NULL; dir = *end ? end + 1 : NULL) {
+		end = strchrnul(dir, ':');
+		if (end == dir) {
+			len = snprintf(buf, sizeof(buf), "./%s", name);
+		} else {
+			len = snprintf(buf, sizeof(buf), "%.*s/%s",
+			    (int)(end - dir), dir, name);
+		}
+		if (len < 0 || (size_t)len >= sizeof(buf)) {
+			continue;
+		}
+		if (stat(buf, &sb) == 0 && S_ISREG(sb.st_mode) &&
+		    access(buf, X_OK) == 0) {
+			if ((p = strdup(buf)) == NULL) {
+				err(1, "strdup");
+			}
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the full path of the command of a. With a PATH=... prefix
+ * assignment, it is looked for in that PATH, bypassing the cache.
+ * Returns NULL if it is not found.
+ */
+static const char *
+cmd_lookup(struct args *a)
+{
+	char	*p;
+	char	*q;
+	size_t	 n;
+	int	 i;
+
+	if (strchr(a->file, '/') != NULL) {
+		return a->file;
+	}
+	for (i = a->nassign - 1; i >= 0; i--) {
+		if (strncmp(a->assign[i], "PATH=", 5) != 0) {
+			continue;
+		}
+		if ((p = path_search(a->assign[i] + 5, a->file)) == NULL) {
+			return NULL;
+		}
+		n = strlen(p) + 1;
+		q = memcpy(arena_alloc(&cmd_arena, n), p, n);
+		free(p);
+		return q;
+	}
+
+	return path_lookup(a->file);
+}
+
+/*
+ * Drop the cache entry for name, if there is one.
+ */
+static void
+path_forget(const char *name)
+{
+	struct pathent	**pp;
+	struct pathent	 *pe;
+
+	pp = &pathtab[hash_str(name) & (PATHTAB_SIZE - 1)];
+	for (pe = *pp; pe != NULL; pp = &pe->next, pe = *pp) {
+		if (!strcmp(pe->name, name)) {
+			*pp = pe->next;
+			free(pe->name);
+			free(pe->path);
+			free(pe);
+			return;
+		}
+	}
+}
+
+/*
+ * Empty the whole command path cache.
+ */
+static void
+path_clear(void)
+{
+	struct pathent	*pe;
+	struct pathent	*next;
+	int		 i;
+
+	for (i = 0; i < PATHTAB_SIZE; i++) {
+		for (pe = pathtab[i]; pe != NULL; pe = next) {
+			next = pe->next;
+			free(pe->name);
+			free(pe->path);
+			free(pe);
+		}
+		pathtab[i] = NULL;
+	}
+	free(pathtab_path);
+	pathtab_path = NULL;
+}
+
+/*
+ * Does search path path have an empty or relative component?
+ */
+static int
+path_relative(const char *path)
+{
+	const char	*s;
+
+	for (s = path; ; s++) {
+		if (*s != '/') {
+			return 1;
+		}
+		if ((s = strchr(s, ':')) == NULL) {
+			return 0;
+		}
+	}
+}
+
+/*
+ * hash [-r] [name ...]
+ *
+ * With no arguments, list the command path cache. -r empties it.
+ * Any names given are looked up and added to the cache.
+ */
+static int
+hash_builtin(struct args *a)
+{
+	struct pathent	*pe;
+	int		 i;
+	int		 ret = 0;
+
+	if (a->argc == 1) {
+		out_printf(&bout, "hits\tcommand\n");
+		for (i = 0; i < PATHTAB_SIZE; i++) {
+			for (pe = pathtab[i]; pe != NULL; pe = pe->next) {
+				out_printf(&bout, "%4u\t%s%s\n", pe->hits,
+				    pe->path ? pe->path : pe->name,
+				    pe->path ? "" : " (not found)");
+			}
+		}
+		return 0;
+	}
+
+	for (i = 1; i < a->argc; i++) {
+		if (!strcmp(a->argv[i], "-r")) {
+			path_clear();
+			continue;
+		}
+		if (path_lookup(a->argv[i]) == NULL) {
+			warnx("%s: not found", a->argv[i]);
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * FNV-1a hash of the n bytes of variable name s.
+ */
+static unsigned
+var_hash(const char *s, size_t n)
+{
+	unsigned	 h = 2166136261u;
+
+	while (n-- > 0) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/*
+ * Is c a character of a variable name? first is set for the first
+ * character, which cannot be a digit.
+ */
+static int
+var_char(int c, int first)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	    c == '_' || (!first && c >= '0' && c <= '9');
+}
+
+/*
+ * Is the n byte string s a valid variable name?
+ */
+static int
+var_valid(const char *s, size_t n)
+{
+	size_t	 i;
+
+	for (i = 0; i < n; i++) {
+		if (!var_char((unsigned char)s[i], i == 0)) {
+			return 0;
+		}
+	}
+
+	return n > 0;
+}
+
+/*
+ * qsort(3) order of "name=value" strings, by name.
+ */
+static int
+var_cmp(const void *a, const void *b)
+{
+	const char	*s = *(char *const *)a;
+	const char	*t = *(char *const *)b;
+
+	while (*s == *t && *s != '=' && *s != '\0') {
+		s++;
+		t++;
+	}
+
+	return (*s == '=' ? 0 : (unsigned char)*s) -
+	    (*t == '=' ? 0 : (unsigned char)*t);
+}
+
+/*
+ * Find the slot of the variable with the n byte name s: the slot it
+ * is in, or the empty slot that ends its probe sequence.
+ */
+static struct var *
+var_slot(const char *s, size_t n)
+{
+	struct var	*v;
+	unsigned	 h = var_hash(s, n);
+	size_t		 i;
+
+	for (i = h & (vartab_size - 1); ; i = (i + 1) & (vartab_size - 1)) {
+		v = &vartab[i];
+		if (v->str == NULL || (v->hash == h && v->nlen == n &&
+		    !memcmp(v->str, s, n))) {
+			return v;
+		}
+	}
+}
+
+/*
+ * Return the variable with the n byte name s, or NULL.
+ */
+static struct var *
+var_find(const char *s, size_t n)
+{
+	struct var	*v;
+
+	if (vartab == NULL) {
+		return NULL;
+	}
+	v = var_slot(s, n);
+
+	return v->str != NULL ? v : NULL;
+}
+
+/*
+ * Value of variable name, or NULL if it is not set.
+ */
+static const char *
+var_get(const char *name)
+{
+	struct var	*v;
+
+	if ((v = var_find(name, strlen(name))) == NULL ||
+	    v->str[v->nlen] != '=') {
+		return NULL;
+	}
+
+	return v->str + v->nlen + 1;
+}
+
+/*
+ * Set the variable with the n byte name s to val, or only mark it
+ * exported if val is NULL. With export, it goes into the environment
+ * of commands from now on.
+ */
+static void
+var_set(const char *s, size_t n, const char *val, int export)
+{
+	struct var	*v;
+	char		*str;
+	size_t		 vlen;
+
+	if (2 * (nvars + 1) > vartab_size) {
+		var_grow();
+	}
+
+	v = var_slot(s, n);
+	if (v->str == NULL) {
+		v->hash = var_hash(s, n);
+		v->nlen = n;
+		v->exported = 0;
+		nvars++;
+	}
+
+	/* "name=value", ready to be an environment string. Just "name"
+	 * is a variable that is exported but has no value. A new value
+	 * that fits goes over the old one, so a loop variable set on
+	 * every pass is not reallocated. */
+	if (val != NULL || v->str == NULL) {
+		vlen = val != NULL ? strlen(val) : 0;
+		if (v->str != NULL && n + 1 + vlen + 1 <= v->size) {
+			str = v->str;
+		} else {
+			if ((str = malloc(n + 1 + vlen + 1)) == NULL) {
+				err(1, "malloc");
+			}
+			memcpy(str, s, n);
+			free(v->str);
+			v->str = str;
+			v->size = n + 1 + vlen + 1;
+		}
+		str[n] = '\0';
+		if (val != NULL) {
+			str[n] = '=';
+			memmove(str + n + 1, val, vlen + 1);
+		}
+		if (v->exported) {
+			env_dirty = 1;
+		}
+	}
+
+	if (export && !v->exported) {
+		v->exported = 1;
+		nexported++;
+		env_dirty = 1;
+	}
+}
+
+/*
+ * Remove the variable name, if it is set. The entries after it in
+ * its probe sequence are shifted back, so lookups need no tombstones.
+ */
+static void
+var_unset(const char *name)
+{
+	struct var	*v;
+	size_t		 i;
+	size_t		 j;
+	size_t		 home;
+
+	if ((v = var_find(name, strlen(name))) == NULL) {
+		return;
+	}
+	if (v->exported) {
+		nexported--;
+		env_dirty = 1;
+	}
+	free(v->str);
+	nvars--;
+
+	i = (size_t)(v - vartab);
+	for (j = (i + 1) & (vartab_size - 1); vartab[j].str != NULL;
+	    j = (j + 1) & (vartab_size - 1)) {
+		/* Move j back to i unless its home lies in (i, j]. */
+		home = vartab[j].hash & (vartab_size - 1);
+		if (i <= j ? (home > i && home <= j) : (home > i || home <= j)) {
+			continue;
+		}
+		vartab[i] = vartab[j];
+		i = j;
+	}
+	vartab[i].str = NULL;
+}
+
+/*
+ * Double the variable table, or make its first one.
+ */
+static void
+var_grow(void)
+{
+	struct var	*old = vartab;
+	size_t		 oldsize = vartab_size;
+	size_t		 i;
+	size_t		 j;
+
+	vartab_size = oldsize ? oldsize * 2 : VARTAB_SIZE;
+	if ((vartab = calloc(vartab_size, sizeof(*vartab))) == NULL) {
+		err(1, "calloc");
+	}
+	for (i = 0; i < oldsize; i++) {
+		if (old[i].str == NULL) {
+			continue;
+		}
+		for (j = old[i].hash & (vartab_size - 1); vartab[j].str != NULL;
+		    j = (j + 1) & (vartab_size - 1))
+			;
+		vartab[j] = old[i];
+	}
+	free(old);
+}
+
+/*
+ * Take the variables of the shell's own environment, all exported.
+ */
+static void
+var_init(void)
+{
+	char	**ep;
+	char	 *eq;
+
+	for (ep = environ; *ep != NULL; ep++) {
+		if ((eq = strchr(*ep, '=')) != NULL && eq != *ep) {
+			var_set(*ep, (size_t)(eq - *ep), eq + 1, 1);
+		}
+	}
+}
+
+/*
+ * The environment for commands: the exported variables that are set.
+ * It is only rebuilt after an exported variable has changed, so most
+ * launches pass the same array as the one before.
+ */
+static char **
+var_env(void)
+{
+	size_t	 i;
+	size_t	 n = 0;
+
+	if (!env_dirty) {
+		return envp;
+	}
+
+	if (nexported + 1 > envp_size) {
+		envp_size = nexported + 1;
+		free(envp);
+		if ((envp = malloc(envp_size * sizeof(*envp))) == NULL) {
+			err(1, "malloc");
+		}
+	}
+	for (i = 0; i < vartab_size; i++) {
+		if (vartab[i].str != NULL && vartab[i].exported &&
+		    vartab[i].str[vartab[i].nlen] == '=') {
+			envp[n++] = vartab[i].str;
+		}
+	}
+	envp[n] = NULL;
+	env_dirty = 0;
+
+	return envp;
+}
+
+/*
+ * The environment for a, whose NAME=value prefix assignments go to it
+ * alone. Built in the command arena, as it is only needed once.
+ */
+static char **
+var_env_cmd(struct args *a)
+{
+	char	**base = var_env();
+	char	**ep;
+	char	**v;
+	size_t	  n = 0;
+	size_t	  len;
+	int	  i;
+
+	for (ep = base; *ep != NULL; ep++) {
+		n++;
+	}
+	v = arena_alloc(&cmd_arena,
+	    (n + (size_t)a->nassign + 1) * sizeof(*v));
+	n = 0;
+	for (ep = base; *ep != NULL; ep++) {
+		len = (size_t)(strchr(*ep, '=') - *ep) + 1;
+		for (i = 0; i < a->nassign; i++) {
+			if (!strncmp(*ep, a->assign[i], len)) {
+				break;
+			}
+		}
+		if (i == a->nassign) {
+			v[n++] = *ep;
+		}
+	}
+	for (i = 0; i < a->nassign; i++) {
+		v[n++] = a->assign[i];
+	}
+	v[n] = NULL;
 
-				np = &p;
+	return v;
+}
+
+/*
+ * If word w is an assignment, NAME=value, return the length of NAME,
+ * else 0. A word still to be expanded has the text before its first
+ * expansion quoted with backslashes, by lex_raw().
+ */
+static size_t
+var_assign(const char *w)
+{
+	size_t	 n;
+	int	 raw = w[0] == EXP_MARK;
+
+	w += raw;
+	for (n = 0; ; n++) {
+		if (raw && *w++ != '\\') {
+			return 0;
+		}
+		if (*w == '=') {
+			return n;
+		}
+		if (!var_char((unsigned char)*w++, n == 0)) {
+			return 0;
+		}
+	}
+}
+
+/*
+ * Carry out the assignments of a, a command that has no words other
+ * than assignments, on the shell's variables.
+ */
+static int
+var_assign_run(struct args *a)
+{
+	const char	*s;
+	size_t		 n;
+	int		 i;
+
+	for (i = 0; i < a->nassign; i++) {
+		s = a->assign[i];
+		n = (size_t)(strchr(s, '=') - s);
+		var_set(s, n, s + n + 1, 0);
+	}
+
+	return 0;
+}
+
+/*
+ * export [-p] [name[=value] ...]
+ *
+ * Put variables into the environment of commands run from now on.
+ * With no names, list the exported variables.
+ */
+static int
+export_builtin(struct args *a)
+{
+	const char	*eq;
+	const char	*val;
+	char		**list;
+	size_t		 n = 0;
+	size_t		 i;
+	int		 ret = 0;
+	int		 k = 1;
 
-				return np; 	/* Return the proc struct *. */
+	if (k < a->argc && !strcmp(a->argv[k], "-p")) {
+		k++;
+	}
+	if (k == a->argc) {		/* List them, sorted by name. */
+		list = arena_alloc(&cmd_arena, (nexported + 1) * sizeof(*list));
+		for (i = 0; i < vartab_size; i++) {
+			if (vartab[i].str != NULL && vartab[i].exported) {
+				list[n++] = vartab[i].str;
+			}
+		}
+		qsort(list, n, sizeof(*list), var_cmp);
+		for (i = 0; i < n; i++) {
+			if ((val = strchr(list[i], '=')) == NULL) {
+				out_printf(&bout, "export %s\n", list[i]);
+				continue;
 			}
-		} else {			/* Foreground exec(). */
-			if (pid == 0) {		/* Child. */
-				if (execvp(a->file, a->argv) == -1) {
-					warnx("%s: not found", a->file);
+			out_printf(&bout, "export %.*s='", (int)(val - list[i]),
+			    list[i]);
+			for (val++; *val != '\0'; val++) {
+				if (*val == '\'') {
+					out_puts(&bout, "'\\''");
+				} else {
+					out_putc(&bout, *val);
 				}
-				_exit(127);	/* 127 for cmd not found. */
-			} else {		/* Parent. */
-				wait(NULL);	/* Block for child. */
+			}
+			out_puts(&bout, "'\n");
+		}
+		return stdout_status();
+	}
+
+	for (; k < a->argc; k++) {
+		eq = strchrnul(a->argv[k], '=');
+		n = (size_t)(eq - a->argv[k]);
+		if (!var_valid(a->argv[k], n)) {
+			warnx("%s: %s: not a valid name", a->argv[0],
+			    a->argv[k]);
+			ret = 1;
+			continue;
+		}
+		var_set(a->argv[k], n, *eq == '=' ? eq + 1 : NULL, 1);
+	}
+
+	return ret;
+}
+
+/*
+ * unset [-v] name ...
+ *
+ * Remove shell variables, and from the environment if exported.
+ */
+static int
+unset_builtin(struct args *a)
+{
+	int	 ret = 0;
+	int	 k = 1;
+
+	if (k < a->argc && !strcmp(a->argv[k], "-v")) {
+		k++;
+	}
+	for (; k < a->argc; k++) {
+		if (!var_valid(a->argv[k], strlen(a->argv[k]))) {
+			warnx("%s: %s: not a valid name", a->argv[0],
+			    a->argv[k]);
+			ret = 1;
+			continue;
+		}
+		var_unset(a->argv[k]);
+	}
+
+	return ret;
+}
+
+/*
+ * Add a background job for the n processes of pids, whose command
+ * text is the len bytes of cmd. Each process gets a pidfd in the epoll
+ * set, so finished ones can be found without polling every job.
+ */
+static void
+bg_add(const char *cmd, size_t len, const pid_t *pids, int n)
+{
+	struct job		*j;
+	struct jproc		*jp;
+	struct epoll_event	 ev;
+	int			 last;
+	int			 i;
 
-				return NULL;	/* Nothing to send back. */
+	/* The job is whatever processes started, if any did. */
+	for (last = n - 1; last >= 0 && pids[last] <= 0; last--)
+		;
+	if (last < 0) {
+		return;
+	}
+
+	/* Job records outlive the command arena, so come from pools. */
+	j = pool_get(&job_pool);
+	if ((j->cmd = malloc(len + 1)) == NULL) {
+		err(1, "malloc");
+	}
+	memcpy(j->cmd, cmd, len);
+	j->cmd[len] = '\0';
+
+	if (bg_epfd == -1 &&
+	    (bg_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		warn("epoll_create1");	/* Reaped by waitpid(2) instead. */
+	}
+
+	for (i = last; i >= 0; i--) {
+		if (pids[i] <= 0) {		/* Stage never started. */
+			continue;
+		}
+		jp = pool_get(&jproc_pool);
+		jp->jnext = j->procs;
+		j->procs = jp;
+		j->nprocs++;
+		jp->job = j;
+		jp->pid = pids[i];
+		/*
+		 * With no pidfd support, once pidfds have filled the
+		 * descriptor table, or on any other failure, the process
+		 * is reaped by waitpid(2). Only the unexpected is told.
+		 */
+		if (bg_epfd == -1) {
+			jp->pidfd = -1;
+		} else if ((jp->pidfd = pidfd_open(jp->pid, 0)) == -1) {
+			if (errno != ENOSYS && errno != EMFILE &&
+			    errno != ENFILE) {
+				warn("pidfd_open");
+			}
+		} else {
+			ev.events = EPOLLIN;
+			ev.data.ptr = jp;
+			if (epoll_ctl(bg_epfd, EPOLL_CTL_ADD, jp->pidfd,
+			    &ev) == -1) {
+				if (errno != ENOMEM && errno != ENOSPC) {
+					warn("epoll_ctl");
+				}
+				close(jp->pidfd);
+				jp->pidfd = -1;
 			}
 		}
+		if (jp->pidfd == -1) {
+			bgnopidfd++;
+		}
+		bg_hash_insert(jp);
+	}
+	j->nlive = j->nprocs;
+	j->pid = pids[last];
+
+	/* Add to end of list, so bglist shows jobs in launch order. */
+	j->next = NULL;
+	j->prev = bgtail;
+	if (bgtail == NULL) {
+		bghead = j;
+	} else {
+		bgtail->next = j;
 	}
+	bgtail = j;
+	bgcnt++;
 
-	return NULL;		/* XXX To satiate the compiler. */
+	bg_print(j, NULL);
 }
 
-#if 0
+/*
+ * Add the command text of n, for bglist, to c: its words as they were
+ * written, with compound commands cut short.
+ */
 static void
-proc_free(struct proc **np)
+node_text(struct capture *c, const struct node *n)
 {
-	struct proc	*p = *np;
-	args_free(&p->a);
-	p->a = NULL;
-	free(p);
+	switch (n->type) {
+	case N_PIPE:
+		pipe_text(c, n->pl);
+		break;
+	case N_AND:
+	case N_OR:
+		node_text(c, n->left);
+		capture_add(c, n->type == N_AND ? " &&" : " ||", 3);
+		node_text(c, n->right);
+		break;
+	case N_NOT:
+		capture_add(c, " !", 2);
+		node_text(c, n->left);
+		break;
+	case N_IF:
+		capture_add(c, " if ...; fi", 11);
+		break;
+	case N_WHILE:
+		capture_add(c, " while ...; done", 16);
+		break;
+	case N_UNTIL:
+		capture_add(c, " until ...; done", 16);
+		break;
+	case N_FOR:
+		capture_add(c, " for ", 5);
+		capture_add(c, n->var, strlen(n->var));
+		capture_add(c, " ...; done", 10);
+		break;
+	case N_CASE:
+		capture_add(c, " case", 5);
+		word_text(c, n->words[0]);
+		capture_add(c, " in ... esac", 12);
+		break;
+	case N_BG:
+		node_text(c, n->left);
+		break;
+	}
 }
-#endif
 
-#if 0 /*XXX*/
+/*
+ * Add the words of pipeline pl to c, each after a blank, with " |"
+ * between its commands.
+ */
 static void
-bg_add(struct proc **np)
+pipe_text(struct capture *c, const struct pipeline *pl)
 {
-	struct proc	*p = *np;
+	int	 i;
+	int	 k;
+
+	for (i = 0; i < pl->ncmds; i++) {
+		if (i > 0) {
+			capture_add(c, " |", 2);
+		}
+		for (k = 0; k < pl->cmds[i].argc; k++) {
+			word_text(c, pl->cmds[i].argv[k]);
+		}
+	}
+}
 
-	if (bghead == NULL) {	/* Add first item in list. */
-		bghead = p;
-	} else {		/* Add to front of list. */
-		p->next = bghead;
-		bghead = p;
+/*
+ * Add a blank and word w to c. A word still to be expanded is shown
+ * without the backslashes lex_raw() put before its first expansion.
+ */
+static void
+word_text(struct capture *c, const char *w)
+{
+	capture_add(c, " ", 1);
+	if (*w == EXP_MARK) {
+		for (w++; w[0] == '\\' && w[1] != '\0'; w += 2) {
+			capture_add(c, w + 1, 1);
+		}
 	}
-	bg_print(&p, NULL);
+	capture_add(c, w, strlen(w));
 }
 
 /*
@@ -441,19 +7526,23 @@ bg_add(struct proc **np)
  * a supplied string s.
  */
 static void
-bg_print(struct proc **np, char *s)
+bg_print(struct job *j, const char *s)
 {
-	int		 i;
-	struct proc	*p = *np;
+	out_printf(&bout, "%d:%s%s\n", j->pid, j->cmd,
+	    s != NULL ? s : "");
+}
 
-	printf("%d:", p->pid);
-	for (i = 0; i < p->a->argc; i++) {
-		printf(" %s", p->a->argv[i]);
-	}
-	if (s != NULL) {
-		printf("%s", s);
-	}
-	printf("\n");
+/*
+ * bglist
+ */
+static int
+bglist_builtin(struct args *a)
+{
+	(void)a;
+
+	bg_list();
+
+	return 0;
 }
 
 /*
@@ -462,33 +7551,69 @@ bg_print(struct proc **np, char *s)
 static void
 bg_list(void)
 {
-	struct proc	*p;
-	int		 jobcnt = 0;
+	struct job	*j;
+
+	for (j = bghead; j != NULL; j = j->next) {
+		bg_print(j, NULL);
+	}
+	out_printf(&bout, "Total Background Jobs:\t%zu\n", bgcnt);
+}
+
+/*
+ * Insert jp into the pid hash, doubling the table as it fills up so
+ * that chains stay short however many jobs are running.
+ */
+static void
+bg_hash_insert(struct jproc *jp)
+{
+	struct jproc	**tab;
+	struct jproc	 *p;
+	struct jproc	 *next;
+	size_t		  size;
+	size_t		  i;
+	size_t		  h;
 
-	for (p = bghead; p != NULL; p = p->next) {
-		bg_print(&p, NULL);
-		jobcnt++;
+	if (bgnprocs >= bgtab_size) {
+		size = bgtab_size ? bgtab_size * 2 : BGTAB_SIZE;
+		if ((tab = calloc(size, sizeof(*tab))) == NULL) {
+			err(1, "calloc");
+		}
+		for (i = 0; i < bgtab_size; i++) {
+			for (p = bgtab[i]; p != NULL; p = next) {
+				next = p->hnext;
+				h = (size_t)p->pid & (size - 1);
+				p->hnext = tab[h];
+				tab[h] = p;
+			}
+		}
+		free(bgtab);
+		bgtab = tab;
+		bgtab_size = size;
 	}
-	printf("Total Background Jobs:\t%d\n", jobcnt);
+
+	h = (size_t)jp->pid & (bgtab_size - 1);
+	jp->hnext = bgtab[h];
+	bgtab[h] = jp;
+	bgnprocs++;
 }
 
 /*
  * Find a background process by its pid and return a pointer to it.
  */
-struct proc **
+static struct jproc *
 bg_find(pid_t pid)
 {
-	struct proc	**np = &bghead;
-	struct proc	 *p;
+	struct jproc	*jp;
 
-	if (np == NULL) {
+	if (bgtab_size == 0) {
 		return NULL;
 	}
 
-	for (p = *np; p != NULL; p = p->next) {
-		if (p->pid == pid) {
+	for (jp = bgtab[(size_t)pid & (bgtab_size - 1)]; jp != NULL;
+	    jp = jp->hnext) {
+		if (jp->pid == pid) {
 			/* Found the struct with pid 'pid'. */
-			return np;
+			return jp;
 		}
 	}
 
@@ -497,67 +7622,495 @@ bg_find(pid_t pid)
 }
 
 /*
- * Best effort to remove process identified by struct proc * from the
- * global background processes list.
- *
- * Note: No error code is returned if the process is not found.
+ * Mark background process jp as reaped. Once every stage of its job
+ * has finished, the job is announced and removed from the bglist.
  */
 static void
-bg_remove(struct proc **np)
+bg_done(struct jproc *jp)
 {
-	struct proc	*prev = NULL;
-	struct proc	*curr = bghead;;
-	struct proc	*p = *np;
+	struct jproc	**pp;
+	struct job	 *j = jp->job;
 
-	/* Nothing to remove. */
-	if (p == NULL) {
-		return;
+	if (jp->pidfd != -1) {
+		/* Closing a pidfd may not take it out of the set. */
+		(void)epoll_ctl(bg_epfd, EPOLL_CTL_DEL, jp->pidfd, NULL);
+		close(jp->pidfd);
+		jp->pidfd = -1;
+	} else {
+		bgnopidfd--;
 	}
 
-	/* Remove the head. */
-	if (p == curr) {
-		bg_print(&p, " has terminated.");
-		curr = p->next;
-		free(p);
+	for (pp = &bgtab[(size_t)jp->pid & (bgtab_size - 1)]; *pp != NULL;
+	    pp = &(*pp)->hnext) {
+		if (*pp == jp) {
+			*pp = jp->hnext;
+			bgnprocs--;
+			break;
+		}
+	}
+
+	if (--j->nlive == 0) {
+		bg_print(j, " has terminated.");
+		bg_remove(j);
+	}
+}
+
+/*
+ * Unlink job j from the bglist and free it.
+ */
+static void
+bg_remove(struct job *j)
+{
+	if (j->prev == NULL) {
+		bghead = j->next;
+	} else {
+		j->prev->next = j->next;
+	}
+	if (j->next == NULL) {
+		bgtail = j->prev;
+	} else {
+		j->next->prev = j->prev;
+	}
+	bgcnt--;
+
+	bg_job_free(j);
+}
+
+/*
+ * Return job j and its process records to their pools.
+ */
+static void
+bg_job_free(struct job *j)
+{
+	struct jproc	*jp;
+	struct jproc	*next;
+
+	for (jp = j->procs; jp != NULL; jp = next) {
+		next = jp->jnext;
+		if (jp->pidfd != -1) {
+			close(jp->pidfd);
+		}
+		pool_put(&jproc_pool, jp);
+	}
+	free(j->cmd);
+	pool_put(&job_pool, j);
+}
+
+/*
+ * Reap background processes that have finished. The epoll set only
+ * reports pidfds of exited children, so this costs one syscall when
+ * nothing has happened and O(1) per finished process otherwise.
+ * Processes without a pidfd are found by waitpid(2) and the pid hash.
+ * If block is set, sleep until at least one process finishes: in
+ * epoll_wait(2) if every process has a pidfd, else in waitpid(2),
+ * which also sees those that have one.
+ */
+static void
+bg_reap(int block)
+{
+	struct epoll_event	 evs[BG_EVENTS];
+	struct jproc		*jp;
+	pid_t			 pid;
+	int			 epblock = block && bgnopidfd == 0;
+	int			 reaped = 0;
+	int			 n;
+	int			 i;
+
+	if (bgcnt == 0) {
 		return;
 	}
 
-	while (curr != NULL) {
-		if (p == curr) {
-			bg_print(&p, " has terminated.");
-			if (curr->next == NULL) {
-				/* Remove the tail. */
-				prev->next = NULL;
-				free(curr);
-			} else {
-				/* Remove in the middle. */
-				prev->next = curr->next;
-				free(curr);
+	do {
+		n = bg_epfd == -1 ? 0 :
+		    epoll_wait(bg_epfd, evs, BG_EVENTS, epblock ? -1 : 0);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
 			}
-			return;
+			err(1, "epoll_wait");
+		}
+		for (i = 0; i < n; i++) {
+			jp = evs[i].data.ptr;
+			if (waitpid(jp->pid, NULL, WNOHANG) != 0) {
+				bg_done(jp);
+				reaped++;
+			}
+		}
+		epblock = 0;
+	} while (n == BG_EVENTS);
+
+	/* Processes without a pidfd. */
+	while (bgnopidfd > 0 && (pid = waitpid(-1, NULL,
+	    block && reaped == 0 ? 0 : WNOHANG)) > 0) {
+		if ((jp = bg_find(pid)) != NULL) {
+			bg_done(jp);
+			reaped++;
+		}
+	}
+}
+
+/*
+ * wait [pid ...]
+ *
+ * Wait for the given background processes, or for every background
+ * job if no pids are given.
+ */
+static int
+wait_builtin(struct args *a)
+{
+	struct jproc	*jp;
+	char		*ep;
+	long		 pid;
+	int		 status;
+	int		 ret = 0;
+	int		 i;
+
+	if (a->argc == 1) {
+		while (bgcnt > 0) {
+			bg_reap(1);
+		}
+		return 0;
+	}
+
+	for (i = 1; i < a->argc; i++) {
+		errno = 0;
+		pid = strtol(a->argv[i], &ep, 10);
+		if (a->argv[i][0] == '\0' || *ep != '\0' || errno != 0 ||
+		    pid <= 0 || (jp = bg_find((pid_t)pid)) == NULL) {
+			warnx("%s: %s: no such job", a->argv[0], a->argv[i]);
+			ret = 127;
+			continue;
+		}
+		while (waitpid(jp->pid, &status, 0) == -1) {
+			if (errno != EINTR) {
+				status = 0;
+				break;
+			}
+		}
+		ret = status_code(status);
+		bg_done(jp);
+	}
+
+	return ret;
+}
+
+/*
+ * parallel [-j jobs] command [arg ...] [::: item ...]
+ *
+ * Run command once per work item, with at most jobs children running
+ * at a time; jobs defaults to the number of online CPUs. Items come
+ * from after ':::', or one per line from stdin. An argument of '{}'
+ * is replaced by the item; otherwise the item is appended.
+ * Children are reaped through their pidfds as they finish, and each
+ * item's exit status is reported on stderr, followed by throughput.
+ * Returns 0 if every item succeeded, 1 otherwise.
+ */
+static int
+parallel_builtin(struct args *a)
+{
+	struct pslot {
+		pid_t		 pid;		/* Child running the item. */
+		int		 pidfd;		/* Its pidfd, or -1. */
+		const char	*item;		/* Work item. */
+	}			*slots;
+	struct pslot		*sl;
+	struct epoll_event	 evs[BG_EVENTS];
+	struct timespec		 t0, t1;
+	struct args		 ca =	/* One item. */
+				    { NULL, NULL, 0, NULL, 0, NULL, 0 };
+	char			**items;	/* Work queue. */
+	char			*inbuf = NULL;	/* Items read from stdin. */
+	int			*freeslots;	/* Stack of idle slots. */
+	int			 nfree;
+	long			 njobs;
+	int			 cmdidx = 1;	/* First word of command. */
+	int			 cmdargc;
+	int			 nitems;
+	int			 next;
+	int			 running = 0;
+	int			 failed = 0;
+	int			 epfd;
+	int			 status;
+	int			 n;
+	int			 i;
+	int			 k;
+	int			 subst;
+	const char		*s;
+	char			*ep;
+	double			 secs;
+
+	njobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (a->argc > 1 && !strncmp(a->argv[1], "-j", 2)) {
+		s = a->argv[1] + 2;
+		cmdidx = 2;
+		if (*s == '\0' && a->argc > 2) {
+			s = a->argv[2];
+			cmdidx = 3;
+		}
+		errno = 0;
+		njobs = strtol(s, &ep, 10);
+		if (*s == '\0' || *ep != '\0' || errno != 0 || njobs <= 0 ||
+		    njobs > PARALLEL_MAX) {
+			warnx("%s: %s: job count not in 1-%d", a->argv[0], s,
+			    PARALLEL_MAX);
+			warnx("usage: %s [-j jobs] command [arg ...] "
+			    "[::: item ...]", a->argv[0]);
+			return 1;
+		}
+	}
+	if (njobs < 1) {
+		njobs = 1;
+	}
+
+	/* Split argv into the command and the ':::' items. */
+	for (k = cmdidx; k < a->argc && strcmp(a->argv[k], ":::"); k++) {
+		continue;
+	}
+	cmdargc = k - cmdidx;
+	if (cmdargc == 0) {
+		warnx("%s: missing command argument", a->argv[0]);
+		return 1;
+	}
+	if (k < a->argc) {
+		items = &a->argv[k + 1];
+		nitems = a->argc - k - 1;
+	} else {
+		nitems = parallel_read(STDIN_FILENO, &inbuf, &items);
+	}
+	if (njobs > nitems) {		/* No more slots than items. */
+		njobs = nitems > 0 ? nitems : 1;
+	}
+
+	slots = arena_alloc(&cmd_arena, (size_t)njobs * sizeof(*slots));
+	freeslots = arena_alloc(&cmd_arena,
+	    (size_t)njobs * sizeof(*freeslots));
+	ca.argv = arena_alloc(&cmd_arena,
+	    ((size_t)cmdargc + 2) * sizeof(*ca.argv));
+	for (nfree = 0; nfree < njobs; nfree++) {
+		freeslots[nfree] = (int)njobs - nfree - 1;
+	}
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		err(1, "epoll_create1");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (next = 0; next < nitems || running > 0;) {
+		/* Fill every idle slot from the work queue. */
+		while (nfree > 0 && next < nitems) {
+			sl = &slots[freeslots[nfree - 1]];
+			sl->item = items[next++];
+			subst = 0;
+			for (i = 0; i < cmdargc; i++) {
+				ca.argv[i] = a->argv[cmdidx + i];
+				if (!strcmp(ca.argv[i], "{}")) {
+					ca.argv[i] =
+					    (char *)(uintptr_t)sl->item;
+					subst = 1;
+				}
+			}
+			ca.argc = cmdargc;
+			if (!subst) {
+				ca.argv[ca.argc++] =
+				    (char *)(uintptr_t)sl->item;
+			}
+			ca.argv[ca.argc] = NULL;
+			ca.file = ca.argv[0];
+
+			sl->pid = fflag ? proc_fork(&ca, -1, -1) :
+			    proc_spawn(&ca, -1, -1);
+			if (sl->pid == -1) {
+				fprintf(stderr, "%s: exit %d\n", sl->item, 127);
+				failed++;
+				continue;
+			}
+			if ((sl->pidfd = pidfd_open(sl->pid, 0)) == -1) {
+				/* No pidfds: this item runs to completion. */
+				while (waitpid(sl->pid, &status, 0) == -1 &&
+				    errno == EINTR) {
+					continue;
+				}
+				fprintf(stderr, "%s: exit %d\n", sl->item,
+				    status_code(status));
+				failed += status != 0;
+				continue;
+			}
+			evs[0].events = EPOLLIN;
+			evs[0].data.u32 = (uint32_t)freeslots[--nfree];
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, sl->pidfd,
+			    &evs[0]) == -1) {
+				err(1, "epoll_ctl");
+			}
+			running++;
+		}
+		if (running == 0) {
+			continue;
+		}
+
+		/* Reap whichever children have finished. */
+		if ((n = epoll_wait(epfd, evs, BG_EVENTS, -1)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(1, "epoll_wait");
+		}
+		for (i = 0; i < n; i++) {
+			sl = &slots[evs[i].data.u32];
+			while (waitpid(sl->pid, &status, 0) == -1) {
+				if (errno != EINTR) {
+					status = 0;
+					break;
+				}
+			}
+			/* Closing a pidfd may not take it out of the set. */
+			(void)epoll_ctl(epfd, EPOLL_CTL_DEL, sl->pidfd, NULL);
+			close(sl->pidfd);
+			fprintf(stderr, "%s: exit %d\n", sl->item,
+			    status_code(status));
+			failed += status != 0;
+			freeslots[nfree++] = (int)evs[i].data.u32;
+			running--;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	secs = (double)(t1.tv_sec - t0.tv_sec) +
+	    (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fprintf(stderr, "%s: %d items, %d failed, %ld jobs, %.3f s, "
+	    "%.1f items/s\n", a->argv[0], nitems, failed, njobs, secs,
+	    secs > 0 ? nitems / secs : 0.0);
+
+	close(epfd);
+	if (inbuf != NULL) {
+		free(inbuf);
+		free(items);
+	}
+
+	return failed > 0;
+}
+
+/*
+ * Read all of fd into *bufp and split it into one item per line.
+ * Blank lines are skipped. Returns the number of items in *itemsp.
+ */
+static int
+parallel_read(int fd, char **bufp, char ***itemsp)
+{
+	char		*buf = NULL;
+	char		**items;
+	char		*p;
+	char		*nl;
+	size_t		 len = 0;
+	size_t		 size = 0;
+	ssize_t		 n;
+	int		 nitems = 0;
+	int		 i;
+
+	for (;;) {
+		if (size - len < 65536) {
+			size = size ? size * 2 : 65536;
+			if ((buf = realloc(buf, size + 1)) == NULL) {
+				err(1, "realloc");
+			}
+		}
+		if ((n = read(fd, buf + len, size - len)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			warn("read");
+			break;
+		}
+		if (n == 0) {
+			break;
+		}
+		len += (size_t)n;
+	}
+	if (buf == NULL) {
+		*bufp = NULL;
+		*itemsp = NULL;
+		return 0;
+	}
+	buf[len] = '\0';
+
+	for (p = buf; (p = memchr(p, '\n', len - (size_t)(p - buf))); p++) {
+		nitems++;
+	}
+	if ((items = calloc((size_t)nitems + 1, sizeof(*items))) == NULL) {
+		err(1, "calloc");
+	}
+
+	i = 0;
+	for (p = buf; p < buf + len; p = nl + 1) {
+		if ((nl = memchr(p, '\n', len - (size_t)(p - buf))) == NULL) {
+			nl = buf + len;
+		}
+		*nl = '\0';
+		if (*p != '\0') {
+			items[i++] = p;
 		}
-		prev = curr;
-		curr = curr->next;
 	}
+
+	*bufp = buf;
+	*itemsp = items;
+	return i;
 }
 
 /*
  * Free the entire background processes list, but don't kill them.
  */
 static void
-bg_free(struct proc *p)
+bg_free(void)
 {
-	p++;		/* XXX */
+	struct job	*j;
+	struct job	*next;
+
+	for (j = bghead; j != NULL; j = next) {
+		next = j->next;
+		bg_job_free(j);
+	}
+	bghead = bgtail = NULL;
+	bgcnt = 0;
+	bgnprocs = 0;
+	bgnopidfd = 0;
+	free(bgtab);
+	bgtab = NULL;
+	bgtab_size = 0;
+}
+
+/*
+ * In a forked child, let go of the shell's background jobs. They are
+ * not its children, and the epoll set is shared with the shell, so it
+ * is closed without taking anything out of it.
+ */
+static void
+bg_forget(void)
+{
+	bg_free();
+	if (bg_epfd != -1) {
+		close(bg_epfd);
+		bg_epfd = -1;
+	}
 }
 
-#endif /*XXX*/
+/*
+ * Convert a wait(2) status into a shell exit status.
+ */
+static int
+status_code(int status)
+{
+	if (WIFSIGNALED(status)) {
+		return 128 + WTERMSIG(status);
+	}
+
+	return WEXITSTATUS(status);
+}
 
 static void
 usage(void)
 {
 	extern char	*__progname;
 
-	(void)fprintf(stderr, "usage: %s\n", __progname);
+	(void)fprintf(stderr, "usage: %s [-fn] [-c command | file]\n",
+	    __progname);
 
 	exit(1);
 }